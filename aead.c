@@ -0,0 +1,659 @@
+#include "aead.h"
+
+#include <stdio.h>
+#include <string.h>
+#ifdef __linux__
+#include <sys/random.h>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define AEAD_X86
+#include <immintrin.h>
+#endif
+
+//64-bit Poly1305 limbs need 128-bit products, otherwise 26-bit limbs with 64-bit products
+#ifdef __SIZEOF_INT128__
+#define POLY1305_64
+#define POLY1305_HIBIT ((uint64_t) 1 << 40)
+__extension__ typedef unsigned __int128 uint128_t;
+#else
+#define POLY1305_HIBIT ((uint64_t) 1 << 24)
+#endif
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+//ChaCha quarter round on words a, b, c, d of x
+#define QUARTER_ROUND(x, a, b, c, d)                                                           \
+    do {                                                                                       \
+        x[a] += x[b];                                                                          \
+        x[d] = ROTL32(x[d] ^ x[a], 16);                                                        \
+        x[c] += x[d];                                                                          \
+        x[b] = ROTL32(x[b] ^ x[c], 12);                                                        \
+        x[a] += x[b];                                                                          \
+        x[d] = ROTL32(x[d] ^ x[a], 8);                                                         \
+        x[c] += x[d];                                                                          \
+        x[b] = ROTL32(x[b] ^ x[c], 7);                                                         \
+    } while (0)
+
+//Poly1305 state: accumulator h and key r in 44/44/42-bit or 26-bit limbs, s the final addend
+typedef struct {
+#ifdef POLY1305_64
+    uint64_t r[3], h[3];
+#else
+    uint32_t r[5], h[5];
+#endif
+    uint8_t s[16];
+} poly1305;
+
+//Encrypts blocks consecutive 64 byte blocks from counter on: out = in ^ key stream
+typedef struct {
+    uint32_t blocks;
+    void (*run)(uint8_t *out, const uint8_t *in, const uint32_t *state, uint32_t counter);
+} chacha20_wide;
+
+//Helper functions not in header file
+uint32_t load32(const uint8_t *p);
+void store32(uint8_t *p, uint32_t v);
+uint64_t load64(const uint8_t *p);
+void store64(uint8_t *p, uint64_t v);
+void chacha20_block(uint8_t *out, const uint32_t *state, uint32_t counter);
+chacha20_wide chacha20_pick(void);
+#ifdef AEAD_X86
+void chacha20_xor8_avx2(uint8_t *out, const uint8_t *in, const uint32_t *state, uint32_t counter);
+void chacha20_xor16_avx512(
+    uint8_t *out, const uint8_t *in, const uint32_t *state, uint32_t counter);
+#endif
+void chacha20_init(uint32_t *state, const uint8_t *key, const uint8_t *nonce);
+void chacha20_xor(uint8_t *out, const uint8_t *in, size_t len, const uint32_t *state,
+    uint32_t counter);
+void poly1305_init(poly1305 *p, const uint8_t *key);
+void poly1305_blocks(poly1305 *p, const uint8_t *m, size_t len, uint64_t hibit);
+void poly1305_padded(poly1305 *p, const uint8_t *m, size_t len);
+void poly1305_finish(poly1305 *p, uint8_t *tag);
+void aead_tag(uint8_t *tag, const uint8_t *ct, size_t len, const uint8_t *aad, size_t aad_len,
+    const uint32_t *state);
+
+uint32_t load32(const uint8_t *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16)
+           | ((uint32_t) p[3] << 24);
+}
+
+void store32(uint8_t *p, uint32_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+    p[2] = (uint8_t) (v >> 16);
+    p[3] = (uint8_t) (v >> 24);
+    return;
+}
+
+uint64_t load64(const uint8_t *p) {
+    return (uint64_t) load32(p) | ((uint64_t) load32(p + 4) << 32);
+}
+
+void store64(uint8_t *p, uint64_t v) {
+    store32(p, (uint32_t) v);
+    store32(p + 4, (uint32_t) (v >> 32));
+    return;
+}
+
+/*
+    Sets up the ChaCha20 state for key and nonce, leaving the block counter (word 12) 0.
+*/
+void chacha20_init(uint32_t *state, const uint8_t *key, const uint8_t *nonce) {
+    state[0] = 0x61707865; //"expand 32-byte k"
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++) {
+        state[4 + i] = load32(key + 4 * i);
+    }
+    state[12] = 0;
+    for (int i = 0; i < 3; i++) {
+        state[13 + i] = load32(nonce + 4 * i);
+    }
+    return;
+}
+
+/*
+    Writes the 64 byte key stream block number counter.
+*/
+void chacha20_block(uint8_t *out, const uint32_t *state, uint32_t counter) {
+    uint32_t x[16];
+    memcpy(x, state, sizeof(x));
+    x[12] = counter;
+    for (int i = 0; i < 10; i++) {
+        QUARTER_ROUND(x, 0, 4, 8, 12);
+        QUARTER_ROUND(x, 1, 5, 9, 13);
+        QUARTER_ROUND(x, 2, 6, 10, 14);
+        QUARTER_ROUND(x, 3, 7, 11, 15);
+        QUARTER_ROUND(x, 0, 5, 10, 15);
+        QUARTER_ROUND(x, 1, 6, 11, 12);
+        QUARTER_ROUND(x, 2, 7, 8, 13);
+        QUARTER_ROUND(x, 3, 4, 9, 14);
+    }
+    for (int i = 0; i < 16; i++) {
+        store32(out + 4 * i, x[i] + (i == 12 ? counter : state[i]));
+    }
+    return;
+}
+
+#ifdef AEAD_X86
+/*
+    Encrypts 8 blocks from counter on. Each vector holds one state word of all 8 blocks,
+    so the rounds run on 8 blocks at once and only the key stream is transposed.
+*/
+__attribute__((target("avx2"))) void chacha20_xor8_avx2(
+    uint8_t *out, const uint8_t *in, const uint32_t *state, uint32_t counter) {
+    __m256i x[16], start[16];
+    for (int i = 0; i < 16; i++) {
+        start[i] = _mm256_set1_epi32((int) state[i]);
+    }
+    start[12] = _mm256_add_epi32(
+        _mm256_set1_epi32((int) counter), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+    for (int i = 0; i < 16; i++) {
+        x[i] = start[i];
+    }
+
+#define ROTL256(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+#define QUARTER_ROUND256(a, b, c, d)                                                           \
+    do {                                                                                       \
+        x[a] = _mm256_add_epi32(x[a], x[b]);                                                   \
+        x[d] = ROTL256(_mm256_xor_si256(x[d], x[a]), 16);                                      \
+        x[c] = _mm256_add_epi32(x[c], x[d]);                                                   \
+        x[b] = ROTL256(_mm256_xor_si256(x[b], x[c]), 12);                                      \
+        x[a] = _mm256_add_epi32(x[a], x[b]);                                                   \
+        x[d] = ROTL256(_mm256_xor_si256(x[d], x[a]), 8);                                       \
+        x[c] = _mm256_add_epi32(x[c], x[d]);                                                   \
+        x[b] = ROTL256(_mm256_xor_si256(x[b], x[c]), 7);                                       \
+    } while (0)
+    for (int i = 0; i < 10; i++) {
+        QUARTER_ROUND256(0, 4, 8, 12);
+        QUARTER_ROUND256(1, 5, 9, 13);
+        QUARTER_ROUND256(2, 6, 10, 14);
+        QUARTER_ROUND256(3, 7, 11, 15);
+        QUARTER_ROUND256(0, 5, 10, 15);
+        QUARTER_ROUND256(1, 6, 11, 12);
+        QUARTER_ROUND256(2, 7, 8, 13);
+        QUARTER_ROUND256(3, 4, 9, 14);
+    }
+#undef QUARTER_ROUND256
+#undef ROTL256
+
+    for (int i = 0; i < 16; i++) {
+        x[i] = _mm256_add_epi32(x[i], start[i]);
+    }
+
+    //Transpose each 8 x 8 half: word rows h..h+7 of block b end up in one vector
+    for (int h = 0; h < 16; h += 8) {
+        __m256i t[8], u[8];
+        for (int k = 0; k < 8; k += 2) {
+            t[k] = _mm256_unpacklo_epi32(x[h + k], x[h + k + 1]);
+            t[k + 1] = _mm256_unpackhi_epi32(x[h + k], x[h + k + 1]);
+        }
+        for (int k = 0; k < 8; k += 4) {
+            u[k] = _mm256_unpacklo_epi64(t[k], t[k + 2]);
+            u[k + 1] = _mm256_unpackhi_epi64(t[k], t[k + 2]);
+            u[k + 2] = _mm256_unpacklo_epi64(t[k + 1], t[k + 3]);
+            u[k + 3] = _mm256_unpackhi_epi64(t[k + 1], t[k + 3]);
+        }
+        for (int j = 0; j < 4; j++) {
+            __m256i lo = _mm256_permute2x128_si256(u[j], u[4 + j], 0x20); //Block j
+            __m256i hi = _mm256_permute2x128_si256(u[j], u[4 + j], 0x31); //Block 4 + j
+            const __m256i *src_lo = (const __m256i *) (in + 64 * j + 4 * h);
+            const __m256i *src_hi = (const __m256i *) (in + 64 * (4 + j) + 4 * h);
+            _mm256_storeu_si256((__m256i *) (out + 64 * j + 4 * h),
+                _mm256_xor_si256(_mm256_loadu_si256(src_lo), lo));
+            _mm256_storeu_si256((__m256i *) (out + 64 * (4 + j) + 4 * h),
+                _mm256_xor_si256(_mm256_loadu_si256(src_hi), hi));
+        }
+    }
+    return;
+}
+
+/*
+    chacha20_xor8_avx2 on 16 blocks with AVX-512 rotates.
+*/
+__attribute__((target("avx512f"))) void chacha20_xor16_avx512(
+    uint8_t *out, const uint8_t *in, const uint32_t *state, uint32_t counter) {
+    __m512i x[16], start[16];
+    for (int i = 0; i < 16; i++) {
+        start[i] = _mm512_set1_epi32((int) state[i]);
+    }
+    start[12] = _mm512_add_epi32(_mm512_set1_epi32((int) counter),
+        _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+    for (int i = 0; i < 16; i++) {
+        x[i] = start[i];
+    }
+
+#define QUARTER_ROUND512(a, b, c, d)                                                           \
+    do {                                                                                       \
+        x[a] = _mm512_add_epi32(x[a], x[b]);                                                   \
+        x[d] = _mm512_rol_epi32(_mm512_xor_si512(x[d], x[a]), 16);                             \
+        x[c] = _mm512_add_epi32(x[c], x[d]);                                                   \
+        x[b] = _mm512_rol_epi32(_mm512_xor_si512(x[b], x[c]), 12);                             \
+        x[a] = _mm512_add_epi32(x[a], x[b]);                                                   \
+        x[d] = _mm512_rol_epi32(_mm512_xor_si512(x[d], x[a]), 8);                              \
+        x[c] = _mm512_add_epi32(x[c], x[d]);                                                   \
+        x[b] = _mm512_rol_epi32(_mm512_xor_si512(x[b], x[c]), 7);                              \
+    } while (0)
+    for (int i = 0; i < 10; i++) {
+        QUARTER_ROUND512(0, 4, 8, 12);
+        QUARTER_ROUND512(1, 5, 9, 13);
+        QUARTER_ROUND512(2, 6, 10, 14);
+        QUARTER_ROUND512(3, 7, 11, 15);
+        QUARTER_ROUND512(0, 5, 10, 15);
+        QUARTER_ROUND512(1, 6, 11, 12);
+        QUARTER_ROUND512(2, 7, 8, 13);
+        QUARTER_ROUND512(3, 4, 9, 14);
+    }
+#undef QUARTER_ROUND512
+
+    for (int i = 0; i < 16; i++) {
+        x[i] = _mm512_add_epi32(x[i], start[i]);
+    }
+
+    //Transpose the 16 x 16 word matrix so each vector holds one block. After the unpacks
+    //128-bit lane l of u[4k + j] holds words 4k..4k+3 of block 4l + j.
+    __m512i t[16], u[16];
+    for (int k = 0; k < 16; k += 2) {
+        t[k] = _mm512_unpacklo_epi32(x[k], x[k + 1]);
+        t[k + 1] = _mm512_unpackhi_epi32(x[k], x[k + 1]);
+    }
+    for (int k = 0; k < 16; k += 4) {
+        u[k] = _mm512_unpacklo_epi64(t[k], t[k + 2]);
+        u[k + 1] = _mm512_unpackhi_epi64(t[k], t[k + 2]);
+        u[k + 2] = _mm512_unpacklo_epi64(t[k + 1], t[k + 3]);
+        u[k + 3] = _mm512_unpackhi_epi64(t[k + 1], t[k + 3]);
+    }
+    for (int j = 0; j < 4; j++) {
+        __m512i even01 = _mm512_shuffle_i32x4(u[j], u[4 + j], 0x88); //Lanes 0, 2
+        __m512i odd01 = _mm512_shuffle_i32x4(u[j], u[4 + j], 0xdd); //Lanes 1, 3
+        __m512i even23 = _mm512_shuffle_i32x4(u[8 + j], u[12 + j], 0x88);
+        __m512i odd23 = _mm512_shuffle_i32x4(u[8 + j], u[12 + j], 0xdd);
+        __m512i block[4] = {
+            _mm512_shuffle_i32x4(even01, even23, 0x88), //Block j
+            _mm512_shuffle_i32x4(odd01, odd23, 0x88), //Block 4 + j
+            _mm512_shuffle_i32x4(even01, even23, 0xdd), //Block 8 + j
+            _mm512_shuffle_i32x4(odd01, odd23, 0xdd), //Block 12 + j
+        };
+        for (int l = 0; l < 4; l++) {
+            size_t offset = (size_t) 64 * (4 * l + j);
+            __m512i src = _mm512_loadu_si512((const void *) (in + offset));
+            _mm512_storeu_si512((void *) (out + offset), _mm512_xor_si512(src, block[l]));
+        }
+    }
+    return;
+}
+#endif
+
+/*
+    Picks the widest key stream generator this CPU runs, NULL run if there is none.
+*/
+chacha20_wide chacha20_pick(void) {
+    chacha20_wide wide = { 1, NULL };
+#ifdef AEAD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+        wide.blocks = 16;
+        wide.run = chacha20_xor16_avx512;
+    } else if (__builtin_cpu_supports("avx2")) {
+        wide.blocks = 8;
+        wide.run = chacha20_xor8_avx2;
+    }
+#endif
+    return wide;
+}
+
+/*
+    out = in ^ key stream, starting at block counter. Runs of several blocks use the
+    vector key stream generator if the CPU has one.
+*/
+void chacha20_xor(uint8_t *out, const uint8_t *in, size_t len, const uint32_t *state,
+    uint32_t counter) {
+    uint8_t stream[64];
+    chacha20_wide wide = chacha20_pick();
+    size_t wide_bytes = (size_t) wide.blocks * 64;
+    if (wide.run != NULL) {
+        for (; len >= wide_bytes; len -= wide_bytes, in += wide_bytes, out += wide_bytes) {
+            wide.run(out, in, state, counter);
+            counter += wide.blocks;
+        }
+    }
+    for (; len >= 64; len -= 64, in += 64, out += 64) {
+        chacha20_block(stream, state, counter++);
+        for (int i = 0; i < 64; i += 8) {
+            store64(out + i, load64(in + i) ^ load64(stream + i));
+        }
+    }
+    if (len > 0) {
+        chacha20_block(stream, state, counter);
+        for (size_t i = 0; i < len; i++) {
+            out[i] = in[i] ^ stream[i];
+        }
+    }
+    return;
+}
+
+#ifdef POLY1305_64
+/*
+    Clamps r from the first half of the one-time key and keeps s from the second half.
+*/
+void poly1305_init(poly1305 *p, const uint8_t *key) {
+    uint64_t t0 = load64(key);
+    uint64_t t1 = load64(key + 8);
+    p->r[0] = t0 & 0xffc0fffffff;
+    p->r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffff;
+    p->r[2] = (t1 >> 24) & 0x00ffffffc0f;
+    memset(p->h, 0, sizeof(p->h));
+    memcpy(p->s, key + 16, 16);
+    return;
+}
+
+/*
+    Absorbs len bytes (a multiple of 16) of m: h = (h + m + hibit * 2^128) * r % (2^130 - 5).
+    hibit is 2^128 in the top 42-bit limb, 1 << 40. Clamping keeps r1 and r2 multiples
+    of 4, so 2^130 = 5 folds the high products in as (r * 5 / 4) * 2^132 / 4.
+*/
+void poly1305_blocks(poly1305 *p, const uint8_t *m, size_t len, uint64_t hibit) {
+    uint64_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2];
+    uint64_t s1 = r1 * (5 << 2), s2 = r2 * (5 << 2);
+    uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2];
+
+    for (; len >= 16; len -= 16, m += 16) {
+        uint64_t t0 = load64(m);
+        uint64_t t1 = load64(m + 8);
+        h0 += t0 & 0xfffffffffff;
+        h1 += ((t0 >> 44) | (t1 << 20)) & 0xfffffffffff;
+        h2 += ((t1 >> 24) & 0x3ffffffffff) | hibit;
+
+        uint128_t d0 = (uint128_t) h0 * r0 + (uint128_t) h1 * s2 + (uint128_t) h2 * s1;
+        uint128_t d1 = (uint128_t) h0 * r1 + (uint128_t) h1 * r0 + (uint128_t) h2 * s2;
+        uint128_t d2 = (uint128_t) h0 * r2 + (uint128_t) h1 * r1 + (uint128_t) h2 * r0;
+
+        //Partial carry, 2^130 = 5 (mod 2^130 - 5) folds the top carry into h0
+        uint64_t c = (uint64_t) (d0 >> 44);
+        h0 = (uint64_t) d0 & 0xfffffffffff;
+        d1 += c;
+        c = (uint64_t) (d1 >> 44);
+        h1 = (uint64_t) d1 & 0xfffffffffff;
+        d2 += c;
+        c = (uint64_t) (d2 >> 42);
+        h2 = (uint64_t) d2 & 0x3ffffffffff;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= 0xfffffffffff;
+        h1 += c;
+    }
+
+    p->h[0] = h0;
+    p->h[1] = h1;
+    p->h[2] = h2;
+    return;
+}
+
+/*
+    Fully reduces h, adds s and writes the 16 byte tag.
+*/
+void poly1305_finish(poly1305 *p, uint8_t *tag) {
+    uint64_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2];
+
+    uint64_t c = h1 >> 44;
+    h1 &= 0xfffffffffff;
+    for (int i = 0; i < 2; i++) {
+        h2 += c;
+        c = h2 >> 42;
+        h2 &= 0x3ffffffffff;
+        h0 += c * 5;
+        c = h0 >> 44;
+        h0 &= 0xfffffffffff;
+        h1 += c;
+        c = h1 >> 44;
+        h1 &= 0xfffffffffff;
+    }
+    h2 += c;
+
+    //g = h + 5 - 2^130, use it if it is not negative (h >= 2^130 - 5)
+    uint64_t g0 = h0 + 5;
+    c = g0 >> 44;
+    g0 &= 0xfffffffffff;
+    uint64_t g1 = h1 + c;
+    c = g1 >> 44;
+    g1 &= 0xfffffffffff;
+    uint64_t g2 = h2 + c - ((uint64_t) 1 << 42);
+
+    uint64_t mask = (g2 >> 63) - 1; //All ones if g is not negative, branch free
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+
+    //h + s % 2^128
+    uint64_t t0 = load64(p->s);
+    uint64_t t1 = load64(p->s + 8);
+    h0 += t0 & 0xfffffffffff;
+    c = h0 >> 44;
+    h0 &= 0xfffffffffff;
+    h1 += (((t0 >> 44) | (t1 << 20)) & 0xfffffffffff) + c;
+    c = h1 >> 44;
+    h1 &= 0xfffffffffff;
+    h2 += ((t1 >> 24) & 0x3ffffffffff) + c;
+    store64(tag, h0 | (h1 << 44));
+    store64(tag + 8, (h1 >> 20) | (h2 << 24));
+    return;
+}
+
+#else
+/*
+    Clamps r from the first half of the one-time key and keeps s from the second half.
+*/
+void poly1305_init(poly1305 *p, const uint8_t *key) {
+    p->r[0] = load32(key + 0) & 0x3ffffff;
+    p->r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+    p->r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+    p->r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+    p->r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+    memset(p->h, 0, sizeof(p->h));
+    memcpy(p->s, key + 16, 16);
+    return;
+}
+
+/*
+    Absorbs len bytes (a multiple of 16) of m: h = (h + m + hibit * 2^128) * r % (2^130 - 5).
+    Products of 26-bit limbs stay below 2^58 in 64-bit sums.
+*/
+void poly1305_blocks(poly1305 *p, const uint8_t *m, size_t len, uint64_t hibit) {
+    uint32_t r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3], r4 = p->r[4];
+    uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+
+    for (; len >= 16; len -= 16, m += 16) {
+        h0 += load32(m + 0) & 0x3ffffff;
+        h1 += (load32(m + 3) >> 2) & 0x3ffffff;
+        h2 += (load32(m + 6) >> 4) & 0x3ffffff;
+        h3 += (load32(m + 9) >> 6) & 0x3ffffff;
+        h4 += (load32(m + 12) >> 8) | (uint32_t) hibit;
+
+        uint64_t d0 = (uint64_t) h0 * r0 + (uint64_t) h1 * s4 + (uint64_t) h2 * s3
+                      + (uint64_t) h3 * s2 + (uint64_t) h4 * s1;
+        uint64_t d1 = (uint64_t) h0 * r1 + (uint64_t) h1 * r0 + (uint64_t) h2 * s4
+                      + (uint64_t) h3 * s3 + (uint64_t) h4 * s2;
+        uint64_t d2 = (uint64_t) h0 * r2 + (uint64_t) h1 * r1 + (uint64_t) h2 * r0
+                      + (uint64_t) h3 * s4 + (uint64_t) h4 * s3;
+        uint64_t d3 = (uint64_t) h0 * r3 + (uint64_t) h1 * r2 + (uint64_t) h2 * r1
+                      + (uint64_t) h3 * r0 + (uint64_t) h4 * s4;
+        uint64_t d4 = (uint64_t) h0 * r4 + (uint64_t) h1 * r3 + (uint64_t) h2 * r2
+                      + (uint64_t) h3 * r1 + (uint64_t) h4 * r0;
+
+        //Partial carry, 2^130 = 5 (mod 2^130 - 5) folds the top carry into h0
+        uint32_t c = (uint32_t) (d0 >> 26);
+        h0 = (uint32_t) d0 & 0x3ffffff;
+        d1 += c;
+        c = (uint32_t) (d1 >> 26);
+        h1 = (uint32_t) d1 & 0x3ffffff;
+        d2 += c;
+        c = (uint32_t) (d2 >> 26);
+        h2 = (uint32_t) d2 & 0x3ffffff;
+        d3 += c;
+        c = (uint32_t) (d3 >> 26);
+        h3 = (uint32_t) d3 & 0x3ffffff;
+        d4 += c;
+        c = (uint32_t) (d4 >> 26);
+        h4 = (uint32_t) d4 & 0x3ffffff;
+        h0 += c * 5;
+        c = h0 >> 26;
+        h0 &= 0x3ffffff;
+        h1 += c;
+    }
+
+    p->h[0] = h0;
+    p->h[1] = h1;
+    p->h[2] = h2;
+    p->h[3] = h3;
+    p->h[4] = h4;
+    return;
+}
+
+/*
+    Fully reduces h, adds s and writes the 16 byte tag.
+*/
+void poly1305_finish(poly1305 *p, uint8_t *tag) {
+    uint32_t h0 = p->h[0], h1 = p->h[1], h2 = p->h[2], h3 = p->h[3], h4 = p->h[4];
+
+    uint32_t c = h1 >> 26;
+    h1 &= 0x3ffffff;
+    h2 += c;
+    c = h2 >> 26;
+    h2 &= 0x3ffffff;
+    h3 += c;
+    c = h3 >> 26;
+    h3 &= 0x3ffffff;
+    h4 += c;
+    c = h4 >> 26;
+    h4 &= 0x3ffffff;
+    h0 += c * 5;
+    c = h0 >> 26;
+    h0 &= 0x3ffffff;
+    h1 += c;
+
+    //g = h + 5 - 2^130, use it if it is not negative (h >= 2^130 - 5)
+    uint32_t g0 = h0 + 5;
+    c = g0 >> 26;
+    g0 &= 0x3ffffff;
+    uint32_t g1 = h1 + c;
+    c = g1 >> 26;
+    g1 &= 0x3ffffff;
+    uint32_t g2 = h2 + c;
+    c = g2 >> 26;
+    g2 &= 0x3ffffff;
+    uint32_t g3 = h3 + c;
+    c = g3 >> 26;
+    g3 &= 0x3ffffff;
+    uint32_t g4 = h4 + c - (1u << 26);
+
+    uint32_t mask = (g4 >> 31) - 1; //All ones if g is not negative, branch free
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    //h % 2^128 as four 32-bit words, plus s
+    uint32_t w[4] = { h0 | (h1 << 26), (h1 >> 6) | (h2 << 20), (h2 >> 12) | (h3 << 14),
+        (h3 >> 18) | (h4 << 8) };
+    uint64_t f = 0;
+    for (int i = 0; i < 4; i++) {
+        f += (uint64_t) w[i] + load32(p->s + 4 * i);
+        store32(tag + 4 * i, (uint32_t) f);
+        f >>= 32;
+    }
+    return;
+}
+
+#endif
+
+/*
+    Absorbs m zero padded to a multiple of 16 bytes, as the AEAD construction does.
+*/
+void poly1305_padded(poly1305 *p, const uint8_t *m, size_t len) {
+    size_t full = len & ~(size_t) 15;
+    poly1305_blocks(p, m, full, POLY1305_HIBIT);
+    if (len > full) {
+        uint8_t last[16] = { 0 };
+        memcpy(last, m + full, len - full);
+        poly1305_blocks(p, last, 16, POLY1305_HIBIT);
+    }
+    return;
+}
+
+/*
+    Poly1305 over aad and the ciphertext with the one-time key from key stream block 0.
+*/
+void aead_tag(uint8_t *tag, const uint8_t *ct, size_t len, const uint8_t *aad, size_t aad_len,
+    const uint32_t *state) {
+    uint8_t otk[64];
+    chacha20_block(otk, state, 0);
+
+    poly1305 p;
+    poly1305_init(&p, otk);
+    poly1305_padded(&p, aad, aad_len);
+    poly1305_padded(&p, ct, len);
+
+    uint8_t lengths[16];
+    store32(lengths, (uint32_t) aad_len);
+    store32(lengths + 4, (uint32_t) ((uint64_t) aad_len >> 32));
+    store32(lengths + 8, (uint32_t) len);
+    store32(lengths + 12, (uint32_t) ((uint64_t) len >> 32));
+    poly1305_blocks(&p, lengths, 16, POLY1305_HIBIT);
+    poly1305_finish(&p, tag);
+    return;
+}
+
+void aead_seal(uint8_t *out, uint8_t *tag, const uint8_t *in, size_t len, const uint8_t *aad,
+    size_t aad_len, const uint8_t *key, const uint8_t *nonce) {
+    uint32_t state[16];
+    chacha20_init(state, key, nonce);
+    chacha20_xor(out, in, len, state, 1);
+    aead_tag(tag, out, len, aad, aad_len, state);
+    return;
+}
+
+bool aead_open(uint8_t *out, const uint8_t *in, size_t len, const uint8_t *tag,
+    const uint8_t *aad, size_t aad_len, const uint8_t *key, const uint8_t *nonce) {
+    uint32_t state[16];
+    chacha20_init(state, key, nonce);
+
+    uint8_t expected[AEAD_TAG_SIZE];
+    aead_tag(expected, in, len, aad, aad_len, state);
+    uint8_t diff = 0; //Constant time comparison
+    for (int i = 0; i < AEAD_TAG_SIZE; i++) {
+        diff |= expected[i] ^ tag[i];
+    }
+    if (diff != 0) {
+        return false;
+    }
+
+    chacha20_xor(out, in, len, state, 1);
+    return true;
+}
+
+bool aead_random(uint8_t *buf, size_t len) {
+#ifdef __linux__
+    size_t filled = 0;
+    while (filled < len) {
+        ssize_t got = getrandom(buf + filled, len - filled, 0);
+        if (got <= 0) {
+            break;
+        }
+        filled += (size_t) got;
+    }
+    if (filled == len) {
+        return true;
+    }
+#endif
+    FILE *urandom = fopen("/dev/urandom", "rb");
+    if (urandom == NULL) {
+        return false;
+    }
+    size_t got = fread(buf, 1, len, urandom);
+    fclose(urandom);
+    return got == len;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//
+// ChaCha20-Poly1305 authenticated encryption (RFC 8439), used to encrypt the payload
+// of hybrid containers under a session key.
+//
+
+#define AEAD_KEY_SIZE   32
+#define AEAD_NONCE_SIZE 12
+#define AEAD_TAG_SIZE   16
+
+//
+// Encrypts len bytes of in into out and authenticates them together with aad.
+// out may alias in.
+//
+// Provides:
+//  tag: AEAD_TAG_SIZE bytes
+//
+void aead_seal(uint8_t *out, uint8_t *tag, const uint8_t *in, size_t len, const uint8_t *aad,
+    size_t aad_len, const uint8_t *key, const uint8_t *nonce);
+
+//
+// Checks tag over len bytes of in and aad, then decrypts in into out. out may alias in.
+//
+// Returns false, leaving out untouched, if the tag does not match.
+//
+bool aead_open(uint8_t *out, const uint8_t *in, size_t len, const uint8_t *tag,
+    const uint8_t *aad, size_t aad_len, const uint8_t *key, const uint8_t *nonce);
+
+//
+// Fills buf with len bytes from the operating system's random source
+// (getrandom, or /dev/urandom where it is missing). Returns false if neither works.
+//
+bool aead_random(uint8_t *buf, size_t len);
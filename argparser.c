@@ -2,13 +2,22 @@
 
 /*
     Parses and correctly sets arguments for encrypt and decrypt since they share the same command line arguments.
+    Options of the other tool (the formats for decrypt, --range for encrypt) are rejected
+    like unknown ones.
     Returns non-zero argument if failed. 
 */
-int argparser(int argc, char **argv, FILE **input_file, FILE **output_file, FILE **pbfile,
-    bool *verbose, bool *help) {
+int argparser(int argc, char **argv, bool decrypting, FILE **input_file, FILE **output_file,
+    FILE **pbfile, bool *verbose, bool *help, bool *pool_alloc, bool *stats, stats_format *format,
+    FILE **trace_file, const char **batch_path, const char **batch_dir, ss_file_opts *opts) {
+    struct option long_options[]
+        = { STATS_LONG_OPTION, TRACE_LONG_OPTION, RANGE_LONG_OPTION, { NULL, 0, NULL, 0 } };
+    if (!decrypting) {
+        long_options[2] = (struct option) { NULL, 0, NULL, 0 };
+    }
+    const char *options = decrypting ? DECRYPT_OPTIONS : ENCRYPT_OPTIONS;
     int opt = 0;
     bool is_open = false;
-    while ((opt = getopt(argc, argv, OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, options, long_options, NULL)) != -1) {
         switch (opt) {
         case 'i':
             is_open = open_file(input_file, optarg, "r");
@@ -28,6 +37,39 @@ int argparser(int argc, char **argv, FILE **input_file, FILE **output_file, FILE
                 return 3;
             }
             break;
+        case 't':
+            opts->threads = (uint32_t) strtoul(optarg, NULL, 10);
+            if (opts->threads == 0) {
+                printf("Please enter a positive number of threads\n");
+                return 6;
+            }
+            break;
+        case 'x': opts->format = SS_FORMAT_HEX; break;
+        case 'H': opts->format = SS_FORMAT_HYBRID; break;
+        case 'I': opts->format = SS_FORMAT_INDEXED; break;
+        case 'B': *batch_path = optarg; break;
+        case 'O': *batch_dir = optarg; break;
+        case 'm': *pool_alloc = true; break;
+        case 'S':
+            *stats = true;
+            if (!stats_parse_format(optarg, format)) {
+                printf("Please enter text or json for --stats\n");
+                return 7;
+            }
+            break;
+        case 'T':
+            is_open = open_file(trace_file, optarg, "w");
+            if (!is_open) {
+                return 8;
+            }
+            break;
+        case 'R':
+            opts->range = parse_range(optarg, &opts->range_start, &opts->range_len);
+            if (!opts->range) {
+                printf("Please enter --range as start:len in bytes\n");
+                return 9;
+            }
+            break;
         case 'v': *verbose = true; break;
         case 'h': *help = true; return 4;
         default: *help = true; return 5;
@@ -36,6 +78,24 @@ int argparser(int argc, char **argv, FILE **input_file, FILE **output_file, FILE
     return 0;
 }
 
+/*
+    Parses start:len, two decimal byte counts.
+    Returns false if arg is not of that form or a count does not fit 64 bits.
+*/
+bool parse_range(const char *arg, uint64_t *start, uint64_t *len) {
+    char *end = NULL;
+    if (*arg < '0' || *arg > '9') {
+        return false;
+    }
+    errno = 0;
+    *start = (uint64_t) strtoull(arg, &end, 10);
+    if (errno == ERANGE || *end != ':' || end[1] < '0' || end[1] > '9') {
+        return false;
+    }
+    *len = (uint64_t) strtoull(end + 1, &end, 10);
+    return errno != ERANGE && *end == '\0';
+}
+
 /*
     Opens file_name into file in mode.
     Prints error message and returns false if failed.
@@ -5,10 +5,28 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <getopt.h>
 
-#define OPTIONS "i:o:n:vh"
+#include "ss.h"
+#include "stats.h"
+#include "trace.h"
 
-int argparser(int argc, char **argv, FILE **input_file, FILE **output_file, FILE **pbfile,
-    bool *verbose, bool *help);
+#include <errno.h>
+
+//encrypt has the output formats, decrypt the byte range
+#define ENCRYPT_OPTIONS "i:o:n:t:xHIB:O:mvh"
+#define DECRYPT_OPTIONS "i:o:n:t:B:O:mvh"
+
+//--stats[=text|json], shared by every tool. getopt_long returns 'S' for it.
+#define STATS_LONG_OPTION { "stats", optional_argument, NULL, 'S' }
+//--trace=file, shared by every tool. getopt_long returns 'T' for it.
+#define TRACE_LONG_OPTION { "trace", required_argument, NULL, 'T' }
+//--range=start:len, decrypt only. getopt_long returns 'R' for it.
+#define RANGE_LONG_OPTION { "range", required_argument, NULL, 'R' }
+
+int argparser(int argc, char **argv, bool decrypting, FILE **input_file, FILE **output_file,
+    FILE **pbfile, bool *verbose, bool *help, bool *pool_alloc, bool *stats, stats_format *format,
+    FILE **trace_file, const char **batch_path, const char **batch_dir, ss_file_opts *opts);
+bool parse_range(const char *arg, uint64_t *start, uint64_t *len);
 bool open_file(FILE **file, const char *file_name, const char *mode);
 void check_null_and_close(FILE *file);
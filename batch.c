@@ -0,0 +1,229 @@
+#include "batch.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+//Files a list starts with, it doubles when full
+#define BATCH_INITIAL_FILES 64
+
+//Helper functions not in header file
+char *join_path(const char *dir, const char *name);
+bool add_file(batch_list *list, size_t *capacity, char *input, char *output);
+bool load_directory(batch_list *list, const char *path, const char *outdir);
+bool load_manifest(batch_list *list, const char *path, const char *outdir);
+int compare_size(const void *a, const void *b);
+
+/*
+    Returns dir/name in a new string, NULL if out of memory.
+*/
+char *join_path(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char *path = (char *) malloc(dir_len + name_len + 2);
+    if (path == NULL) {
+        return NULL;
+    }
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+    return path;
+}
+
+/*
+    Appends a file, taking ownership of input and output, and records its size.
+    Returns false if out of memory, with both names freed.
+*/
+bool add_file(batch_list *list, size_t *capacity, char *input, char *output) {
+    if (input == NULL || output == NULL) {
+        free(input);
+        free(output);
+        return false;
+    }
+    if (list->count == *capacity) {
+        size_t grown = *capacity == 0 ? BATCH_INITIAL_FILES : 2 * *capacity;
+        batch_file *files = (batch_file *) realloc(list->files, grown * sizeof(batch_file));
+        if (files == NULL) {
+            free(input);
+            free(output);
+            return false;
+        }
+        list->files = files;
+        *capacity = grown;
+    }
+    struct stat info;
+    uint64_t size = stat(input, &info) == 0 ? (uint64_t) info.st_size : 0;
+    list->files[list->count++] = (batch_file) { .input = input, .output = output, .size = size };
+    return true;
+}
+
+/*
+    Adds every regular file directly inside path, written to outdir under the same name.
+*/
+bool load_directory(batch_list *list, const char *path, const char *outdir) {
+    if (outdir == NULL) {
+        printf("A directory needs an output directory (-O)\n");
+        return false;
+    }
+    char in_real[PATH_MAX], out_real[PATH_MAX];
+    if (realpath(outdir, out_real) == NULL) {
+        printf("%s: No such file or directory\n", outdir);
+        return false;
+    }
+    if (realpath(path, in_real) == NULL || strcmp(in_real, out_real) == 0) {
+        printf("%s: The output directory must differ from the input directory\n", outdir);
+        return false;
+    }
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        printf("%s: No such file or directory\n", path);
+        return false;
+    }
+    size_t capacity = 0;
+    bool ok = true;
+    struct dirent *entry;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        char *input = join_path(path, entry->d_name);
+        struct stat info;
+        if (input != NULL && (stat(input, &info) != 0 || !S_ISREG(info.st_mode))) {
+            free(input); //Subdirectories, . and .. and anything else that is no file
+            continue;
+        }
+        ok = add_file(list, &capacity, input, join_path(outdir, entry->d_name));
+    }
+    closedir(dir);
+    if (!ok) {
+        printf("Out of memory reading %s\n", path);
+    }
+    return ok;
+}
+
+/*
+    Adds one file per non-empty line of the manifest at path.
+*/
+bool load_manifest(batch_list *list, const char *path, const char *outdir) {
+    FILE *manifest = fopen(path, "r");
+    if (manifest == NULL) {
+        printf("%s: No such file or directory\n", path);
+        return false;
+    }
+    size_t capacity = 0;
+    bool ok = true;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    uint64_t number = 0;
+    while (ok && (len = getline(&line, &line_size, manifest)) != -1) {
+        number++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len == 0) {
+            continue;
+        }
+
+        char *tab = strchr(line, '\t');
+        if (tab != NULL) {
+            *tab = '\0';
+            ok = add_file(list, &capacity, strdup(line), strdup(tab + 1));
+        } else if (outdir != NULL) {
+            const char *base = strrchr(line, '/');
+            ok = add_file(
+                list, &capacity, strdup(line), join_path(outdir, base == NULL ? line : base + 1));
+        } else {
+            printf("%s:%llu: No output name and no output directory (-O)\n", path,
+                (unsigned long long) number);
+            ok = false;
+        }
+    }
+    free(line);
+    fclose(manifest);
+    return ok;
+}
+
+bool batch_list_load(batch_list *list, const char *path, const char *outdir) {
+    *list = (batch_list) { 0 };
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        printf("%s: No such file or directory\n", path);
+        return false;
+    }
+    bool ok = S_ISDIR(info.st_mode) ? load_directory(list, path, outdir)
+                                    : load_manifest(list, path, outdir);
+    if (!ok) {
+        batch_list_clear(list);
+    }
+    return ok;
+}
+
+void batch_list_clear(batch_list *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->files[i].input);
+        free(list->files[i].output);
+    }
+    free(list->files);
+    *list = (batch_list) { 0 };
+    return;
+}
+
+/*
+    Largest first, ties by input name so a schedule is reproducible.
+*/
+int compare_size(const void *a, const void *b) {
+    const batch_file *x = (const batch_file *) a;
+    const batch_file *y = (const batch_file *) b;
+    if (x->size != y->size) {
+        return x->size < y->size ? 1 : -1;
+    }
+    return strcmp(x->input, y->input);
+}
+
+/*
+    work_pool_run hands worker w the contiguous slice of count / threads files, one more
+    for the first count % threads workers, so the files are dealt into those slices.
+*/
+void batch_list_schedule(batch_list *list, uint32_t threads) {
+    qsort(list->files, list->count, sizeof(batch_file), compare_size);
+    if (threads <= 1 || list->count <= 1) {
+        return;
+    }
+
+    batch_file *order = (batch_file *) malloc(list->count * sizeof(batch_file));
+    size_t *next = (size_t *) calloc(threads, sizeof(size_t));
+    size_t *end = (size_t *) calloc(threads, sizeof(size_t));
+    uint64_t *bytes = (uint64_t *) calloc(threads, sizeof(uint64_t));
+    if (order == NULL || next == NULL || end == NULL || bytes == NULL) {
+        free(order); //Largest first is still a fair order
+        free(next);
+        free(end);
+        free(bytes);
+        return;
+    }
+
+    size_t start = 0;
+    for (uint32_t w = 0; w < threads; w++) {
+        next[w] = start;
+        start += list->count / threads + (w < list->count % threads ? 1 : 0);
+        end[w] = start;
+    }
+    for (size_t i = 0; i < list->count; i++) {
+        uint32_t best = threads;
+        for (uint32_t w = 0; w < threads; w++) {
+            if (next[w] < end[w] && (best == threads || bytes[w] < bytes[best])) {
+                best = w;
+            }
+        }
+        order[next[best]++] = list->files[i];
+        bytes[best] += list->files[i].size;
+    }
+
+    free(list->files);
+    list->files = order;
+    free(next);
+    free(end);
+    free(bytes);
+    return;
+}
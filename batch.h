@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Files processed by one encrypt or decrypt run in batch mode (-B), loaded from a
+// manifest or a directory.
+//
+// Manifest: one file per line, the input name, a tab and the output name. A line
+// without a tab writes to the output directory under the input's base name. Empty
+// lines are skipped.
+//
+// Directory: every regular file directly inside it, written to the output directory
+// under the same name. The output directory must be another directory.
+//
+typedef struct {
+    char *input;
+    char *output;
+    uint64_t size; //Bytes in input when the list was loaded, 0 if it could not be read
+} batch_file;
+
+typedef struct {
+    batch_file *files;
+    size_t count;
+} batch_list;
+
+//
+// Loads the files named by path, a manifest or a directory.
+//
+// Requires:
+//  outdir: output directory, may be NULL if every manifest line names its output
+//
+// Returns false, with a message printed and list empty, if path cannot be read, an
+// output directory is needed and missing, or a directory would be written into itself.
+//
+bool batch_list_load(batch_list *list, const char *path, const char *outdir);
+
+void batch_list_clear(batch_list *list);
+
+//
+// Orders the files for a work_pool of threads workers so every worker's slice holds about
+// as many bytes: largest files first, each to the slice with the fewest bytes so far that
+// still has room. Each slice starts with its largest file, so stealing takes small files.
+//
+void batch_list_schedule(batch_list *list, uint32_t threads);
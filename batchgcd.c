@@ -0,0 +1,153 @@
+#include "batchgcd.h"
+#include "trace.h"
+
+#include <stdlib.h>
+
+//One level of the product or remainder tree
+typedef struct {
+    mpz_t *nodes;
+    size_t count;
+} tree_level;
+
+//Work of one level, shared by the tasks of its nodes
+typedef struct {
+    mpz_t *below; //Nodes of the level below, the moduli for the leaves
+    size_t below_count;
+    mpz_t *above; //Nodes of the level above
+    mpz_t *remainders; //Remainders of the level below, on the way down
+    mpz_t *gcds; //Set at the leaves
+    mpz_t *scratch; //One per worker
+} level_job;
+
+//Helper functions not in header file
+mpz_t *create_nodes(size_t count);
+void delete_nodes(mpz_t *nodes, size_t count);
+void run_level(work_pool *pool, size_t count, work_pool_task task, level_job *job);
+void product_task(void *arg, size_t index, uint32_t worker);
+void remainder_task(void *arg, size_t index, uint32_t worker);
+void leaf_task(void *arg, size_t index, uint32_t worker);
+
+mpz_t *create_nodes(size_t count) {
+    mpz_t *nodes = (mpz_t *) malloc(count * sizeof(mpz_t));
+    for (size_t i = 0; i < count; i++) {
+        mpz_init(nodes[i]);
+    }
+    return nodes;
+}
+
+void delete_nodes(mpz_t *nodes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        mpz_clear(nodes[i]);
+    }
+    free(nodes);
+    return;
+}
+
+/*
+    Runs task for the count nodes of a level, on the calling thread without a pool.
+*/
+void run_level(work_pool *pool, size_t count, work_pool_task task, level_job *job) {
+    if (pool == NULL) {
+        for (size_t i = 0; i < count; i++) {
+            task(job, i, 0);
+        }
+        return;
+    }
+    work_pool_run(pool, count, task, job);
+    return;
+}
+
+/*
+    Node index of the level above: the product of its two children, or the last child
+    alone when the level below has an odd count.
+*/
+void product_task(void *arg, size_t index, uint32_t worker) {
+    (void) worker;
+    level_job *job = (level_job *) arg;
+    if (2 * index + 1 < job->below_count) {
+        mpz_mul(job->above[index], job->below[2 * index], job->below[2 * index + 1]);
+    } else {
+        mpz_set(job->above[index], job->below[2 * index]);
+    }
+    return;
+}
+
+/*
+    Remainder of node index of the level below: its parent's remainder modulo the
+    square of the node.
+*/
+void remainder_task(void *arg, size_t index, uint32_t worker) {
+    level_job *job = (level_job *) arg;
+    mpz_t *square = &job->scratch[worker];
+    mpz_mul(*square, job->below[index], job->below[index]);
+    mpz_mod(job->remainders[index], job->above[index / 2], *square);
+    return;
+}
+
+/*
+    The remainder of leaf index is P mod n^2, a multiple of n since n divides P.
+*/
+void leaf_task(void *arg, size_t index, uint32_t worker) {
+    remainder_task(arg, index, worker);
+    level_job *job = (level_job *) arg;
+    mpz_divexact(job->remainders[index], job->remainders[index], job->below[index]);
+    mpz_gcd(job->gcds[index], job->remainders[index], job->below[index]);
+    return;
+}
+
+void batch_gcd(mpz_t *gcds, mpz_t *moduli, size_t count, work_pool *pool) {
+    if (count < 2) {
+        for (size_t i = 0; i < count; i++) {
+            mpz_set_ui(gcds[i], 1);
+        }
+        return;
+    }
+
+    uint32_t workers = pool == NULL ? 1 : work_pool_threads(pool);
+    mpz_t *scratch = create_nodes(workers);
+
+    //Level 0 is the moduli themselves, level depth - 1 the product of all of them
+    size_t depth = 1;
+    for (size_t n = count; n > 1; n = (n + 1) / 2) {
+        depth++;
+    }
+    tree_level *tree = (tree_level *) calloc(depth, sizeof(tree_level));
+    tree[0] = (tree_level) { .nodes = moduli, .count = count };
+
+    uint64_t span = trace_begin();
+    for (size_t l = 1; l < depth; l++) {
+        tree[l].count = (tree[l - 1].count + 1) / 2;
+        tree[l].nodes = create_nodes(tree[l].count);
+        level_job job = { .below = tree[l - 1].nodes,
+            .below_count = tree[l - 1].count,
+            .above = tree[l].nodes };
+        run_level(pool, tree[l].count, product_task, &job);
+    }
+    trace_span("product_tree", span, "keys", count);
+
+    //The root's remainder is P itself, so the tree's top level stands in for it
+    span = trace_begin();
+    mpz_t *above = tree[depth - 1].nodes;
+    for (size_t l = depth - 1; l > 0; l--) {
+        mpz_t *remainders = create_nodes(tree[l - 1].count);
+        level_job job = { .below = tree[l - 1].nodes,
+            .below_count = tree[l - 1].count,
+            .above = above,
+            .remainders = remainders,
+            .gcds = gcds,
+            .scratch = scratch };
+        run_level(pool, tree[l - 1].count, l == 1 ? leaf_task : remainder_task, &job);
+
+        if (above != tree[depth - 1].nodes) {
+            delete_nodes(above, tree[l].count);
+        }
+        delete_nodes(tree[l].nodes, tree[l].count);
+        above = remainders;
+    }
+    delete_nodes(above, count);
+    trace_span("remainder_tree", span, "keys", count);
+
+    free(tree);
+    delete_nodes(scratch, workers);
+    return;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <gmp.h>
+
+#include "pool.h"
+
+//
+// Batch GCD: for every modulus n_i of a collection, the gcd of n_i with the product of
+// all the others, in quasi-linear time instead of the count^2 gcds of comparing pairs.
+//
+// A product tree multiplies the moduli pairwise up to their product P. A remainder
+// tree then reduces P down the same tree, modulo the square of every node, so leaf i
+// holds P mod n_i^2 and gcd(n_i, (P mod n_i^2) / n_i) is the gcd with the others.
+//
+// The nodes of each level are independent and spread over the workers of pool. The
+// levels near the root hold few, large numbers, so they are bound by GMP's
+// multiplication on one thread. The tree holds about log2(count) copies of the
+// moduli's bits, each level is freed on the way down.
+//
+// Provides:
+//  gcds: gcds[i] = gcd(n_i, n_0 * ... * n_count-1 / n_i), 1 if n_i shares no factor,
+//        n_i if every factor of n_i is shared (for example by a copy of the same key)
+//
+// Requires:
+//  gcds: count initialized integers
+//  moduli: count integers > 1, not modified
+//  pool: worker pool, NULL to run on the calling thread
+//
+void batch_gcd(mpz_t *gcds, mpz_t *moduli, size_t count, work_pool *pool);
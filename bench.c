@@ -0,0 +1,387 @@
+#include "numtheory.h"
+#include "randstate.h"
+#include "ss.h"
+#include "gmpalloc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <gmp.h>
+
+#define BENCH_OPTIONS "b:p:r:t:e:s:o:mh"
+
+#define MAX_SIZES 32
+//Blocks timed one at a time for the per-block latency percentiles
+#define BLOCK_SAMPLES 32
+
+typedef struct {
+    double min, p50, p90, p99, max, mean;
+} summary;
+
+uint32_t parse_list(const char *arg, uint64_t *values, uint32_t max);
+bool parse_isa(const char *arg, mont_batch_isa *isa);
+double now_seconds(void);
+int compare_doubles(const void *a, const void *b);
+summary summarize(double *samples, uint32_t count);
+double nearest_rank(const double *samples, uint32_t count, uint32_t percent);
+void print_summary(FILE *out, const char *name, summary s, double scale);
+void print_alloc(FILE *out, const gmpalloc_stats *stats);
+void bench_key(FILE *out, uint64_t nbits, const uint64_t *payloads, uint32_t payload_count,
+    uint32_t reps, const ss_file_opts *opts);
+void bench_payload(FILE *out, ss_pub_ctx *pub, ss_priv_ctx *priv, uint64_t bytes, uint32_t reps,
+    const ss_file_opts *opts);
+void bench_blocks(FILE *out, ss_pub_ctx *pub, ss_priv_ctx *priv);
+void print_help(void);
+
+/*
+    Benchmark driver for keygen, encrypt and decrypt. Calls the library in ss.c directly
+    (in-memory streams, no CLI or disk) and writes the results as JSON.
+*/
+int main(int argc, char **argv) {
+    uint64_t bits[MAX_SIZES] = { 512, 1024, 2048, 3072, 4096 };
+    uint32_t bit_count = 5;
+    uint64_t payloads[MAX_SIZES] = { 1024, 16384 };
+    uint32_t payload_count = 2;
+    uint32_t reps = 3;
+    uint64_t seed = (uint64_t) time(NULL);
+    ss_file_opts opts = { .threads = 1 };
+    FILE *out = stdout;
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, BENCH_OPTIONS)) != -1) {
+        switch (opt) {
+        case 'b': bit_count = parse_list(optarg, bits, MAX_SIZES); break;
+        case 'p': payload_count = parse_list(optarg, payloads, MAX_SIZES); break;
+        case 'r': reps = (uint32_t) strtoul(optarg, NULL, 10); break;
+        case 't': opts.threads = (uint32_t) strtoul(optarg, NULL, 10); break;
+        case 'e':
+            if (!parse_isa(optarg, &opts.isa)) {
+                print_help();
+                return -1;
+            }
+            break;
+        case 's': seed = (uint64_t) strtoul(optarg, NULL, 10); break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if (out == NULL) {
+                printf("%s: No such file or directory\n", optarg);
+                return -1;
+            }
+            break;
+        case 'm': gmpalloc_init(GMPALLOC_POOL); break; //Before GMP allocates anything
+        case 'h': print_help(); return 0;
+        default: print_help(); return -1;
+        }
+    }
+
+    if (bit_count == 0 || payload_count == 0 || reps == 0) {
+        print_help();
+        return -1;
+    }
+
+    randstate_init(seed);
+    srandom(seed);
+
+    fprintf(out, "{\n  \"timestamp\": %lld,\n  \"seed\": %llu,\n  \"threads\": %u,\n",
+        (long long) time(NULL), (unsigned long long) seed, opts.threads);
+    fprintf(out, "  \"gmp_allocator\": \"%s\",\n", gmpalloc_installed() ? "pool" : "default");
+    fprintf(out, "  \"engine\": \"%s\",\n",
+        mont_batch_name(opts.isa == MONT_BATCH_AUTO ? mont_batch_detect() : opts.isa));
+    fprintf(out, "  \"reps\": %u,\n  \"gmp_version\": \"%s\",\n  \"keys\": [\n", reps, gmp_version);
+    for (uint32_t i = 0; i < bit_count; i++) {
+        bench_key(out, bits[i], payloads, payload_count, reps, &opts);
+        fprintf(out, i + 1 < bit_count ? ",\n" : "\n");
+        fflush(out);
+    }
+    fprintf(out, "  ]\n}\n");
+
+    randstate_clear();
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
+
+/*
+    Parses a comma separated list of numbers into values. Returns how many were read.
+*/
+uint32_t parse_list(const char *arg, uint64_t *values, uint32_t max) {
+    uint32_t count = 0;
+    const char *cursor = arg;
+    while (*cursor != '\0' && count < max) {
+        char *end;
+        values[count] = (uint64_t) strtoull(cursor, &end, 10);
+        if (end == cursor || values[count] == 0) {
+            return 0;
+        }
+        count++;
+        cursor = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+/*
+    Parses a batch engine name. Returns false if it is unknown.
+*/
+bool parse_isa(const char *arg, mont_batch_isa *isa) {
+    mont_batch_isa all[] = { MONT_BATCH_AUTO, MONT_BATCH_SCALAR, MONT_BATCH_AVX2, MONT_BATCH_IFMA };
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++) {
+        if (strcmp(arg, mont_batch_name(all[i])) == 0) {
+            *isa = all[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+    Nearest-rank percentile of sorted samples, the one at index
+    ceil(percent / 100 * count) - 1. With 3 samples p90 and p99 are the maximum.
+*/
+double nearest_rank(const double *samples, uint32_t count, uint32_t percent) {
+    uint64_t rank = ((uint64_t) count * percent + 99) / 100; //ceil, at least 1 for count > 0
+    return samples[rank == 0 ? 0 : rank - 1];
+}
+
+/*
+    Sorts samples and reports nearest-rank percentiles.
+*/
+summary summarize(double *samples, uint32_t count) {
+    qsort(samples, count, sizeof(double), compare_doubles);
+    summary s = { 0 };
+    double total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        total += samples[i];
+    }
+    s.min = samples[0];
+    s.max = samples[count - 1];
+    s.mean = total / count;
+    s.p50 = nearest_rank(samples, count, 50);
+    s.p90 = nearest_rank(samples, count, 90);
+    s.p99 = nearest_rank(samples, count, 99);
+    return s;
+}
+
+/*
+    Writes a summary as a JSON object, multiplying every value by scale.
+*/
+void print_summary(FILE *out, const char *name, summary s, double scale) {
+    fprintf(out,
+        "\"%s\": { \"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f, "
+        "\"mean\": %.3f }",
+        name, s.min * scale, s.p50 * scale, s.p90 * scale, s.p99 * scale, s.max * scale,
+        s.mean * scale);
+    return;
+}
+
+/*
+    Writes the GMP allocation counts of an operation as a JSON member with a leading
+    comma, or nothing without the pooled allocator.
+*/
+void print_alloc(FILE *out, const gmpalloc_stats *stats) {
+    if (!gmpalloc_installed()) {
+        return;
+    }
+    fprintf(out, ", \"gmp\": { \"allocs\": %llu, \"reallocs\": %llu, \"peak_bytes\": %llu }",
+        (unsigned long long) stats->op_allocs, (unsigned long long) stats->op_reallocs,
+        (unsigned long long) stats->op_peak_bytes);
+    return;
+}
+
+/*
+    Times reps key generations of nbits, then benchmarks the last key on every payload size.
+*/
+void bench_key(FILE *out, uint64_t nbits, const uint64_t *payloads, uint32_t payload_count,
+    uint32_t reps, const ss_file_opts *opts) {
+    mpz_t p, q, n, pq, d, dp, dq, qinv;
+    mpz_inits(p, q, n, pq, d, dp, dq, qinv, NULL);
+
+    gmpalloc_stats keygen_alloc;
+    double *samples = (double *) calloc(reps, sizeof(double));
+    for (uint32_t i = 0; i < reps; i++) {
+        gmpalloc_op_begin();
+        double start = now_seconds();
+        ss_make_pub(p, q, n, nbits, PRIME_BPSW);
+        ss_make_priv(d, pq, p, q);
+        ss_make_priv_crt(dp, dq, qinv, d, p, q);
+        samples[i] = now_seconds() - start;
+        gmpalloc_get_stats(&keygen_alloc);
+    }
+
+    ss_pub_ctx pub;
+    ss_priv_ctx priv;
+    ss_pub_ctx_init(&pub, n);
+    ss_priv_ctx_init_crt(&priv, pq, d, p, q, dp, dq, qinv);
+
+    fprintf(out, "    {\n      \"bits\": %llu,\n      \"n_bits\": %zu,\n",
+        (unsigned long long) nbits, mpz_sizeinbase(n, 2));
+    fprintf(out, "      \"block_bytes\": %zu,\n      ", pub.k - 1);
+    print_summary(out, "keygen_ms", summarize(samples, reps), 1e3);
+    if (gmpalloc_installed()) {
+        fprintf(out, ",\n      \"keygen_gmp\": { \"allocs\": %llu, \"reallocs\": %llu, "
+                     "\"peak_bytes\": %llu }",
+            (unsigned long long) keygen_alloc.op_allocs,
+            (unsigned long long) keygen_alloc.op_reallocs,
+            (unsigned long long) keygen_alloc.op_peak_bytes);
+    }
+    fprintf(out, ",\n");
+    bench_blocks(out, &pub, &priv);
+    fprintf(out, "      \"payloads\": [\n");
+    for (uint32_t i = 0; i < payload_count; i++) {
+        bench_payload(out, &pub, &priv, payloads[i], reps, opts);
+        fprintf(out, i + 1 < payload_count ? ",\n" : "\n");
+    }
+    fprintf(out, "      ]\n    }");
+
+    ss_priv_ctx_clear(&priv);
+    ss_pub_ctx_clear(&pub);
+    free(samples);
+    mpz_clears(p, q, n, pq, d, dp, dq, qinv, NULL);
+    return;
+}
+
+/*
+    Per-block latency of ss_encrypt_ctx and ss_decrypt_ctx on full random blocks.
+*/
+void bench_blocks(FILE *out, ss_pub_ctx *pub, ss_priv_ctx *priv) {
+    double enc[BLOCK_SAMPLES], dec[BLOCK_SAMPLES];
+    mpz_t m, c, r;
+    mpz_inits(m, c, r, NULL);
+
+    for (uint32_t i = 0; i < BLOCK_SAMPLES; i++) {
+        mpz_urandomb(m, state, (mp_bitcnt_t) (8 * (pub->k - 1)));
+        mpz_setbit(m, (mp_bitcnt_t) (8 * pub->k - 1)); //0xFF prefix keeps the block full size
+
+        double start = now_seconds();
+        ss_encrypt_ctx(c, m, pub);
+        enc[i] = now_seconds() - start;
+
+        start = now_seconds();
+        ss_decrypt_ctx(r, c, priv);
+        dec[i] = now_seconds() - start;
+
+        if (mpz_cmp(r, m) != 0) {
+            fprintf(stderr, "bench: block round trip failed\n");
+            exit(1);
+        }
+    }
+
+    fprintf(out, "      ");
+    print_summary(out, "encrypt_block_us", summarize(enc, BLOCK_SAMPLES), 1e6);
+    fprintf(out, ",\n      ");
+    print_summary(out, "decrypt_block_us", summarize(dec, BLOCK_SAMPLES), 1e6);
+    fprintf(out, ",\n");
+    mpz_clears(m, c, r, NULL);
+    return;
+}
+
+/*
+    Encrypts and decrypts a random payload of bytes reps times through in-memory streams
+    and reports throughput. Every run is checked against the original payload.
+*/
+void bench_payload(FILE *out, ss_pub_ctx *pub, ss_priv_ctx *priv, uint64_t bytes, uint32_t reps,
+    const ss_file_opts *opts) {
+    uint8_t *payload = (uint8_t *) malloc(bytes);
+    for (uint64_t i = 0; i < bytes; i++) {
+        payload[i] = (uint8_t) gmp_urandomb_ui(state, 8);
+    }
+
+    double *enc = (double *) calloc(reps, sizeof(double));
+    double *dec = (double *) calloc(reps, sizeof(double));
+    uint64_t blocks = (bytes + pub->k - 2) / (pub->k - 1);
+    gmpalloc_stats enc_alloc, dec_alloc; //Of the last run
+
+    for (uint32_t i = 0; i < reps; i++) {
+        char *cipher = NULL, *plain = NULL;
+        size_t cipher_size = 0, plain_size = 0;
+
+        FILE *infile = fmemopen(payload, bytes, "r");
+        FILE *outfile = open_memstream(&cipher, &cipher_size);
+        gmpalloc_op_begin();
+        double start = now_seconds();
+        ss_encrypt_file(infile, outfile, pub, opts);
+        fflush(outfile);
+        enc[i] = now_seconds() - start;
+        gmpalloc_get_stats(&enc_alloc);
+        fclose(infile);
+        fclose(outfile);
+
+        infile = fmemopen(cipher, cipher_size, "r");
+        outfile = open_memstream(&plain, &plain_size);
+        gmpalloc_op_begin();
+        start = now_seconds();
+        ss_decrypt_file(infile, outfile, priv, opts);
+        fflush(outfile);
+        dec[i] = now_seconds() - start;
+        gmpalloc_get_stats(&dec_alloc);
+        fclose(infile);
+        fclose(outfile);
+
+        if (plain_size != bytes || memcmp(plain, payload, bytes) != 0) {
+            fprintf(stderr, "bench: file round trip failed for %llu bytes\n",
+                (unsigned long long) bytes);
+            exit(1);
+        }
+        free(cipher);
+        free(plain);
+    }
+
+    summary e = summarize(enc, reps);
+    summary d = summarize(dec, reps);
+    fprintf(out, "        {\n          \"bytes\": %llu,\n          \"blocks\": %llu,\n",
+        (unsigned long long) bytes, (unsigned long long) blocks);
+    fprintf(out,
+        "          \"encrypt\": { \"mb_per_s\": %.4f, \"blocks_per_s\": %.2f, ",
+        (double) bytes / e.p50 / 1e6, (double) blocks / e.p50);
+    print_summary(out, "ms", e, 1e3);
+    print_alloc(out, &enc_alloc);
+    fprintf(out,
+        " },\n          \"decrypt\": { \"mb_per_s\": %.4f, \"blocks_per_s\": %.2f, ",
+        (double) bytes / d.p50 / 1e6, (double) blocks / d.p50);
+    print_summary(out, "ms", d, 1e3);
+    print_alloc(out, &dec_alloc);
+    fprintf(out, " }\n        }");
+
+    free(enc);
+    free(dec);
+    free(payload);
+    return;
+}
+
+/*
+    Prints help message
+*/
+void print_help(void) {
+    printf("SYNOPSIS\n"
+           "   Benchmarks SS key generation, encryption and decryption and writes JSON.\n"
+           "   Throughput figures use the median run.\n\n"
+
+           "USAGE\n"
+           "   ./ssbench [OPTIONS]\n\n"
+
+           "OPTIONS\n"
+           "   -h              Display program help and usage.\n"
+           "   -b bits,...     Key sizes to sweep (default: 512,1024,2048,3072,4096).\n"
+           "   -p bytes,...    Payload sizes to sweep (default: 1024,16384).\n"
+           "   -r reps         Repetitions per measurement (default: 3).\n"
+           "   -t threads      Worker threads for file encryption/decryption (default: 1).\n"
+           "   -e engine       Batch engine: auto, scalar, avx2 or ifma (default: auto).\n"
+           "   -s seed         Random seed (default: current time).\n"
+           "   -o outfile      JSON output file (default: stdout).\n"
+           "   -m              Use the pooled GMP allocator and report allocations and\n"
+           "                   peak bytes per operation.\n");
+}
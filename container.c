@@ -0,0 +1,203 @@
+#include "container.h"
+
+#include <string.h>
+
+void put_be(uint8_t *buffer, uint64_t value, size_t bytes);
+uint64_t get_be(const uint8_t *buffer, size_t bytes);
+
+/*
+    Stores the low *bytes* bytes of value big-endian into buffer.
+*/
+void put_be(uint8_t *buffer, uint64_t value, size_t bytes) {
+    for (size_t i = 0; i < bytes; i++) {
+        buffer[bytes - 1 - i] = (uint8_t) (value >> (8 * i));
+    }
+    return;
+}
+
+/*
+    Loads a big-endian integer of *bytes* bytes from buffer.
+*/
+uint64_t get_be(const uint8_t *buffer, size_t bytes) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < bytes; i++) {
+        value = (value << 8) | buffer[i];
+    }
+    return value;
+}
+
+/*
+    Hex ciphertext starts with a hex digit or whitespace, never with the magic's 'S'.
+*/
+bool container_detect(FILE *infile) {
+    int c = getc(infile);
+    if (c == EOF) {
+        return false;
+    }
+    ungetc(c, infile);
+    return c == CONTAINER_MAGIC[0];
+}
+
+size_t container_encode_header(const container_header *header, uint8_t *buffer) {
+    const char *magic = header->indexed ? CONTAINER_INDEXED_MAGIC : CONTAINER_MAGIC;
+    memcpy(buffer, header->hybrid ? CONTAINER_HYBRID_MAGIC : magic, 3);
+    buffer[3] = header->version;
+    put_be(buffer + 4, header->width, 4);
+    put_be(buffer + 8, header->blocks, 8);
+    if (!header->hybrid) {
+        return CONTAINER_HEADER_SIZE;
+    }
+    buffer[16] = header->cipher;
+    memset(buffer + 17, 0, 3);
+    put_be(buffer + 20, header->chunk, 4);
+    return CONTAINER_HYBRID_SIZE;
+}
+
+bool container_write_header(FILE *outfile, const container_header *header, long *offset) {
+    uint8_t buffer[CONTAINER_HYBRID_SIZE];
+    size_t size = container_encode_header(header, buffer);
+
+    *offset = ftell(outfile);
+    return fwrite(buffer, sizeof(uint8_t), size, outfile) == size;
+}
+
+bool container_patch_blocks(FILE *outfile, long offset, uint64_t blocks) {
+    if (offset < 0) {
+        return false;
+    }
+    long end = ftell(outfile);
+    if (end < 0 || fseek(outfile, offset + 8, SEEK_SET) != 0) {
+        return false;
+    }
+    uint8_t buffer[8];
+    put_be(buffer, blocks, 8);
+    bool written = fwrite(buffer, sizeof(uint8_t), 8, outfile) == 8;
+    return fseek(outfile, end, SEEK_SET) == 0 && written;
+}
+
+size_t container_decode_header(const uint8_t *buffer, size_t size, container_header *header) {
+    if (size < CONTAINER_HEADER_SIZE) {
+        return 0;
+    }
+    header->hybrid = memcmp(buffer, CONTAINER_HYBRID_MAGIC, 3) == 0;
+    header->indexed = memcmp(buffer, CONTAINER_INDEXED_MAGIC, 3) == 0;
+    if (!header->hybrid && !header->indexed && memcmp(buffer, CONTAINER_MAGIC, 3) != 0) {
+        return 0;
+    }
+    header->version = buffer[3];
+    header->width = (uint32_t) get_be(buffer + 4, 4);
+    header->blocks = get_be(buffer + 8, 8);
+    if (header->version == 0 || header->version > CONTAINER_VERSION || header->width == 0
+        || header->width > CONTAINER_MAX_WIDTH) {
+        return 0;
+    }
+    if (header->indexed) {
+        //The index needs the block count
+        return header->blocks != CONTAINER_BLOCKS_UNKNOWN ? CONTAINER_HEADER_SIZE : 0;
+    }
+    if (!header->hybrid) {
+        return CONTAINER_HEADER_SIZE;
+    }
+
+    if (size < CONTAINER_HYBRID_SIZE) {
+        return 0;
+    }
+    header->cipher = buffer[16];
+    header->chunk = (uint32_t) get_be(buffer + 20, 4);
+    bool valid = header->cipher == CONTAINER_CIPHER_CHACHA20_POLY1305 && header->chunk > 0
+                 && header->chunk <= CONTAINER_MAX_CHUNK;
+    return valid ? CONTAINER_HYBRID_SIZE : 0;
+}
+
+/*
+    Reads the hybrid fields only after the magic asked for them.
+*/
+bool container_read_header(FILE *infile, container_header *header) {
+    uint8_t buffer[CONTAINER_HYBRID_SIZE];
+    if (fread(buffer, sizeof(uint8_t), CONTAINER_HEADER_SIZE, infile) != CONTAINER_HEADER_SIZE) {
+        return false;
+    }
+    size_t size = CONTAINER_HEADER_SIZE;
+    if (memcmp(buffer, CONTAINER_HYBRID_MAGIC, 3) == 0) {
+        size_t extra = CONTAINER_HYBRID_SIZE - CONTAINER_HEADER_SIZE;
+        if (fread(buffer + size, sizeof(uint8_t), extra, infile) != extra) {
+            return false;
+        }
+        size += extra;
+    }
+    return container_decode_header(buffer, size, header) == size;
+}
+
+/*
+    Left pads the exported value with zero bytes up to width.
+*/
+void container_export_block(const mpz_t c, uint8_t *buffer, uint32_t width) {
+    size_t size = (mpz_sizeinbase(c, 2) + 7) / 8;
+    if (mpz_sgn(c) == 0) {
+        size = 0;
+    }
+    memset(buffer, 0, width - size);
+    mpz_export(buffer + (width - size), NULL, 1, sizeof(uint8_t), 1, 0, c);
+    return;
+}
+
+void container_import_block(mpz_t c, const uint8_t *buffer, uint32_t width) {
+    mpz_import(c, width, 1, sizeof(uint8_t), 1, 0, buffer);
+    return;
+}
+
+bool container_write_block(FILE *outfile, const mpz_t c, uint8_t *buffer, uint32_t width) {
+    container_export_block(c, buffer, width);
+    return fwrite(buffer, sizeof(uint8_t), width, outfile) == width;
+}
+
+bool container_read_block(FILE *infile, mpz_t c, uint8_t *buffer, uint32_t width) {
+    if (fread(buffer, sizeof(uint8_t), width, infile) != width) {
+        return false;
+    }
+    container_import_block(c, buffer, width);
+    return true;
+}
+
+bool container_write_index(FILE *outfile, uint32_t payload, uint64_t size) {
+    uint8_t buffer[CONTAINER_INDEX_TRAILER_SIZE];
+    put_be(buffer, size, 8);
+    put_be(buffer + 8, payload, 4);
+    memset(buffer + 12, 0, 4);
+    return fwrite(buffer, sizeof(uint8_t), CONTAINER_INDEX_TRAILER_SIZE, outfile)
+           == CONTAINER_INDEX_TRAILER_SIZE;
+}
+
+/*
+    Every block but the last is full and no block is empty, so an empty plaintext has no
+    blocks at all.
+*/
+bool container_read_index(FILE *infile, const container_header *header, container_index *index) {
+    index->first_block = ftell(infile);
+    if (index->first_block < 0 || fseek(infile, -CONTAINER_INDEX_TRAILER_SIZE, SEEK_END) != 0) {
+        return false;
+    }
+    long trailer = ftell(infile);
+    uint8_t buffer[CONTAINER_INDEX_TRAILER_SIZE];
+    if (trailer < index->first_block
+        || fread(buffer, sizeof(uint8_t), CONTAINER_INDEX_TRAILER_SIZE, infile)
+               != CONTAINER_INDEX_TRAILER_SIZE) {
+        return false;
+    }
+    index->size = get_be(buffer, 8);
+    index->payload = (uint32_t) get_be(buffer + 8, 4);
+    if (index->payload == 0 || index->payload >= header->width) {
+        return false;
+    }
+
+    //Blocks must fill the space before the trailer exactly
+    uint64_t space = (uint64_t) (trailer - index->first_block);
+    if (header->blocks > space / header->width || header->blocks * header->width != space) {
+        return false;
+    }
+    uint64_t blocks = index->size / index->payload + (index->size % index->payload != 0 ? 1 : 0);
+    if (header->blocks != blocks) {
+        return false;
+    }
+    return fseek(infile, index->first_block, SEEK_SET) == 0;
+}
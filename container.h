@@ -0,0 +1,171 @@
+#pragma once
+
+#include <stdio.h>
+#include <gmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Binary ciphertext container written by ss_encrypt_file.
+//
+// Layout (all integers big-endian):
+//  magic:   3 bytes "SSB"
+//  version: 1 byte
+//  width:   4 bytes, bytes per encrypted block (bytes in the public modulus n)
+//  blocks:  8 bytes, number of blocks or CONTAINER_BLOCKS_UNKNOWN if the output
+//           could not be rewound to fill it in
+//  followed by the blocks, each exactly width bytes
+//
+// Every block decrypts to 0xFF followed by the plaintext bytes of the block. The marker
+// frames the block: everything after it is data, including 0x00 bytes, and decrypt
+// writes it as is. The same holds for the blocks of the hex format.
+//
+// Indexed container written for SS_FORMAT_INDEXED, for decrypting a byte range without
+// the blocks before it. Laid out like the binary container with the magic "SSI" and a
+// block count that is always filled in, followed by a trailer:
+//
+//  size:     8 bytes, plaintext bytes in the whole container
+//  payload:  4 bytes, plaintext bytes in every block but the last
+//  reserved: 4 bytes, 0
+//
+// Plaintext byte i is in block i / payload, so a reader seeks straight to it. The payload
+// is k - 1 of the encrypting key, which a private key without n cannot derive.
+//
+// Hybrid container written for SS_FORMAT_HYBRID. Only a random session key is SS
+// encrypted, the payload is encrypted with ChaCha20-Poly1305 (see aead.h) under it.
+//
+//  magic:    3 bytes "SSH"
+//  version:  1 byte
+//  width:    4 bytes, bytes per SS encrypted block
+//  blocks:   8 bytes, SS encrypted blocks holding the session key
+//  cipher:   1 byte, CONTAINER_CIPHER_CHACHA20_POLY1305
+//  reserved: 3 bytes, 0
+//  chunk:    4 bytes, plaintext bytes per chunk
+//  followed by the key blocks, each exactly width bytes, then the chunks: chunk bytes of
+//  ciphertext and a 16 byte tag each, except the last, which may be shorter or empty.
+//  Chunk i is sealed with the nonce last || 0x000000 || i (8 bytes, big-endian), where
+//  last is 1 for the final chunk and 0 otherwise so truncation is detected, and the 24
+//  header bytes as associated data.
+//
+
+#define CONTAINER_MAGIC        "SSB"
+#define CONTAINER_HYBRID_MAGIC "SSH"
+#define CONTAINER_INDEXED_MAGIC "SSI"
+#define CONTAINER_VERSION      2
+#define CONTAINER_HEADER_SIZE  16
+#define CONTAINER_HYBRID_SIZE  24
+#define CONTAINER_MAX_WIDTH    (1u << 20)
+#define CONTAINER_MAX_CHUNK    (1u << 24)
+
+#define CONTAINER_BLOCKS_UNKNOWN UINT64_MAX
+
+#define CONTAINER_CIPHER_CHACHA20_POLY1305 1
+
+//Trailer after the last block of an indexed container
+#define CONTAINER_INDEX_TRAILER_SIZE 16
+
+typedef struct {
+    uint8_t version;
+    uint32_t width;
+    uint64_t blocks;
+    bool indexed; //Blocks are followed by an index trailer (never set with hybrid)
+    bool hybrid; //The hybrid fields below are only used if set
+    uint8_t cipher;
+    uint32_t chunk;
+} container_header;
+
+//Trailer of an indexed container
+typedef struct {
+    uint64_t size; //Plaintext bytes
+    uint32_t payload; //Plaintext bytes in every block but the last
+    long first_block; //Stream position of block 0
+} container_index;
+
+//
+// Peeks at the next byte of infile without consuming it.
+//
+// Returns true if the stream starts with a binary container.
+//
+bool container_detect(FILE *infile);
+
+//
+// Serializes header into buffer (CONTAINER_HYBRID_SIZE bytes are always enough).
+// Returns the header size.
+//
+size_t container_encode_header(const container_header *header, uint8_t *buffer);
+
+//
+// Writes header to outfile.
+//
+// Provides:
+//  offset: stream position of the header so the block count can be patched later
+//          (-1 if the stream is not seekable)
+//
+bool container_write_header(FILE *outfile, const container_header *header, long *offset);
+
+//
+// Rewrites the block count of a header written at offset and returns to the end of the stream.
+// Returns false (leaving CONTAINER_BLOCKS_UNKNOWN in place) if the stream cannot seek.
+//
+bool container_patch_blocks(FILE *outfile, long offset, uint64_t blocks);
+
+//
+// Parses and validates a header from the first size bytes of buffer, like
+// container_read_header.
+//
+// Returns the header size, 0 if buffer does not start with a whole valid header.
+//
+size_t container_decode_header(const uint8_t *buffer, size_t size, container_header *header);
+
+//
+// Reads and validates a container, indexed container or hybrid container header from
+// infile. Every version up to CONTAINER_VERSION is accepted.
+//
+bool container_read_header(FILE *infile, container_header *header);
+
+//
+// Exports c into buffer as a width byte big-endian block, zero padded in front.
+//
+// Requires:
+//  c: less than 256^width
+//
+void container_export_block(const mpz_t c, uint8_t *buffer, uint32_t width);
+
+//
+// Imports a width byte block from buffer into c.
+//
+void container_import_block(mpz_t c, const uint8_t *buffer, uint32_t width);
+
+//
+// Writes c as a width byte big-endian block.
+//
+// Requires:
+//  buffer: scratch space of at least width bytes
+//  c: less than 256^width
+//
+bool container_write_block(FILE *outfile, const mpz_t c, uint8_t *buffer, uint32_t width);
+
+//
+// Reads one width byte block into c.
+//
+// Returns false at the end of the stream or on a truncated block.
+//
+bool container_read_block(FILE *infile, mpz_t c, uint8_t *buffer, uint32_t width);
+
+//
+// Writes the trailer of an indexed container after its last block.
+//
+// Requires:
+//  payload: plaintext bytes in every block but the last
+//  size: plaintext bytes in all blocks
+//
+bool container_write_index(FILE *outfile, uint32_t payload, uint64_t size);
+
+//
+// Reads the trailer of an indexed container whose header was just read and checks that
+// the stream is exactly as long as header, blocks and trailer, and that the block count
+// matches size and payload. Leaves infile at block 0.
+//
+// Returns false if infile cannot seek or is not a complete indexed container.
+//
+bool container_read_index(FILE *infile, const container_header *header, container_index *index);
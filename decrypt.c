@@ -2,12 +2,15 @@
 #include "numtheory.h"
 #include "randstate.h"
 #include "ss.h"
+#include "gmpalloc.h"
+#include "keyfile.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <gmp.h>
 
-void decrypt_file(FILE *input_file, FILE *output_file, FILE *pvfile, bool verbose);
+bool decrypt_file(FILE *input_file, FILE *output_file, FILE *pvfile, bool verbose,
+    const batch_list *batch, const ss_file_opts *opts, size_t *failed);
 
 void print_help(void);
 void print_verbose(const mpz_t pq, const mpz_t d);
@@ -21,11 +24,19 @@ void print_verbose_mpz_var(const mpz_t var, const char *name);
 int main(int argc, char **argv) {
     bool help = false;
     bool verbose = false;
+    bool pool_alloc = false;
+    bool stats = false;
+    stats_format format = STATS_TEXT;
+    FILE *trace_file = NULL;
     FILE *input_file = stdin;
     FILE *output_file = stdout;
     FILE *pvfile = NULL;
+    const char *batch_path = NULL;
+    const char *batch_dir = NULL;
+    ss_file_opts opts = { .threads = 1 };
 
-    int response = argparser(argc, argv, &input_file, &output_file, &pvfile, &verbose, &help);
+    int response = argparser(argc, argv, true, &input_file, &output_file, &pvfile, &verbose,
+        &help, &pool_alloc, &stats, &format, &trace_file, &batch_path, &batch_dir, &opts);
 
     if (response != 0) {
         if (help) {
@@ -35,6 +46,7 @@ int main(int argc, char **argv) {
         check_null_and_close(input_file);
         check_null_and_close(output_file);
         check_null_and_close(pvfile);
+        check_null_and_close(trace_file);
         return -1;
     }
 
@@ -43,36 +55,99 @@ int main(int argc, char **argv) {
         if (!is_open) {
             fclose(input_file);
             fclose(output_file);
+            check_null_and_close(trace_file);
             return -2; //Fail
         }
     }
 
-    decrypt_file(input_file, output_file, pvfile, verbose);
+    batch_list batch = { 0 };
+    if (batch_path != NULL) {
+        if (!batch_list_load(&batch, batch_path, batch_dir)) {
+            fclose(input_file);
+            fclose(output_file);
+            fclose(pvfile);
+            check_null_and_close(trace_file);
+            return -3;
+        }
+        batch_list_schedule(&batch, opts.threads);
+    }
+
+    if (pool_alloc) {
+        gmpalloc_init(GMPALLOC_POOL); //Before GMP allocates anything
+        gmpalloc_op_begin();
+    }
+
+    if (stats) {
+        stats_enable();
+    }
+    if (trace_file != NULL) {
+        trace_enable();
+    }
+
+    size_t failed = 0;
+    bool key_loaded = decrypt_file(input_file, output_file, pvfile, verbose,
+        batch_path == NULL ? NULL : &batch, &opts, &failed);
+
+    if (pool_alloc) {
+        gmpalloc_print_stats(stderr, "decrypt");
+    }
+    if (stats) {
+        stats_report(stderr, "decrypt", format);
+    }
+    if (trace_file != NULL) {
+        trace_write(trace_file);
+        fclose(trace_file);
+    }
 
     fclose(input_file);
     fclose(output_file);
     fclose(pvfile);
+    batch_list_clear(&batch);
 
-    return 0;
+    if (!key_loaded) {
+        return -2; //Fail
+    }
+    return failed == 0 ? 0 : -3;
 }
 
 /*
-    Decrypt file function that reads pq, d values from private file and decrypt it with ss_decrypt_file
+    Decrypt file function that reads pq, d values from private file and decrypt it with ss_decrypt_file.
+    Keys that carry the CRT components get a CRT context, binary key files are loaded
+    with their precomputed context. With a batch list every file of it is decrypted
+    with the one key instead. Returns false if the key cannot be loaded, otherwise sets
+    failed to the number of files that could not be opened or decrypted.
 */
-void decrypt_file(FILE *input_file, FILE *output_file, FILE *pvfile, bool verbose) {
-    mpz_t d, pq;
-    mpz_inits(d, pq, NULL);
-
-    ss_read_priv(pq, d, pvfile);
+bool decrypt_file(FILE *input_file, FILE *output_file, FILE *pvfile, bool verbose,
+    const batch_list *batch, const ss_file_opts *opts, size_t *failed) {
+    ss_priv_ctx ctx;
+    if (keyfile_detect(pvfile)) {
+        if (!keyfile_read_priv(pvfile, &ctx)) {
+            fprintf(stderr, "Error reading the binary private key.\n");
+            return false;
+        }
+    } else {
+        mpz_t d, pq, p, q, dp, dq, qinv;
+        mpz_inits(d, pq, p, q, dp, dq, qinv, NULL);
+        if (ss_read_priv_crt(pq, d, p, q, dp, dq, qinv, pvfile)) {
+            ss_priv_ctx_init_crt(&ctx, pq, d, p, q, dp, dq, qinv);
+        } else {
+            ss_priv_ctx_init(&ctx, pq, d);
+        }
+        mpz_clears(d, pq, p, q, dp, dq, qinv, NULL);
+    }
 
     if (verbose) {
-        print_verbose(pq, d);
+        print_verbose(ctx.pq, ctx.d);
     }
 
-    ss_decrypt_file(input_file, output_file, d, pq);
-
-    mpz_clears(d, pq, NULL);
-    return;
+    *failed = 0;
+    if (batch != NULL) {
+        *failed = ss_decrypt_batch(batch, &ctx, opts);
+    } else {
+        *failed = ss_decrypt_file(input_file, output_file, &ctx, opts) ? 0 : 1;
+    }
+    ss_priv_ctx_clear(&ctx);
+    return true;
 }
 
 /*
@@ -110,5 +185,19 @@ void print_help(void) {
            "   -v              Display verbose program output.\n"
            "   -i infile       Input file of data to decrypt (default: stdin).\n"
            "   -o outfile      Output file for decrypted data (default: stdout).\n"
-           "   -n pvfile       Private key file (default: ss.priv).\n");
+           "   -n pvfile       Private key file, text or binary (default: ss.priv).\n"
+           "   -t threads      Worker threads for block decryption (default: 1).\n"
+           "   -m              Use the pooled GMP allocator and print allocation\n"
+           "                   statistics to stderr.\n"
+           "   --stats[=fmt]   Print operation counters, I/O and arithmetic time and\n"
+           "                   throughput to stderr, fmt is text (default) or json.\n"
+           "   --trace=file    Write a Chrome trace event timeline of every block stage\n"
+           "                   to file.\n"
+           "   --range=start:len\n"
+           "                   Decrypt only len bytes from byte start of data encrypted\n"
+           "                   with encrypt -I.\n"
+           "   -B list         Batch mode: decrypt every file of list, a manifest of\n"
+           "                   \"infile<TAB>outfile\" lines or a directory, with one key\n"
+           "                   load, files spread over the -t threads by size.\n"
+           "   -O dir          Output directory for batch files without an output name.\n");
 }
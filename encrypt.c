@@ -2,12 +2,15 @@
 #include "numtheory.h"
 #include "randstate.h"
 #include "ss.h"
+#include "gmpalloc.h"
+#include "keyfile.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <gmp.h>
 
-void encrypt_file(FILE *input_file, FILE *output_file, FILE *pbfile, bool verbose);
+bool encrypt_file(FILE *input_file, FILE *output_file, FILE *pbfile, bool verbose,
+    const batch_list *batch, const ss_file_opts *opts, size_t *failed);
 
 void print_help(void);
 void print_verbose(const char username[], const mpz_t n);
@@ -20,11 +23,19 @@ void print_verbose(const char username[], const mpz_t n);
 int main(int argc, char **argv) {
     bool help = false;
     bool verbose = false;
+    bool pool_alloc = false;
+    bool stats = false;
+    stats_format format = STATS_TEXT;
+    FILE *trace_file = NULL;
     FILE *input_file = stdin;
     FILE *output_file = stdout;
     FILE *pbfile = NULL;
+    const char *batch_path = NULL;
+    const char *batch_dir = NULL;
+    ss_file_opts opts = { .threads = 1 };
 
-    int response = argparser(argc, argv, &input_file, &output_file, &pbfile, &verbose, &help);
+    int response = argparser(argc, argv, false, &input_file, &output_file, &pbfile, &verbose,
+        &help, &pool_alloc, &stats, &format, &trace_file, &batch_path, &batch_dir, &opts);
 
     if (response != 0) {
         if (help) {
@@ -34,6 +45,7 @@ int main(int argc, char **argv) {
         check_null_and_close(input_file);
         check_null_and_close(output_file);
         check_null_and_close(pbfile);
+        check_null_and_close(trace_file);
         return -1;
     }
 
@@ -42,39 +54,103 @@ int main(int argc, char **argv) {
         if (!is_open) {
             fclose(input_file);
             fclose(output_file);
+            check_null_and_close(trace_file);
             return -2; //Fail
         }
     }
 
-    encrypt_file(input_file, output_file, pbfile, verbose);
+    batch_list batch = { 0 };
+    if (batch_path != NULL) {
+        if (!batch_list_load(&batch, batch_path, batch_dir)) {
+            fclose(input_file);
+            fclose(output_file);
+            fclose(pbfile);
+            check_null_and_close(trace_file);
+            return -3;
+        }
+        batch_list_schedule(&batch, opts.threads);
+    }
+
+    if (pool_alloc) {
+        gmpalloc_init(GMPALLOC_POOL); //Before GMP allocates anything
+        gmpalloc_op_begin();
+    }
+
+    if (stats) {
+        stats_enable();
+    }
+    if (trace_file != NULL) {
+        trace_enable();
+    }
+
+    size_t failed = 0;
+    bool key_loaded = encrypt_file(input_file, output_file, pbfile, verbose,
+        batch_path == NULL ? NULL : &batch, &opts, &failed);
+
+    if (pool_alloc) {
+        gmpalloc_print_stats(stderr, "encrypt");
+    }
+    if (stats) {
+        stats_report(stderr, "encrypt", format);
+    }
+    if (trace_file != NULL) {
+        trace_write(trace_file);
+        fclose(trace_file);
+    }
 
     fclose(pbfile);
     fclose(input_file);
     fclose(output_file);
+    batch_list_clear(&batch);
 
-    return 0;
+    if (!key_loaded) {
+        return -2; //Fail
+    }
+    return failed == 0 ? 0 : -3;
 }
 
 /*
     Encrypt file function that reads n, username values from private file and encrypt it with ss_encrypt_file
+    Binary key files are loaded with their precomputed context.
+    With a batch list every file of it is encrypted with the one key instead.
+    Returns false if the key cannot be loaded, otherwise sets failed to the number of
+    batch files that could not be opened.
 */
-void encrypt_file(FILE *input_file, FILE *output_file, FILE *pbfile, bool verbose) {
+bool encrypt_file(FILE *input_file, FILE *output_file, FILE *pbfile, bool verbose,
+    const batch_list *batch, const ss_file_opts *opts, size_t *failed) {
     char username[_POSIX_LOGIN_NAME_MAX];
     memset(username, 0, _POSIX_LOGIN_NAME_MAX); //Clear username buffer
 
     mpz_t n;
     mpz_init(n);
 
-    ss_read_pub(n, username, pbfile);
+    ss_pub_ctx ctx;
+    if (keyfile_detect(pbfile)) {
+        if (!keyfile_read_pub(pbfile, &ctx, username, _POSIX_LOGIN_NAME_MAX)) {
+            fprintf(stderr, "Error reading the binary public key.\n");
+            mpz_clear(n);
+            return false;
+        }
+        mpz_set(n, ctx.n);
+    } else {
+        ss_read_pub(n, username, pbfile);
+        ss_pub_ctx_init(&ctx, n);
+    }
 
     if (verbose) {
         print_verbose(username, n);
     }
 
-    ss_encrypt_file(input_file, output_file, n);
+    *failed = 0;
+    if (batch != NULL) {
+        *failed = ss_encrypt_batch(batch, &ctx, opts);
+    } else {
+        ss_encrypt_file(input_file, output_file, &ctx, opts);
+    }
+    ss_pub_ctx_clear(&ctx);
 
     mpz_clear(n);
-    return;
+    return true;
 }
 
 /*
@@ -104,5 +180,21 @@ void print_help(void) {
            "   -v              Display verbose program output.\n"
            "   -i infile       Input file of data to encrypt (default: stdin).\n"
            "   -o outfile      Output file for encrypted data (default: stdout).\n"
-           "   -n pbfile       Public key file (default: ss.pub).\n");
+           "   -n pbfile       Public key file, text or binary (default: ss.pub).\n"
+           "   -t threads      Worker threads for block encryption (default: 1).\n"
+           "   -m              Use the pooled GMP allocator and print allocation\n"
+           "                   statistics to stderr.\n"
+           "   --stats[=fmt]   Print operation counters, I/O and arithmetic time and\n"
+           "                   throughput to stderr, fmt is text (default) or json.\n"
+           "   --trace=file    Write a Chrome trace event timeline of every block stage\n"
+           "                   to file.\n"
+           "   -x              Write hexadecimal text blocks instead of the binary format.\n"
+           "   -H              Hybrid mode: SS encrypt a random session key and encrypt the\n"
+           "                   data with ChaCha20-Poly1305 under it.\n"
+           "   -I              Append a trailer with the block size so decrypt --range\n"
+           "                   can decrypt part of the data. Needs a seekable outfile.\n"
+           "   -B list         Batch mode: encrypt every file of list, a manifest of\n"
+           "                   \"infile<TAB>outfile\" lines or a directory, with one key\n"
+           "                   load, files spread over the -t threads by size.\n"
+           "   -O dir          Output directory for batch files without an output name.\n");
 }
@@ -0,0 +1,273 @@
+#include "gmpalloc.h"
+
+#include <gmp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+//Smallest size class, header included
+#define GMPALLOC_MIN_SHIFT 6
+//Size classes 2^6 .. 2^16 bytes
+#define GMPALLOC_CLASSES 11
+//Marks blocks that came straight from malloc
+#define GMPALLOC_LARGE GMPALLOC_CLASSES
+//Bytes each thread keeps cached per size class, at least GMPALLOC_MIN_CACHED blocks
+#define GMPALLOC_CACHE_BYTES (1u << 18)
+#define GMPALLOC_MIN_CACHED  4
+
+//Placed in front of every block. 16 bytes, so the block keeps malloc's alignment.
+typedef struct {
+    uint32_t cls;
+    uint32_t unused;
+    uint64_t size; //Bytes GMP asked for
+} block_header;
+
+//A cached block reuses its data area as the free list link
+typedef struct free_block {
+    struct free_block *next;
+} free_block;
+
+//Free lists of one thread
+typedef struct {
+    free_block *head[GMPALLOC_CLASSES];
+    uint32_t count[GMPALLOC_CLASSES];
+    bool registered;
+} thread_cache;
+
+gmpalloc_mode alloc_mode = GMPALLOC_COUNT;
+atomic_bool alloc_installed = false;
+
+_Atomic uint64_t stat_allocs = 0;
+_Atomic uint64_t stat_reallocs = 0;
+_Atomic uint64_t stat_frees = 0;
+_Atomic uint64_t stat_pool_hits = 0;
+_Atomic uint64_t stat_bytes = 0;
+_Atomic uint64_t stat_peak = 0;
+_Atomic uint64_t stat_op_peak = 0;
+_Atomic uint64_t op_start_allocs = 0;
+_Atomic uint64_t op_start_reallocs = 0;
+
+_Thread_local thread_cache cache;
+pthread_key_t cache_key;
+pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+//Helper functions not in header file
+void *gmpalloc_alloc(size_t size);
+void *gmpalloc_realloc(void *ptr, size_t old_size, size_t new_size);
+void gmpalloc_free(void *ptr, size_t size);
+uint32_t size_class(size_t total);
+block_header *take_block(uint32_t cls, size_t total);
+void give_block(block_header *header);
+void flush_cache(void *arg);
+void create_cache_key(void);
+void track_bytes(uint64_t add, uint64_t sub);
+
+void gmpalloc_init(gmpalloc_mode mode) {
+    if (atomic_exchange(&alloc_installed, true)) {
+        return;
+    }
+    alloc_mode = mode;
+    mp_set_memory_functions(gmpalloc_alloc, gmpalloc_realloc, gmpalloc_free);
+    return;
+}
+
+bool gmpalloc_installed(void) {
+    return atomic_load(&alloc_installed);
+}
+
+void gmpalloc_op_begin(void) {
+    atomic_store(&op_start_allocs, atomic_load(&stat_allocs));
+    atomic_store(&op_start_reallocs, atomic_load(&stat_reallocs));
+    atomic_store(&stat_op_peak, atomic_load(&stat_bytes));
+    return;
+}
+
+void gmpalloc_get_stats(gmpalloc_stats *stats) {
+    stats->allocs = atomic_load(&stat_allocs);
+    stats->reallocs = atomic_load(&stat_reallocs);
+    stats->frees = atomic_load(&stat_frees);
+    stats->pool_hits = atomic_load(&stat_pool_hits);
+    stats->bytes = atomic_load(&stat_bytes);
+    stats->peak_bytes = atomic_load(&stat_peak);
+    stats->op_allocs = stats->allocs - atomic_load(&op_start_allocs);
+    stats->op_reallocs = stats->reallocs - atomic_load(&op_start_reallocs);
+    stats->op_peak_bytes = atomic_load(&stat_op_peak);
+    return;
+}
+
+void gmpalloc_print_stats(FILE *out, const char *op) {
+    gmpalloc_stats stats;
+    gmpalloc_get_stats(&stats);
+    fprintf(out,
+        "%s: %llu gmp allocations, %llu reallocs, peak %llu bytes (process: %llu allocations, "
+        "%llu from the pool, peak %llu bytes)\n",
+        op, (unsigned long long) stats.op_allocs, (unsigned long long) stats.op_reallocs,
+        (unsigned long long) stats.op_peak_bytes, (unsigned long long) stats.allocs,
+        (unsigned long long) stats.pool_hits, (unsigned long long) stats.peak_bytes);
+    return;
+}
+
+/*
+    Adds add and removes sub live bytes, raising both peaks if needed.
+*/
+void track_bytes(uint64_t add, uint64_t sub) {
+    if (add <= sub) {
+        atomic_fetch_sub_explicit(&stat_bytes, sub - add, memory_order_relaxed);
+        return;
+    }
+    uint64_t grow = add - sub;
+    uint64_t now = atomic_fetch_add_explicit(&stat_bytes, grow, memory_order_relaxed) + grow;
+
+    uint64_t peak = atomic_load_explicit(&stat_peak, memory_order_relaxed);
+    while (now > peak
+           && !atomic_compare_exchange_weak_explicit(
+               &stat_peak, &peak, now, memory_order_relaxed, memory_order_relaxed)) {
+    }
+    peak = atomic_load_explicit(&stat_op_peak, memory_order_relaxed);
+    while (now > peak
+           && !atomic_compare_exchange_weak_explicit(
+               &stat_op_peak, &peak, now, memory_order_relaxed, memory_order_relaxed)) {
+    }
+    return;
+}
+
+/*
+    Size class of a block of total bytes (header included), GMPALLOC_LARGE if it is not
+    pooled.
+*/
+uint32_t size_class(size_t total) {
+    if (alloc_mode != GMPALLOC_POOL || total > GMPALLOC_MAX_POOLED) {
+        return GMPALLOC_LARGE;
+    }
+    uint32_t cls = 0;
+    while (((size_t) 1 << (GMPALLOC_MIN_SHIFT + cls)) < total) {
+        cls++;
+    }
+    return cls;
+}
+
+void create_cache_key(void) {
+    pthread_key_create(&cache_key, flush_cache);
+    return;
+}
+
+/*
+    Hands a thread's cached blocks back to malloc when the thread exits.
+*/
+void flush_cache(void *arg) {
+    thread_cache *c = (thread_cache *) arg;
+    for (uint32_t i = 0; i < GMPALLOC_CLASSES; i++) {
+        while (c->head[i] != NULL) {
+            free_block *next = c->head[i]->next;
+            free(c->head[i]);
+            c->head[i] = next;
+        }
+        c->count[i] = 0;
+    }
+    return;
+}
+
+/*
+    Gets a block of class cls from this thread's free list, or from malloc.
+*/
+block_header *take_block(uint32_t cls, size_t total) {
+    if (cls == GMPALLOC_LARGE) {
+        return (block_header *) malloc(total);
+    }
+    free_block *block = cache.head[cls];
+    if (block != NULL) {
+        cache.head[cls] = block->next;
+        cache.count[cls]--;
+        atomic_fetch_add_explicit(&stat_pool_hits, 1, memory_order_relaxed);
+        return (block_header *) block;
+    }
+    return (block_header *) malloc((size_t) 1 << (GMPALLOC_MIN_SHIFT + cls));
+}
+
+/*
+    Puts a block on this thread's free list, or back to malloc if the list is full.
+    Blocks freed by another thread than the one that allocated them simply change lists.
+*/
+void give_block(block_header *header) {
+    uint32_t cls = header->cls;
+    if (cls == GMPALLOC_LARGE) {
+        free(header);
+        return;
+    }
+    uint32_t cap = GMPALLOC_CACHE_BYTES >> (GMPALLOC_MIN_SHIFT + cls);
+    if (cache.count[cls] >= (cap > GMPALLOC_MIN_CACHED ? cap : GMPALLOC_MIN_CACHED)) {
+        free(header);
+        return;
+    }
+    if (!cache.registered) {
+        pthread_once(&cache_key_once, create_cache_key);
+        pthread_setspecific(cache_key, &cache);
+        cache.registered = true;
+    }
+    free_block *block = (free_block *) header;
+    block->next = cache.head[cls];
+    cache.head[cls] = block;
+    cache.count[cls]++;
+    return;
+}
+
+void *gmpalloc_alloc(size_t size) {
+    size_t total = size + sizeof(block_header);
+    uint32_t cls = size_class(total);
+    block_header *header = take_block(cls, total);
+    if (header == NULL) {
+        fprintf(stderr, "gmpalloc: out of memory\n");
+        abort();
+    }
+    header->cls = cls;
+    header->size = size;
+    atomic_fetch_add_explicit(&stat_allocs, 1, memory_order_relaxed);
+    track_bytes(size, 0);
+    return header + 1;
+}
+
+/*
+    Grows or shrinks in place while the new size still fits the block's class.
+*/
+void *gmpalloc_realloc(void *ptr, size_t old_size, size_t new_size) {
+    (void) old_size;
+    block_header *header = (block_header *) ptr - 1;
+    size_t total = new_size + sizeof(block_header);
+    uint32_t cls = size_class(total);
+    uint64_t previous = header->size;
+    atomic_fetch_add_explicit(&stat_reallocs, 1, memory_order_relaxed);
+
+    if (cls == header->cls && cls != GMPALLOC_LARGE) {
+        header->size = new_size;
+    } else if (cls == GMPALLOC_LARGE && header->cls == GMPALLOC_LARGE) {
+        header = (block_header *) realloc(header, total);
+        if (header == NULL) {
+            fprintf(stderr, "gmpalloc: out of memory\n");
+            abort();
+        }
+        header->size = new_size;
+    } else {
+        block_header *moved = take_block(cls, total);
+        if (moved == NULL) {
+            fprintf(stderr, "gmpalloc: out of memory\n");
+            abort();
+        }
+        memcpy(moved + 1, header + 1, previous < new_size ? previous : new_size);
+        moved->cls = cls;
+        moved->size = new_size;
+        give_block(header);
+        header = moved;
+    }
+    track_bytes(new_size, previous);
+    return header + 1;
+}
+
+void gmpalloc_free(void *ptr, size_t size) {
+    (void) size;
+    block_header *header = (block_header *) ptr - 1;
+    atomic_fetch_add_explicit(&stat_frees, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&stat_bytes, header->size, memory_order_relaxed);
+    give_block(header);
+    return;
+}
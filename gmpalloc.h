@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Optional memory functions for GMP, installed with mp_set_memory_functions.
+//
+//  GMPALLOC_COUNT: every block still comes from malloc, only the statistics are kept
+//  GMPALLOC_POOL:  blocks up to GMPALLOC_MAX_POOLED bytes are rounded up to a power of
+//                  two size class and recycled through per-thread free lists, so the
+//                  short-lived limb buffers of numtheory.c and ss.c rarely reach malloc
+//
+typedef enum { GMPALLOC_COUNT = 0, GMPALLOC_POOL } gmpalloc_mode;
+
+#define GMPALLOC_MAX_POOLED (1u << 16)
+
+//
+// Counters since gmpalloc_init. The op_ fields cover the current operation, started
+// by the last gmpalloc_op_begin. Bytes are the sizes GMP asked for, without the
+// rounding to size classes.
+//
+typedef struct {
+    uint64_t allocs;
+    uint64_t reallocs;
+    uint64_t frees;
+    uint64_t pool_hits; //Allocations served from a free list
+    uint64_t bytes; //Live bytes
+    uint64_t peak_bytes;
+    uint64_t op_allocs;
+    uint64_t op_reallocs;
+    uint64_t op_peak_bytes;
+} gmpalloc_stats;
+
+//
+// Installs the memory functions for mode. Must be called before GMP allocates anything
+// (before randstate_init and before any mpz_t is initialized), since blocks from the
+// default functions cannot be freed through these. Only the first call has an effect.
+//
+void gmpalloc_init(gmpalloc_mode mode);
+
+//
+// Returns true once gmpalloc_init has installed the memory functions.
+//
+bool gmpalloc_installed(void);
+
+//
+// Starts a new operation: the op_ counters restart and the op peak drops to the bytes
+// live right now.
+//
+void gmpalloc_op_begin(void);
+
+void gmpalloc_get_stats(gmpalloc_stats *stats);
+
+//
+// Writes one line of statistics for the current operation op to out.
+//
+void gmpalloc_print_stats(FILE *out, const char *op);
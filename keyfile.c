@@ -0,0 +1,467 @@
+#include "keyfile.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+//FNV-1a, 64-bit
+#define KEYFILE_HASH_BASIS UINT64_C(0xcbf29ce484222325)
+#define KEYFILE_HASH_PRIME UINT64_C(0x100000001b3)
+
+#define WORD_BYTES sizeof(uint64_t)
+
+//File being built by a keyfile_write function
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    bool failed; //Out of memory
+} key_writer;
+
+//Mapped key file. Fields are read from pos up to end, where the hash starts.
+typedef struct {
+    const uint8_t *data;
+    size_t size; //Bytes mapped
+    size_t pos;
+    size_t end;
+    bool ok; //Cleared by the first read past end
+} key_reader;
+
+//Helper functions not in header file
+uint64_t key_hash(const uint8_t *data, size_t size);
+void put_bytes(key_writer *w, const void *bytes, size_t count);
+void put_word(key_writer *w, uint64_t word);
+void put_number(key_writer *w, const mpz_t x);
+void put_modulus(key_writer *w, const mont_modulus *m);
+void put_recoding(key_writer *w, const exp_recoding *r);
+void begin_key(key_writer *w, keyfile_kind kind);
+bool finish_key(key_writer *w, FILE *file);
+bool map_key(FILE *file, key_reader *r, keyfile_kind *kind);
+void unmap_key(key_reader *r);
+const uint8_t *get_bytes(key_reader *r, size_t count);
+uint64_t get_word(key_reader *r);
+bool get_number(key_reader *r, mpz_t x);
+bool get_modulus(key_reader *r, mont_modulus *m);
+bool get_recoding(key_reader *r, exp_recoding *e);
+bool get_plain(key_reader *r, ss_priv_ctx *ctx);
+bool get_crt(key_reader *r, ss_priv_ctx *ctx);
+bool key_consistent(const ss_priv_ctx *ctx, uint64_t k);
+
+uint64_t key_hash(const uint8_t *data, size_t size) {
+    uint64_t hash = KEYFILE_HASH_BASIS;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * KEYFILE_HASH_PRIME;
+    }
+    return hash;
+}
+
+/*
+    Appends count bytes, zero padded to a whole word.
+*/
+void put_bytes(key_writer *w, const void *bytes, size_t count) {
+    size_t padded = (count + WORD_BYTES - 1) / WORD_BYTES * WORD_BYTES;
+    if (w->size + padded > w->capacity) {
+        size_t capacity = 2 * (w->size + padded);
+        uint8_t *data = (uint8_t *) realloc(w->data, capacity);
+        if (data == NULL) {
+            w->failed = true;
+            return;
+        }
+        w->data = data;
+        w->capacity = capacity;
+    }
+    memcpy(w->data + w->size, bytes, count);
+    memset(w->data + w->size + count, 0, padded - count);
+    w->size += padded;
+    return;
+}
+
+void put_word(key_writer *w, uint64_t word) {
+    put_bytes(w, &word, WORD_BYTES);
+    return;
+}
+
+void put_number(key_writer *w, const mpz_t x) {
+    put_word(w, mpz_size(x));
+    put_bytes(w, mpz_limbs_read(x), mpz_size(x) * sizeof(mp_limb_t));
+    return;
+}
+
+void put_modulus(key_writer *w, const mont_modulus *m) {
+    put_word(w, (uint64_t) m->size);
+    put_word(w, m->minv);
+    put_bytes(w, m->mod, (size_t) m->size * sizeof(mp_limb_t));
+    put_bytes(w, m->r2, (size_t) m->size * sizeof(mp_limb_t));
+    return;
+}
+
+void put_recoding(key_writer *w, const exp_recoding *r) {
+    put_word(w, r->window);
+    put_word(w, r->tail);
+    put_word(w, r->count);
+    put_bytes(w, r->shift, r->count * sizeof(uint32_t));
+    put_bytes(w, r->digit, r->count * sizeof(uint32_t));
+    return;
+}
+
+/*
+    Starts w with the header of kind, its size is filled in by finish_key.
+*/
+void begin_key(key_writer *w, keyfile_kind kind) {
+    *w = (key_writer) { 0 };
+    uint8_t head[8] = { 0 };
+    memcpy(head, KEYFILE_MAGIC, 3);
+    head[3] = KEYFILE_VERSION;
+    head[4] = (uint8_t) kind;
+    head[5] = sizeof(mp_limb_t);
+    put_bytes(w, head, sizeof(head));
+    put_word(w, KEYFILE_BYTE_ORDER);
+    put_word(w, 0);
+    return;
+}
+
+/*
+    Fills in the size, appends the hash and writes the whole file at once.
+*/
+bool finish_key(key_writer *w, FILE *file) {
+    put_word(w, 0); //Room for the hash
+    bool written = false;
+    if (!w->failed) {
+        uint64_t size = w->size;
+        memcpy(w->data + 16, &size, WORD_BYTES);
+        uint64_t hash = key_hash(w->data, w->size - WORD_BYTES);
+        memcpy(w->data + w->size - WORD_BYTES, &hash, WORD_BYTES);
+        written = fwrite(w->data, sizeof(uint8_t), w->size, file) == w->size;
+    }
+    free(w->data);
+    return written;
+}
+
+bool keyfile_detect(FILE *file) {
+    int c = getc(file);
+    if (c == EOF) {
+        return false;
+    }
+    ungetc(c, file);
+    return c == KEYFILE_MAGIC[0];
+}
+
+bool keyfile_write_pub(FILE *pbfile, const ss_pub_ctx *ctx, const char *username) {
+    key_writer w;
+    begin_key(&w, KEYFILE_PUBLIC);
+    put_word(&w, ctx->k);
+    put_word(&w, ctx->width);
+    put_word(&w, strlen(username));
+    put_bytes(&w, username, strlen(username));
+    put_modulus(&w, &ctx->mont);
+    put_recoding(&w, &ctx->exp);
+    return finish_key(&w, pbfile);
+}
+
+bool keyfile_write_priv(FILE *pvfile, const ss_priv_ctx *ctx) {
+    key_writer w;
+    begin_key(&w, ctx->crt ? KEYFILE_PRIVATE_CRT : KEYFILE_PRIVATE);
+    put_word(&w, ctx->k);
+    if (ctx->crt) {
+        put_number(&w, ctx->pq);
+        put_number(&w, ctx->d);
+        put_number(&w, ctx->dp);
+        put_number(&w, ctx->dq);
+        put_number(&w, ctx->qinv);
+        put_modulus(&w, &ctx->mont_p);
+        put_modulus(&w, &ctx->mont_q);
+        put_recoding(&w, &ctx->exp_dp);
+        put_recoding(&w, &ctx->exp_dq);
+    } else {
+        put_number(&w, ctx->d);
+        put_modulus(&w, &ctx->mont_pq);
+        put_recoding(&w, &ctx->exp_d);
+    }
+    return finish_key(&w, pvfile);
+}
+
+/*
+    Maps the whole of file, which must be a regular file, and checks its header and hash.
+    Sets kind and leaves r at the first field.
+*/
+bool map_key(FILE *file, key_reader *r, keyfile_kind *kind) {
+    *r = (key_reader) { 0 };
+    struct stat info;
+    if (fstat(fileno(file), &info) != 0 || !S_ISREG(info.st_mode)
+        || info.st_size < (off_t) (KEYFILE_HEADER_SIZE + WORD_BYTES)
+        || info.st_size % (off_t) WORD_BYTES != 0) {
+        return false;
+    }
+    size_t size = (size_t) info.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (map == MAP_FAILED) {
+        return false;
+    }
+    r->data = (const uint8_t *) map;
+    r->size = size;
+
+    uint64_t order, recorded, hash;
+    memcpy(&order, r->data + 8, WORD_BYTES);
+    memcpy(&recorded, r->data + 16, WORD_BYTES);
+    memcpy(&hash, r->data + size - WORD_BYTES, WORD_BYTES);
+    *kind = (keyfile_kind) r->data[4];
+    if (memcmp(r->data, KEYFILE_MAGIC, 3) != 0 || r->data[3] != KEYFILE_VERSION
+        || r->data[5] != sizeof(mp_limb_t) || order != KEYFILE_BYTE_ORDER || recorded != size
+        || hash != key_hash(r->data, size - WORD_BYTES)) {
+        unmap_key(r);
+        return false;
+    }
+    r->pos = KEYFILE_HEADER_SIZE;
+    r->end = size - WORD_BYTES;
+    r->ok = true;
+    return true;
+}
+
+void unmap_key(key_reader *r) {
+    munmap((void *) r->data, r->size);
+    return;
+}
+
+/*
+    Returns the next count bytes and skips their padding, NULL (and clears r->ok) if
+    they run past the fields.
+*/
+const uint8_t *get_bytes(key_reader *r, size_t count) {
+    size_t padded = (count + WORD_BYTES - 1) / WORD_BYTES * WORD_BYTES;
+    if (!r->ok || count > r->end - r->pos || padded > r->end - r->pos) {
+        r->ok = false;
+        return NULL;
+    }
+    const uint8_t *bytes = r->data + r->pos;
+    r->pos += padded;
+    return bytes;
+}
+
+uint64_t get_word(key_reader *r) {
+    uint64_t word = 0;
+    const uint8_t *bytes = get_bytes(r, WORD_BYTES);
+    if (bytes != NULL) {
+        memcpy(&word, bytes, WORD_BYTES);
+    }
+    return word;
+}
+
+/*
+    Reads a number into x, which must be initialized.
+*/
+bool get_number(key_reader *r, mpz_t x) {
+    uint64_t size = get_word(r);
+    if (size > (r->end - r->pos) / sizeof(mp_limb_t)) {
+        r->ok = false;
+        return false;
+    }
+    const uint8_t *limbs = get_bytes(r, size * sizeof(mp_limb_t));
+    if (limbs == NULL) {
+        return false;
+    }
+    mpz_import(x, size, -1, sizeof(mp_limb_t), 0, 0, limbs);
+    return true;
+}
+
+/*
+    Reads a modulus into m, which must be cleared with mont_clear if true is returned.
+*/
+bool get_modulus(key_reader *r, mont_modulus *m) {
+    uint64_t size = get_word(r);
+    mp_limb_t minv = get_word(r);
+    if (size == 0 || size > (r->end - r->pos) / (2 * sizeof(mp_limb_t))) {
+        r->ok = false;
+        return false;
+    }
+    const uint8_t *mod = get_bytes(r, size * sizeof(mp_limb_t));
+    const uint8_t *r2 = get_bytes(r, size * sizeof(mp_limb_t));
+    return r->ok
+           && mont_load(m, (const mp_limb_t *) mod, (const mp_limb_t *) r2, (mp_size_t) size,
+               minv);
+}
+
+/*
+    Reads a recoding into e, which must be cleared with exp_recoding_clear if true is returned.
+*/
+bool get_recoding(key_reader *r, exp_recoding *e) {
+    uint64_t window = get_word(r);
+    uint64_t tail = get_word(r);
+    uint64_t count = get_word(r);
+    if (window > UINT32_MAX || tail > UINT32_MAX
+        || count > (r->end - r->pos) / (2 * sizeof(uint32_t))) {
+        r->ok = false;
+        return false;
+    }
+    const uint8_t *shift = get_bytes(r, count * sizeof(uint32_t));
+    const uint8_t *digit = get_bytes(r, count * sizeof(uint32_t));
+    return r->ok
+           && exp_recoding_load(e, (uint32_t) window, count, (uint32_t) tail,
+               (const uint32_t *) shift, (const uint32_t *) digit);
+}
+
+bool keyfile_read_pub(FILE *pbfile, ss_pub_ctx *ctx, char *username, size_t size) {
+    key_reader r;
+    keyfile_kind kind;
+    if (!map_key(pbfile, &r, &kind)) {
+        return false;
+    }
+    uint64_t k = get_word(&r);
+    uint64_t width = get_word(&r);
+    uint64_t name_len = get_word(&r);
+    const uint8_t *name = get_bytes(&r, name_len);
+
+    bool ok = kind == KEYFILE_PUBLIC && r.ok && get_modulus(&r, &ctx->mont);
+    if (ok && !get_recoding(&r, &ctx->exp)) {
+        mont_clear(&ctx->mont);
+        ok = false;
+    }
+    if (ok
+        && (r.pos != r.end || k < 2 || k >= width
+            || width != (mpz_sizeinbase(ctx->mont.mod_z, 2) + 7) / 8)) {
+        exp_recoding_clear(&ctx->exp);
+        mont_clear(&ctx->mont);
+        ok = false;
+    }
+    if (ok) {
+        size_t len = name_len < size - 1 ? name_len : size - 1;
+        memcpy(username, name, len);
+        username[len] = '\0';
+
+        mpz_init_set(ctx->n, ctx->mont.mod_z);
+        ctx->k = k;
+        ctx->width = (uint32_t) width;
+        ss_pub_ctx_finish(ctx);
+    }
+    unmap_key(&r);
+    return ok;
+}
+
+/*
+    Reads d, the modulus pq and the recoding of d. Checks nothing follows them.
+*/
+bool get_plain(key_reader *r, ss_priv_ctx *ctx) {
+    if (!get_number(r, ctx->d) || !get_modulus(r, &ctx->mont_pq)) {
+        return false;
+    }
+    if (!get_recoding(r, &ctx->exp_d)) {
+        mont_clear(&ctx->mont_pq);
+        return false;
+    }
+    if (r->pos != r->end) {
+        exp_recoding_clear(&ctx->exp_d);
+        mont_clear(&ctx->mont_pq);
+        return false;
+    }
+    mpz_set(ctx->pq, ctx->mont_pq.mod_z);
+    return true;
+}
+
+/*
+    Reads the CRT fields of a private key. Checks nothing follows them.
+*/
+bool get_crt(key_reader *r, ss_priv_ctx *ctx) {
+    bool numbers = get_number(r, ctx->pq) && get_number(r, ctx->d) && get_number(r, ctx->dp)
+                   && get_number(r, ctx->dq) && get_number(r, ctx->qinv);
+    if (!numbers || !get_modulus(r, &ctx->mont_p)) {
+        return false;
+    }
+    if (!get_modulus(r, &ctx->mont_q)) {
+        mont_clear(&ctx->mont_p);
+        return false;
+    }
+    if (!get_recoding(r, &ctx->exp_dp)) {
+        mont_clear(&ctx->mont_q);
+        mont_clear(&ctx->mont_p);
+        return false;
+    }
+    if (!get_recoding(r, &ctx->exp_dq)) {
+        exp_recoding_clear(&ctx->exp_dp);
+        mont_clear(&ctx->mont_q);
+        mont_clear(&ctx->mont_p);
+        return false;
+    }
+    if (r->pos != r->end) {
+        exp_recoding_clear(&ctx->exp_dq);
+        exp_recoding_clear(&ctx->exp_dp);
+        mont_clear(&ctx->mont_q);
+        mont_clear(&ctx->mont_p);
+        return false;
+    }
+    mpz_set(ctx->p, ctx->mont_p.mod_z);
+    mpz_set(ctx->q, ctx->mont_q.mod_z);
+    return true;
+}
+
+/*
+    Checks the fields of a private key against pq and d. k must be the one
+    ss_priv_ctx_init derives from pq, and CRT keys must have p * q = pq like
+    ss_read_priv_crt checks for text keys, dp = d mod (p - 1), dq = d mod (q - 1) and
+    qinv * q = 1 mod p.
+*/
+bool key_consistent(const ss_priv_ctx *ctx, uint64_t k) {
+    if (k != (mpz_sizeinbase(ctx->pq, 2) - 1) / 8) {
+        return false;
+    }
+    if (!ctx->crt) {
+        return true;
+    }
+
+    mpz_t temp, rem;
+    mpz_inits(temp, rem, NULL);
+    mpz_mul(temp, ctx->p, ctx->q); //temp = p * q
+    bool valid = mpz_cmp(temp, ctx->pq) == 0;
+
+    mpz_sub_ui(temp, ctx->p, 1); //temp = p - 1
+    valid = valid && mpz_sgn(temp) > 0;
+    if (valid) {
+        mpz_mod(rem, ctx->d, temp); //rem = d % (p - 1)
+        valid = mpz_cmp(rem, ctx->dp) == 0;
+    }
+    mpz_sub_ui(temp, ctx->q, 1); //temp = q - 1
+    valid = valid && mpz_sgn(temp) > 0;
+    if (valid) {
+        mpz_mod(rem, ctx->d, temp); //rem = d % (q - 1)
+        valid = mpz_cmp(rem, ctx->dq) == 0;
+    }
+    if (valid) {
+        mpz_mul(temp, ctx->qinv, ctx->q);
+        mpz_mod(rem, temp, ctx->p); //rem = qinv * q % p
+        valid = mpz_cmp_ui(rem, 1) == 0;
+    }
+    mpz_clears(temp, rem, NULL);
+    return valid;
+}
+
+bool keyfile_read_priv(FILE *pvfile, ss_priv_ctx *ctx) {
+    key_reader r;
+    keyfile_kind kind;
+    if (!map_key(pvfile, &r, &kind)) {
+        return false;
+    }
+    uint64_t k = get_word(&r);
+
+    mpz_inits(ctx->pq, ctx->d, ctx->p, ctx->q, ctx->dp, ctx->dq, ctx->qinv, NULL);
+    ctx->crt = kind == KEYFILE_PRIVATE_CRT;
+    bool ok = r.ok && k >= 2;
+    if (ok && kind == KEYFILE_PRIVATE) {
+        ok = get_plain(&r, ctx);
+    } else if (ok && kind == KEYFILE_PRIVATE_CRT) {
+        ok = get_crt(&r, ctx);
+    } else {
+        ok = false;
+    }
+
+    if (ok) {
+        ctx->k = k;
+        ss_priv_ctx_finish(ctx);
+        if (!key_consistent(ctx, k)) {
+            ss_priv_ctx_clear(ctx);
+            ok = false;
+        }
+    } else {
+        mpz_clears(ctx->pq, ctx->d, ctx->p, ctx->q, ctx->dp, ctx->dq, ctx->qinv, NULL);
+    }
+    unmap_key(&r);
+    return ok;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ss.h"
+
+//
+// Precomputed binary key files, written by keygen next to the text keys. They hold
+// everything ss_pub_ctx_init and ss_priv_ctx_init(_crt) derive from a key, so loading
+// one is a single mmap, a checksum and copies instead of hex parsing, square roots,
+// divisions for R^2 and scans of the exponents.
+//
+// Layout (integers are 64-bit words in the byte order of the machine that wrote the
+// file, files from a machine of the other order or limb size are rejected):
+//  magic:    3 bytes "SSK"
+//  version:  1 byte
+//  kind:     1 byte, KEYFILE_PUBLIC, KEYFILE_PRIVATE or KEYFILE_PRIVATE_CRT
+//  limb:     1 byte, bytes per limb (8)
+//  reserved: 2 bytes, 0
+//  order:    word, KEYFILE_BYTE_ORDER
+//  size:     word, bytes in the whole file
+//  followed by the fields of the kind and a word holding the FNV-1a hash of every
+//  byte before it.
+//
+// Fields:
+//  word:      one word
+//  number:    limb count, then the limbs, least significant first
+//  modulus:   limb count s, -n^-1 % 2^64, the s limbs of n, the s limbs of R^2 % n
+//  recoding:  window, tail, count, then count 32-bit shifts and count 32-bit digits,
+//             each array zero padded to a whole word
+//  text:      byte count, then the bytes, zero padded to a whole word
+//
+// Kinds:
+//  KEYFILE_PUBLIC:      word k, word width, text username, modulus n, recoding of n
+//  KEYFILE_PRIVATE:     word k, number d, modulus pq, recoding of d
+//  KEYFILE_PRIVATE_CRT: word k, number pq, number d, number dp, number dq, number qinv,
+//                       modulus p, modulus q, recoding of dp, recoding of dq
+//
+
+#define KEYFILE_MAGIC       "SSK"
+#define KEYFILE_VERSION     1
+#define KEYFILE_HEADER_SIZE 24
+#define KEYFILE_BYTE_ORDER  UINT64_C(0x0102030405060708)
+
+typedef enum { KEYFILE_PUBLIC = 1, KEYFILE_PRIVATE, KEYFILE_PRIVATE_CRT } keyfile_kind;
+
+//
+// Peeks at the next byte of file without consuming it.
+//
+// Returns true if file starts like a binary key file. Text keys start with a hex digit.
+//
+bool keyfile_detect(FILE *file);
+
+//
+// Writes the precomputed state of a public key context and the key holder's name.
+//
+// Returns false if writing failed.
+//
+bool keyfile_write_pub(FILE *pbfile, const ss_pub_ctx *ctx, const char *username);
+
+//
+// Writes the precomputed state of a private key context, with the CRT components
+// if it has them.
+//
+// Returns false if writing failed.
+//
+bool keyfile_write_priv(FILE *pvfile, const ss_priv_ctx *ctx);
+
+//
+// Loads a public key context from a binary key file written by keyfile_write_pub.
+//
+// Provides:
+//  ctx: ready to use, must be cleared with ss_pub_ctx_clear
+//  username: the key holder's name, cut to size - 1 bytes and NUL terminated
+//
+// Returns false, with ctx not set up, if the file is not a valid public key file of
+// this machine or its checksum does not match.
+//
+bool keyfile_read_pub(FILE *pbfile, ss_pub_ctx *ctx, char *username, size_t size);
+
+//
+// Loads a private key context from a binary key file written by keyfile_write_priv.
+//
+// Provides:
+//  ctx: ready to use, must be cleared with ss_priv_ctx_clear
+//
+// Returns false, with ctx not set up, if the file is not a valid private key file of
+// this machine, its checksum does not match, or k or the CRT components do not match
+// pq and d.
+//
+bool keyfile_read_priv(FILE *pvfile, ss_priv_ctx *ctx);
@@ -13,15 +13,27 @@
 #include "randstate.h"
 #include "ss.h"
 #include "argparser.h"
+#include "numtheory.h"
+#include "gmpalloc.h"
+#include "stats.h"
+#include "trace.h"
+#include "keyfile.h"
+#include "primepool.h"
 
-#define KEYGEN_OPTIONS "b:i:n:d:s:vh"
+#define KEYGEN_OPTIONS "b:i:n:d:N:D:P:s:t:mvh"
+
+#define FILL_POOL_LONG_OPTION { "fill-pool", required_argument, NULL, 'F' }
 
 int keygen_argparser(int argc, char **argv, uint32_t *nbits, uint32_t *iters, FILE **pbfile,
-    FILE **pvfile, uint64_t *seed, bool *verbose);
+    FILE **pvfile, FILE **pbbin, FILE **pvbin, const char **pool, uint32_t *fill,
+    uint64_t *seed, uint32_t *threads, bool *pool_alloc, bool *stats, stats_format *format,
+    FILE **trace_file, bool *verbose);
 uint32_t get_number_from_command_line_argument(char *);
 
-void generate_keys(
-    uint32_t nbits, uint32_t iters, FILE *pbfile, FILE *pvfile, uint64_t seed, bool verbose);
+void generate_keys(uint32_t nbits, uint32_t iters, FILE *pbfile, FILE *pvfile, FILE *pbbin,
+    FILE *pvbin, const char *pool, uint64_t seed, uint32_t threads, bool verbose);
+bool fill_pool(const char *pool, uint32_t count, uint32_t nbits, uint32_t iters, uint64_t seed,
+    uint32_t threads, bool verbose);
 
 void print_help(void);
 void print_verbose(const char *username, const mpz_t p, const mpz_t q, const mpz_t n,
@@ -33,13 +45,24 @@ void print_verbose_mpz_var(const mpz_t var, const char *name);
 */
 int main(int argc, char **argv) {
     uint32_t nbits = 256;
-    uint32_t iters = 50;
+    uint32_t iters = PRIME_BPSW;
     FILE *pbfile = NULL;
     FILE *pvfile = NULL;
+    FILE *pbbin = NULL;
+    FILE *pvbin = NULL;
+    const char *pool = NULL;
+    uint32_t fill = 0;
     uint64_t seed = (uint64_t) time(NULL);
+    uint32_t threads = 0;
+    bool pool_alloc = false;
+    bool stats = false;
+    stats_format format = STATS_TEXT;
+    FILE *trace_file = NULL;
     bool verbose = false;
 
-    int response = keygen_argparser(argc, argv, &nbits, &iters, &pbfile, &pvfile, &seed, &verbose);
+    int response = keygen_argparser(argc, argv, &nbits, &iters, &pbfile, &pvfile, &pbbin,
+        &pvbin, &pool, &fill, &seed, &threads, &pool_alloc, &stats, &format, &trace_file,
+        &verbose);
 
     //Error
     if (response != 0) {
@@ -49,9 +72,41 @@ int main(int argc, char **argv) {
         if (pvfile != NULL) {
             fclose(pvfile);
         }
+        if (trace_file != NULL) {
+            fclose(trace_file);
+        }
+        check_null_and_close(pbbin);
+        check_null_and_close(pvbin);
         return -1;
     }
 
+    if (fill > 0) {
+        //Only primes are written, no key files
+        check_null_and_close(pbfile);
+        check_null_and_close(pvfile);
+        check_null_and_close(pbbin);
+        check_null_and_close(pvbin);
+        if (pool_alloc) {
+            gmpalloc_init(GMPALLOC_POOL);
+        }
+        if (stats) {
+            stats_enable();
+        }
+        if (trace_file != NULL) {
+            trace_enable();
+        }
+        bool filled = fill_pool(pool == NULL ? PRIME_POOL_DEFAULT : pool, fill, nbits, iters,
+            seed, threads, verbose);
+        if (stats) {
+            stats_report(stderr, "keygen", format);
+        }
+        if (trace_file != NULL) {
+            trace_write(trace_file);
+            fclose(trace_file);
+        }
+        return filled ? 0 : -4;
+    }
+
     if (pbfile == NULL) {
         bool is_open = open_file(&pbfile, "ss.pub", "w+");
         if (!is_open) {
@@ -67,8 +122,30 @@ int main(int argc, char **argv) {
     }
 
     fchmod(fileno(pvfile), S_IRUSR + S_IWUSR); //Set file permissions 600 for private file
+    if (pvbin != NULL) {
+        fchmod(fileno(pvbin), S_IRUSR + S_IWUSR);
+    }
+
+    if (pool_alloc) {
+        gmpalloc_init(GMPALLOC_POOL); //Before GMP allocates anything
+    }
+
+    if (stats) {
+        stats_enable();
+    }
+    if (trace_file != NULL) {
+        trace_enable();
+    }
+
+    generate_keys(nbits, iters, pbfile, pvfile, pbbin, pvbin, pool, seed, threads, verbose);
 
-    generate_keys(nbits, iters, pbfile, pvfile, seed, verbose);
+    if (stats) {
+        stats_report(stderr, "keygen", format);
+    }
+    if (trace_file != NULL) {
+        trace_write(trace_file);
+        fclose(trace_file);
+    }
 
     return 0;
 }
@@ -77,10 +154,14 @@ int main(int argc, char **argv) {
     Parses and sets keygen command line arguments
 */
 int keygen_argparser(int argc, char **argv, uint32_t *nbits, uint32_t *iters, FILE **pbfile,
-    FILE **pvfile, uint64_t *seed, bool *verbose) {
+    FILE **pvfile, FILE **pbbin, FILE **pvbin, const char **pool, uint32_t *fill,
+    uint64_t *seed, uint32_t *threads, bool *pool_alloc, bool *stats, stats_format *format,
+    FILE **trace_file, bool *verbose) {
+    struct option long_options[] = { STATS_LONG_OPTION, TRACE_LONG_OPTION,
+        FILL_POOL_LONG_OPTION, { NULL, 0, NULL, 0 } };
     int opt = 0;
     bool is_open = false;
-    while ((opt = getopt(argc, argv, KEYGEN_OPTIONS)) != -1) {
+    while ((opt = getopt_long(argc, argv, KEYGEN_OPTIONS, long_options, NULL)) != -1) {
         switch (opt) {
         case 'b':
             *nbits = get_number_from_command_line_argument(optarg);
@@ -102,7 +183,48 @@ int keygen_argparser(int argc, char **argv, uint32_t *nbits, uint32_t *iters, FI
                 return 3;
             }
             break;
+        case 'N':
+            is_open = open_file(pbbin, optarg, "w");
+            if (!is_open) {
+                return 8;
+            }
+            break;
+        case 'D':
+            is_open = open_file(pvbin, optarg, "w");
+            if (!is_open) {
+                return 9;
+            }
+            break;
+        case 'P': *pool = optarg; break;
+        case 'F':
+            *fill = get_number_from_command_line_argument(optarg);
+            if (*fill == 0) {
+                printf("Please enter a positive number of keys for --fill-pool\n");
+                return 10;
+            }
+            break;
         case 's': *seed = (uint64_t) strtoul(optarg, NULL, 10); break;
+        case 't':
+            *threads = get_number_from_command_line_argument(optarg);
+            if (*threads == 0) {
+                printf("Please enter a positive number of threads\n");
+                return 5;
+            }
+            break;
+        case 'm': *pool_alloc = true; break;
+        case 'S':
+            *stats = true;
+            if (!stats_parse_format(optarg, format)) {
+                printf("Please enter text or json for --stats\n");
+                return 6;
+            }
+            break;
+        case 'T':
+            is_open = open_file(trace_file, optarg, "w");
+            if (!is_open) {
+                return 7;
+            }
+            break;
         case 'v': *verbose = true; break;
         case 'h': print_help(); return 1;
         default: print_help(); return 1;
@@ -121,39 +243,129 @@ uint32_t get_number_from_command_line_argument(char *opt_argument) {
 /*
     Generate keys function:
     - Initializes random states.
-    - Makes public and private keys
+    - Makes public and private keys (on threads workers if threads is not 0), from
+      primes taken out of pool if it is not NULL and holds a pair for nbits
     - Gets username
     - Writes public key to pbfile
     - Writes private key to pvfile
+    - Writes the precomputed binary keys to pbbin and pvbin if they are not NULL
+    - Reports the GMP allocations if the pooled allocator is installed
+    - Times the arithmetic and the key file writes for --stats
 */
-void generate_keys(
-    uint32_t nbits, uint32_t iters, FILE *pbfile, FILE *pvfile, uint64_t seed, bool verbose) {
+void generate_keys(uint32_t nbits, uint32_t iters, FILE *pbfile, FILE *pvfile, FILE *pbbin,
+    FILE *pvbin, const char *pool, uint64_t seed, uint32_t threads, bool verbose) {
+    gmpalloc_op_begin();
     randstate_init(seed);
     srandom(seed);
 
-    mpz_t p, q, n, pq, d;
-    mpz_inits(p, q, n, pq, d, NULL);
+    mpz_t p, q, n, pq, d, dp, dq, qinv;
+    mpz_inits(p, q, n, pq, d, dp, dq, qinv, NULL);
 
-    ss_make_pub(p, q, n, nbits, iters);
+    uint64_t start = stats_now();
+    bool pooled = false;
+    if (pool != NULL) {
+        pooled = ss_make_pub_pooled(p, q, n, nbits, iters, threads, seed, pool);
+    } else if (threads > 0) {
+        ss_make_pub_threaded(p, q, n, nbits, iters, threads, seed);
+    } else {
+        ss_make_pub(p, q, n, nbits, iters);
+    }
     ss_make_priv(d, pq, p, q);
+    ss_make_priv_crt(dp, dq, qinv, d, p, q);
+    stats_add_time(STATS_ARITH_NS, start);
 
     char *username = getenv("USER");
 
+    start = stats_now();
     ss_write_pub(n, username, pbfile);
+    stats_add(STATS_BYTES_OUT, (uint64_t) ftell(pbfile));
     fclose(pbfile);
 
-    ss_write_priv(pq, d, pvfile);
+    ss_write_priv_crt(pq, d, p, q, dp, dq, qinv, pvfile);
+    stats_add(STATS_BYTES_OUT, (uint64_t) ftell(pvfile));
     fclose(pvfile);
+    stats_add_time(STATS_IO_NS, start);
+
+    if (pbbin != NULL) {
+        ss_pub_ctx pub;
+        ss_pub_ctx_init(&pub, n);
+        if (!keyfile_write_pub(pbbin, &pub, username)) {
+            printf("Error writing the binary public key.\n");
+        }
+        stats_add(STATS_BYTES_OUT, (uint64_t) ftell(pbbin));
+        fclose(pbbin);
+        ss_pub_ctx_clear(&pub);
+    }
+    if (pvbin != NULL) {
+        ss_priv_ctx priv;
+        ss_priv_ctx_init_crt(&priv, pq, d, p, q, dp, dq, qinv);
+        if (!keyfile_write_priv(pvbin, &priv)) {
+            printf("Error writing the binary private key.\n");
+        }
+        stats_add(STATS_BYTES_OUT, (uint64_t) ftell(pvbin));
+        fclose(pvbin);
+        ss_priv_ctx_clear(&priv);
+    }
 
     if (verbose) {
+        if (pool != NULL) {
+            printf("primes %s\n", pooled ? "taken from the pool" : "generated, pool empty");
+        }
         print_verbose(username, p, q, n, pq, d);
     }
 
-    mpz_clears(p, q, n, pq, d, NULL);
+    mpz_clears(p, q, n, pq, d, dp, dq, qinv, NULL);
     randstate_clear();
+
+    if (gmpalloc_installed()) {
+        gmpalloc_print_stats(stderr, "keygen");
+    }
     return;
 }
 
+/*
+    Fill pool function:
+    - Generates the primes of count keys of nbits the way a keygen run would, each key
+      on threads workers if threads is not 0
+    - Appends each pair to pool as soon as it is found, so an interrupted fill keeps
+      what it made and keygen runs can take primes meanwhile
+    Returns false if the pool could not be written.
+*/
+bool fill_pool(const char *pool, uint32_t count, uint32_t nbits, uint32_t iters, uint64_t seed,
+    uint32_t threads, bool verbose) {
+    randstate_init(seed);
+    srandom(seed);
+
+    mpz_t p, q, n;
+    mpz_inits(p, q, n, NULL);
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < count; i++) {
+        uint64_t start = stats_now();
+        if (threads > 0) {
+            //Each key from its own seed, drawn from the one the fill was given
+            uint64_t key_seed = ((uint64_t) random() << 32) ^ (uint64_t) random();
+            ss_make_pub_threaded(p, q, n, nbits, iters, threads, key_seed);
+        } else {
+            ss_make_pub(p, q, n, nbits, iters);
+        }
+        stats_add_time(STATS_ARITH_NS, start);
+
+        uint64_t pbits = mpz_sizeinbase(p, 2) - 1;
+        uint64_t qbits = mpz_sizeinbase(q, 2) - 1;
+        ok = prime_pool_add(pool, pbits, p, qbits, q);
+        if (ok && verbose) {
+            printf("%s: key %u of %u, p %lu bits, q %lu bits\n", pool, i + 1, count,
+                (unsigned long) pbits + 1, (unsigned long) qbits + 1);
+        }
+    }
+    if (verbose) {
+        printf("%s: %lu primes\n", pool, (unsigned long) prime_pool_count(pool));
+    }
+    mpz_clears(p, q, n, NULL);
+    randstate_clear();
+    return ok;
+}
+
 /*
     Prints verbose arguements to screen.
 */
@@ -193,8 +405,23 @@ void print_help(void) {
            "   -h              Display program help and usage.\n"
            "   -v              Display verbose program output.\n"
            "   -b bits         Minimum bits needed for public key n (default: 256).\n"
-           "   -i iterations   Miller-Rabin iterations for testing primes (default: 50).\n"
+           "   -i iterations   Test primes with this many Miller-Rabin iterations instead\n"
+           "                   of the Baillie-PSW test (default: Baillie-PSW).\n"
            "   -n pbfile       Public key file (default: ss.pub).\n"
            "   -d pvfile       Private key file (default: ss.priv).\n"
-           "   -s seed         Random seed for testing.\n");
+           "   -N pbbin        Also write the public key, precomputed, as a binary key file.\n"
+           "   -D pvbin        Also write the private key, precomputed, as a binary key file.\n"
+           "   -P pool         Take p and q from this prime pool when it holds a pair for\n"
+           "                   the key size, generate them otherwise.\n"
+           "   --fill-pool=count  Instead of a key, add the primes of count keys of -b\n"
+           "                   bits to the pool given with -P (default: ss.pool).\n"
+           "   -s seed         Random seed for testing.\n"
+           "   -t threads      Test the candidates for p and q on this many threads. Keys\n"
+           "                   only depend on the seed and the thread count.\n"
+           "   -m              Use the pooled GMP allocator and print allocation\n"
+           "                   statistics to stderr.\n"
+           "   --stats[=fmt]   Print operation counters, I/O and arithmetic time and\n"
+           "                   throughput to stderr, fmt is text (default) or json.\n"
+           "   --trace=file    Write a Chrome trace event timeline of every prime search\n"
+           "                   attempt and primality test to file.\n");
 }
@@ -0,0 +1,402 @@
+#include "montbatch.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define MONT_BATCH_X86
+#include <immintrin.h>
+#endif
+
+//Digits of a modulus of bits bits with R > 4n, as mont_batch_init sizes them
+#define BATCH_DIGITS(bits, radix) (((bits) + 2 + (radix) - 1) / (radix))
+
+//Column sums of the largest modulus stay below 2^64: products or halves below 2^52,
+//plus one more 2^52 for the carry moved in
+_Static_assert(2 * BATCH_DIGITS(MONT_BATCH_MAX_BITS, 26) + 1 <= (1u << 12),
+    "mul_avx2 columns overflow at MONT_BATCH_MAX_BITS");
+_Static_assert(4 * BATCH_DIGITS(MONT_BATCH_MAX_BITS, 52) + 1 <= (1u << 12),
+    "mul_ifma columns overflow at MONT_BATCH_MAX_BITS");
+
+//rp = ap * bp * R^-1 (mod n) for every lane, acc holds 2 * digits vectors
+typedef void (*batch_mul)(
+    uint64_t *rp, const uint64_t *ap, const uint64_t *bp, const mont_batch *b, uint64_t *acc);
+
+//Helper functions not in header file
+bool batch_supported(mont_batch_isa isa);
+uint64_t get_digit(const mp_limb_t *xp, size_t size, size_t bit, uint32_t radix);
+void broadcast_digits(uint64_t *dst, const mpz_t x, const mont_batch *b);
+void load_lane(uint64_t *dst, uint32_t lane, const mpz_t x, const mont_batch *b, mpz_t temp);
+void store_lane(mpz_t x, const uint64_t *src, uint32_t lane, const mont_batch *b);
+void reserve_batch_scratch(mont_batch_scratch *s, size_t words);
+#ifdef MONT_BATCH_X86
+void mul_avx2(
+    uint64_t *rp, const uint64_t *ap, const uint64_t *bp, const mont_batch *b, uint64_t *acc);
+void mul_ifma(
+    uint64_t *rp, const uint64_t *ap, const uint64_t *bp, const mont_batch *b, uint64_t *acc);
+#endif
+
+mont_batch_isa mont_batch_detect(void) {
+#ifdef MONT_BATCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512ifma")) {
+        return MONT_BATCH_IFMA;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return MONT_BATCH_AVX2;
+    }
+#endif
+    return MONT_BATCH_SCALAR;
+}
+
+const char *mont_batch_name(mont_batch_isa isa) {
+    switch (isa) {
+    case MONT_BATCH_SCALAR: return "scalar";
+    case MONT_BATCH_AVX2: return "avx2";
+    case MONT_BATCH_IFMA: return "ifma";
+    default: return "auto";
+    }
+}
+
+/*
+    Every CPU with IFMA also has AVX2, so anything up to the detected unit is usable.
+*/
+bool batch_supported(mont_batch_isa isa) {
+    return isa <= mont_batch_detect();
+}
+
+/*
+    Returns bits [bit, bit + radix) of the size limb number xp.
+*/
+uint64_t get_digit(const mp_limb_t *xp, size_t size, size_t bit, uint32_t radix) {
+    size_t limb = bit / GMP_NUMB_BITS;
+    uint32_t offset = (uint32_t) (bit % GMP_NUMB_BITS);
+    if (limb >= size) {
+        return 0;
+    }
+    uint64_t digit = xp[limb] >> offset;
+    if (offset + radix > GMP_NUMB_BITS && limb + 1 < size) {
+        digit |= xp[limb + 1] << (GMP_NUMB_BITS - offset);
+    }
+    return digit & ((UINT64_C(1) << radix) - 1);
+}
+
+/*
+    Writes 0 <= x < R into every lane of dst.
+*/
+void broadcast_digits(uint64_t *dst, const mpz_t x, const mont_batch *b) {
+    for (size_t j = 0; j < b->digits; j++) {
+        uint64_t digit = get_digit(mpz_limbs_read(x), mpz_size(x), j * b->radix, b->radix);
+        for (uint32_t l = 0; l < b->lanes; l++) {
+            dst[j * b->lanes + l] = digit;
+        }
+    }
+    return;
+}
+
+/*
+    Writes x % n into lane of dst, or 0 if x is NULL.
+*/
+void load_lane(uint64_t *dst, uint32_t lane, const mpz_t x, const mont_batch *b, mpz_t temp) {
+    if (x == NULL) {
+        for (size_t j = 0; j < b->digits; j++) {
+            dst[j * b->lanes + lane] = 0;
+        }
+        return;
+    }
+
+    //if x is negative or x >= n, reduce it first
+    if (mpz_sgn(x) < 0 || mpz_cmp(x, b->mod_z) >= 0) {
+        mpz_mod(temp, x, b->mod_z);
+        x = temp;
+    }
+    const mp_limb_t *xp = mpz_limbs_read(x);
+    size_t size = mpz_size(x);
+    for (size_t j = 0; j < b->digits; j++) {
+        dst[j * b->lanes + lane] = get_digit(xp, size, j * b->radix, b->radix);
+    }
+    return;
+}
+
+/*
+    Sets x to the value in lane of src, which is at most n, and reduces it below n.
+*/
+void store_lane(mpz_t x, const uint64_t *src, uint32_t lane, const mont_batch *b) {
+    mp_size_t size = (mp_size_t) ((b->digits * b->radix + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS);
+    mp_limb_t *xp = mpz_limbs_write(x, size);
+    mpn_zero(xp, size);
+    for (size_t j = 0; j < b->digits; j++) {
+        uint64_t digit = src[j * b->lanes + lane];
+        size_t bit = j * b->radix;
+        size_t limb = bit / GMP_NUMB_BITS;
+        uint32_t offset = (uint32_t) (bit % GMP_NUMB_BITS);
+        xp[limb] |= digit << offset;
+        if (offset + b->radix > GMP_NUMB_BITS) {
+            xp[limb + 1] |= digit >> (GMP_NUMB_BITS - offset);
+        }
+    }
+    mpz_limbs_finish(x, size);
+
+    //if x == n, x = 0
+    if (mpz_cmp(x, b->mod_z) >= 0) {
+        mpz_sub(x, x, b->mod_z);
+    }
+    return;
+}
+
+/*
+    Sets up the digit layout and constants for n on the wanted vector unit.
+*/
+void mont_batch_init(mont_batch *b, const mpz_t n, mont_batch_isa want) {
+    b->want = want;
+    if (want == MONT_BATCH_AUTO) {
+        want = mont_batch_detect();
+        if (want == MONT_BATCH_AVX2 && mpz_sizeinbase(n, 2) > MONT_BATCH_AVX2_AUTO_BITS) {
+            want = MONT_BATCH_SCALAR;
+        }
+    }
+    mpz_init_set(b->mod_z, n);
+    b->isa = MONT_BATCH_SCALAR;
+    b->lanes = 1;
+    b->radix = 0;
+    b->digits = 0;
+    b->k0 = 0;
+    b->mod = NULL;
+    b->r2 = NULL;
+    b->one = NULL;
+
+    if (want == MONT_BATCH_SCALAR || !batch_supported(want) || mpz_cmp_ui(n, 1) <= 0
+        || mpz_even_p(n) || mpz_sizeinbase(n, 2) > MONT_BATCH_MAX_BITS) {
+        return;
+    }
+
+    b->isa = want;
+    b->lanes = want == MONT_BATCH_IFMA ? 8 : 4;
+    b->radix = want == MONT_BATCH_IFMA ? 52 : 26;
+    b->digits = BATCH_DIGITS(mpz_sizeinbase(n, 2), b->radix); //R > 4n
+
+    //Newton iteration for n^-1 % 2^64, every step doubles the correct low bits
+    uint64_t n0 = mpz_getlimbn(n, 0);
+    uint64_t inv = n0; //Correct to 3 bits since n0 * n0 = 1 % 8 for odd n0
+    for (int i = 0; i < 5; i++) {
+        inv *= 2 - n0 * inv;
+    }
+    b->k0 = (0 - inv) & ((UINT64_C(1) << b->radix) - 1);
+
+    size_t words = b->digits * b->lanes; //A multiple of 4, so each array stays 32-byte aligned
+    size_t bytes = (3 * words * sizeof(uint64_t) + 63) & ~(size_t) 63;
+    b->mod = (uint64_t *) aligned_alloc(64, bytes); //Vector loads need aligned digits
+    b->r2 = b->mod + words;
+    b->one = b->r2 + words;
+    broadcast_digits(b->mod, n, b);
+
+    mpz_t temp;
+    mpz_init(temp);
+    mpz_setbit(temp, (mp_bitcnt_t) (2 * b->radix * b->digits)); //temp = R^2
+    mpz_mod(temp, temp, n);
+    broadcast_digits(b->r2, temp, b);
+    mpz_set_ui(temp, 1);
+    broadcast_digits(b->one, temp, b);
+    mpz_clear(temp);
+    return;
+}
+
+void mont_batch_clear(mont_batch *b) {
+    free(b->mod);
+    mpz_clear(b->mod_z);
+    return;
+}
+
+void mont_batch_retarget(mont_batch *b, mont_batch_isa want) {
+    if (b->want == want) {
+        return;
+    }
+    mpz_t n;
+    mpz_init_set(n, b->mod_z);
+    mont_batch_clear(b);
+    mont_batch_init(b, n, want);
+    mpz_clear(n);
+    return;
+}
+
+void mont_batch_scratch_init(mont_batch_scratch *s) {
+    s->words = 0;
+    s->mem = NULL;
+    mpz_init(s->temp);
+    return;
+}
+
+void mont_batch_scratch_clear(mont_batch_scratch *s) {
+    free(s->mem);
+    mpz_clear(s->temp);
+    return;
+}
+
+/*
+    Grows s to at least words 64-byte aligned words, dropping its contents.
+*/
+void reserve_batch_scratch(mont_batch_scratch *s, size_t words) {
+    if (words <= s->words) {
+        return;
+    }
+    free(s->mem);
+    size_t bytes = (words * sizeof(uint64_t) + 63) & ~(size_t) 63;
+    s->mem = (uint64_t *) aligned_alloc(64, bytes);
+    s->words = bytes / sizeof(uint64_t);
+    return;
+}
+
+#ifdef MONT_BATCH_X86
+/*
+    Almost Montgomery multiplication of 4 lanes with 26-bit digits. Inputs below 2n give a
+    result below 2n with every digit normalized. Digit products are 52 bits, so the 64-bit
+    accumulators absorb the 2 * digits products of a column without carrying.
+    Row i adds a[i] * b, then y * n with y chosen to clear column i, and moves its carry up.
+*/
+__attribute__((target("avx2"))) void mul_avx2(
+    uint64_t *rp, const uint64_t *ap, const uint64_t *bp, const mont_batch *b, uint64_t *acc) {
+    size_t n = b->digits;
+    const __m256i *a = (const __m256i *) ap;
+    const __m256i *x = (const __m256i *) bp;
+    const __m256i *m = (const __m256i *) b->mod;
+    __m256i *t = (__m256i *) acc;
+    __m256i mask = _mm256_set1_epi64x((INT64_C(1) << 26) - 1);
+    __m256i k0 = _mm256_set1_epi64x((int64_t) b->k0);
+
+    for (size_t j = 0; j < 2 * n; j++) {
+        t[j] = _mm256_setzero_si256();
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        __m256i ai = _mm256_load_si256(a + i);
+        __m256i ti = _mm256_add_epi64(t[i], _mm256_mul_epu32(ai, x[0]));
+        __m256i y = _mm256_and_si256(_mm256_mul_epu32(ti, k0), mask); //y = t[i] * k0 % 2^26
+        ti = _mm256_add_epi64(ti, _mm256_mul_epu32(y, m[0])); //t[i] = 0 % 2^26
+        t[i + 1] = _mm256_add_epi64(t[i + 1], _mm256_srli_epi64(ti, 26));
+        for (size_t j = 1; j < n; j++) {
+            __m256i sum = _mm256_add_epi64(_mm256_mul_epu32(ai, x[j]), _mm256_mul_epu32(y, m[j]));
+            t[i + j] = _mm256_add_epi64(t[i + j], sum);
+        }
+    }
+
+    //Result is t[n..2n) divided by R, normalize its digits
+    __m256i carry = _mm256_setzero_si256();
+    for (size_t j = 0; j < n; j++) {
+        __m256i v = _mm256_add_epi64(t[n + j], carry);
+        _mm256_store_si256((__m256i *) rp + j, _mm256_and_si256(v, mask));
+        carry = _mm256_srli_epi64(v, 26);
+    }
+    return;
+}
+
+/*
+    Almost Montgomery multiplication of 8 lanes with 52-bit digits, same scheme as
+    mul_avx2. vpmadd52luq/vpmadd52huq add the low and high 52 bits of a digit product;
+    the high halves of row i, column j go to column j + 1 together with the next low halves.
+*/
+__attribute__((target("avx512f,avx512ifma"))) void mul_ifma(
+    uint64_t *rp, const uint64_t *ap, const uint64_t *bp, const mont_batch *b, uint64_t *acc) {
+    size_t n = b->digits;
+    const __m512i *a = (const __m512i *) ap;
+    const __m512i *x = (const __m512i *) bp;
+    const __m512i *m = (const __m512i *) b->mod;
+    __m512i *t = (__m512i *) acc;
+    __m512i zero = _mm512_setzero_si512();
+    __m512i mask = _mm512_set1_epi64((INT64_C(1) << 52) - 1);
+    __m512i k0 = _mm512_set1_epi64((int64_t) b->k0);
+
+    for (size_t j = 0; j < 2 * n; j++) {
+        t[j] = zero;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        __m512i ai = _mm512_load_si512(a + i);
+        __m512i ti = _mm512_madd52lo_epu64(t[i], ai, x[0]);
+        __m512i y = _mm512_madd52lo_epu64(zero, ti, k0); //y = t[i] * k0 % 2^52
+        ti = _mm512_madd52lo_epu64(ti, y, m[0]); //t[i] = 0 % 2^52
+        __m512i hi = _mm512_srli_epi64(ti, 52);
+        hi = _mm512_madd52hi_epu64(_mm512_madd52hi_epu64(hi, ai, x[0]), y, m[0]);
+        for (size_t j = 1; j < n; j++) {
+            __m512i tj = _mm512_add_epi64(t[i + j], hi);
+            tj = _mm512_madd52lo_epu64(_mm512_madd52lo_epu64(tj, ai, x[j]), y, m[j]);
+            t[i + j] = tj;
+            hi = _mm512_madd52hi_epu64(_mm512_madd52hi_epu64(zero, ai, x[j]), y, m[j]);
+        }
+        t[i + n] = _mm512_add_epi64(t[i + n], hi);
+    }
+
+    //Result is t[n..2n) divided by R, normalize its digits
+    __m512i carry = zero;
+    for (size_t j = 0; j < n; j++) {
+        __m512i v = _mm512_add_epi64(t[n + j], carry);
+        _mm512_store_si512((__m512i *) rp + j, _mm512_and_si512(v, mask));
+        carry = _mm512_srli_epi64(v, 52);
+    }
+    return;
+}
+#endif
+
+/*
+    Sliding window exponentiation like pow_mod_mont, on every lane at once. Values stay
+    below 2n in Montgomery form and are only fully reduced when they are stored back.
+*/
+void mont_batch_pow(mpz_t *x, uint32_t count, const mont_batch *b, const exp_recoding *r,
+    mont_batch_scratch *s) {
+    stats_add(STATS_MODEXPS, count);
+    //if d == 0, a^0 = 1
+    if (r->count == 0) {
+        for (uint32_t l = 0; l < count; l++) {
+            mpz_set_ui(x[l], 1);
+        }
+        return;
+    }
+
+    batch_mul mul = NULL;
+#ifdef MONT_BATCH_X86
+    mul = b->isa == MONT_BATCH_IFMA ? mul_ifma : mul_avx2;
+#endif
+
+    size_t words = b->digits * b->lanes;
+    size_t entries = (size_t) 1 << (r->window - 1);
+    //table (entries), result, base, accumulator (2 * digits vectors)
+    reserve_batch_scratch(s, (entries + 4) * words);
+    uint64_t *table = s->mem;
+    uint64_t *result = table + entries * words;
+    uint64_t *base = result + words;
+    uint64_t *acc = base + words;
+
+    for (uint32_t l = 0; l < b->lanes; l++) {
+        load_lane(base, l, l < count ? x[l] : NULL, b, s->temp);
+    }
+
+    //table[0] = a * R % n
+    mul(table, base, b->r2, b, acc);
+
+    //table[i] = table[i - 1] * a^2
+    if (entries > 1) {
+        mul(base, table, table, b, acc);
+        for (size_t i = 1; i < entries; i++) {
+            mul(table + i * words, table + (i - 1) * words, base, b, acc);
+        }
+    }
+
+    memcpy(result, table + r->digit[0] * words, words * sizeof(uint64_t));
+    for (size_t i = 1; i < r->count; i++) {
+        for (uint32_t j = 0; j < r->shift[i]; j++) {
+            mul(result, result, result, b, acc);
+        }
+        mul(result, result, table + r->digit[i] * words, b, acc);
+    }
+    for (uint32_t j = 0; j < r->tail; j++) {
+        mul(result, result, result, b, acc);
+    }
+
+    //Leave Montgomery form: result * R^-1 % n
+    mul(result, result, b->one, b, acc);
+
+    for (uint32_t l = 0; l < count; l++) {
+        store_lane(x[l], result, l, b);
+    }
+    return;
+}
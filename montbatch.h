@@ -0,0 +1,99 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <gmp.h>
+
+#include "numtheory.h"
+
+//
+// Vector units the batch engine can run on. MONT_BATCH_AUTO picks the best one the
+// CPU supports at runtime, MONT_BATCH_SCALAR means no batch engine: callers fall back
+// to pow_mod_mont one block at a time.
+//
+//  MONT_BATCH_AVX2: 4 lanes, 26-bit digits multiplied with vpmuludq
+//  MONT_BATCH_IFMA: 8 lanes, 52-bit digits multiplied with AVX-512 IFMA vpmadd52
+//
+typedef enum {
+    MONT_BATCH_AUTO = 0,
+    MONT_BATCH_SCALAR,
+    MONT_BATCH_AVX2,
+    MONT_BATCH_IFMA
+} mont_batch_isa;
+
+#define MONT_BATCH_MAX_LANES 8
+
+//Largest modulus the batch engine takes, bounded by the 64-bit column accumulators.
+//A column of mul_avx2 sums up to 2 * digits products of 26-bit digits, each below 2^52,
+//and one of mul_ifma up to 4 * digits 52-bit halves, each plus a small carry. At 16384
+//bits that is 631 or 316 digits and sums just below 2^62.3, so less than 2 bits are
+//left; moduli over about 53000 bits would overflow. Checked at compile time in montbatch.c.
+#define MONT_BATCH_MAX_BITS 16384
+
+//Above this size 4 AVX2 lanes are no faster than scalar GMP, so MONT_BATCH_AUTO skips them
+#define MONT_BATCH_AVX2_AUTO_BITS 2048
+
+//
+// Montgomery constants for an odd modulus n, laid out for lockstep exponentiation of
+// lanes values at once. Numbers are stored structure-of-arrays: digit j of lane l is
+// word j * lanes + l, so one vector holds the same digit of every lane.
+// R = 2^(radix * digits) > 4n, which lets products stay in [0, 2n) without the final
+// subtraction of every Montgomery step (almost Montgomery multiplication).
+//
+typedef struct {
+    mont_batch_isa want; //Unit asked for at init
+    mont_batch_isa isa; //Unit in use, MONT_BATCH_SCALAR if n or the CPU is not supported
+    uint32_t lanes;
+    uint32_t radix; //Bits per digit
+    size_t digits; //Digits per lane
+    uint64_t k0; //-n^-1 % 2^radix
+    uint64_t *mod; //n broadcast to every lane
+    uint64_t *r2; //R^2 % n broadcast to every lane
+    uint64_t *one; //1 in every lane, leaves Montgomery form
+    mpz_t mod_z;
+} mont_batch;
+
+//
+// Working memory for mont_batch_pow, grown on demand. One per thread.
+//
+typedef struct {
+    size_t words;
+    uint64_t *mem;
+    mpz_t temp;
+} mont_batch_scratch;
+
+//
+// Returns the best vector unit of this CPU, MONT_BATCH_SCALAR if it has none.
+//
+mont_batch_isa mont_batch_detect(void);
+
+//
+// Returns the name of isa ("auto", "scalar", "avx2" or "ifma").
+//
+const char *mont_batch_name(mont_batch_isa isa);
+
+//
+// Sets up b for modulus n on the vector unit want (MONT_BATCH_AUTO for the best one).
+// Falls back to MONT_BATCH_SCALAR if n is even, n <= 1, n is larger than
+// MONT_BATCH_MAX_BITS or the CPU lacks want. b must be cleared in every case.
+//
+void mont_batch_init(mont_batch *b, const mpz_t n, mont_batch_isa want);
+
+void mont_batch_clear(mont_batch *b);
+
+//
+// Rebuilds b for the same modulus on the vector unit want, unless it was set up for want.
+//
+void mont_batch_retarget(mont_batch *b, mont_batch_isa want);
+
+void mont_batch_scratch_init(mont_batch_scratch *s);
+
+void mont_batch_scratch_clear(mont_batch_scratch *s);
+
+//
+// x[i] = x[i]^d % n for i in [0, count), where r is the recoding of d and
+// count <= b->lanes. Every value is exponentiated in lockstep with the same
+// sequence of squarings and products. b must not be MONT_BATCH_SCALAR.
+//
+void mont_batch_pow(mpz_t *x, uint32_t count, const mont_batch *b, const exp_recoding *r,
+    mont_batch_scratch *s);
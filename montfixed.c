@@ -0,0 +1,154 @@
+#include "montfixed.h"
+
+#include <stdatomic.h>
+#include <string.h>
+
+#if GMP_NUMB_BITS != 64
+#error "The fixed size Montgomery kernels assume 64-bit limbs"
+#endif
+
+//Sizes with a specialized kernel, within [MONT_FIXED_MIN_LIMBS, MONT_FIXED_MAX_LIMBS]
+#define MONT_FIXED_SIZES(X) X(2) X(3) X(4) X(5) X(6) X(7) X(8) X(9)
+
+#define MONT_FIXED_INLINE static inline __attribute__((always_inline))
+//Put before the loops over limbs, -O2 alone leaves them rolled
+#define MONT_FIXED_UNROLL _Pragma("GCC unroll 40")
+
+//Double limb for the products, __extension__ keeps -Wpedantic quiet about __int128
+__extension__ typedef unsigned __int128 limb_pair;
+
+atomic_bool fixed_enabled = true;
+
+//Helper functions not in header file
+MONT_FIXED_INLINE void fixed_mul(mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp,
+    const mp_limb_t *np, mp_limb_t minv, mp_size_t n);
+MONT_FIXED_INLINE void fixed_pow(mp_limb_t *rp, const mp_limb_t *ap, const mont_modulus *m,
+    const exp_recoding *r, mp_limb_t *table, mp_size_t n);
+
+//acc:top += x * y, a three limb column sum
+#define MONT_FIXED_MAC(x, y)                                                                   \
+    do {                                                                                       \
+        limb_pair product = (limb_pair) (x) * (y);                                             \
+        acc += product;                                                                        \
+        top += acc < product;                                                                  \
+    } while (0)
+
+/*
+    rp = ap * bp * R^-1 % n, with the product and the reduction interleaved column by
+    column (product scanning). Column i sums every a[j] * b[i - j] and u[j] * n[i - j] in
+    three registers, the low column limbs pick the u[i] that clear them and the high ones
+    are the result, so nothing but u is written until the end. rp may alias ap or bp.
+    Also does the squarings: with the loops unrolled the symmetric products do not pay
+    for the extra bookkeeping of a dedicated square.
+*/
+MONT_FIXED_INLINE void fixed_mul(mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp,
+    const mp_limb_t *np, mp_limb_t minv, mp_size_t n) {
+    mp_limb_t u[MONT_FIXED_MAX_LIMBS];
+    mp_limb_t tp[MONT_FIXED_MAX_LIMBS + 1];
+    limb_pair acc = 0;
+    mp_limb_t top = 0;
+
+    //Low columns: their sums are cleared by u[i] = column * -n^-1 % 2^64
+    MONT_FIXED_UNROLL
+    for (mp_size_t i = 0; i < n; i++) {
+        MONT_FIXED_UNROLL
+        for (mp_size_t j = 0; j < i; j++) {
+            MONT_FIXED_MAC(ap[j], bp[i - j]);
+            MONT_FIXED_MAC(u[j], np[i - j]);
+        }
+        MONT_FIXED_MAC(ap[i], bp[0]);
+        u[i] = (mp_limb_t) acc * minv;
+        MONT_FIXED_MAC(u[i], np[0]);
+        acc = (acc >> 64) | ((limb_pair) top << 64);
+        top = 0;
+    }
+
+    //High columns hold (a * b + u * n) / R
+    MONT_FIXED_UNROLL
+    for (mp_size_t i = n; i < 2 * n; i++) {
+        MONT_FIXED_UNROLL
+        for (mp_size_t j = i - n + 1; j < n; j++) {
+            MONT_FIXED_MAC(ap[j], bp[i - j]);
+            MONT_FIXED_MAC(u[j], np[i - j]);
+        }
+        tp[i - n] = (mp_limb_t) acc;
+        acc = (acc >> 64) | ((limb_pair) top << 64);
+        top = 0;
+    }
+    tp[n] = (mp_limb_t) acc;
+
+    //if tp >= n, tp -= n
+    mp_limb_t borrow = 0;
+    MONT_FIXED_UNROLL
+    for (mp_size_t i = 0; i < n; i++) {
+        limb_pair s = (limb_pair) tp[i] - np[i] - borrow;
+        u[i] = (mp_limb_t) s;
+        borrow = (mp_limb_t) (s >> 64) & 1;
+    }
+    memcpy(rp, tp[n] != 0 || borrow == 0 ? u : tp, (size_t) n * sizeof(mp_limb_t));
+    return;
+}
+
+/*
+    The loop of pow_mod_mont for n limb moduli: rp = ap^d % n for ap < n, where r is
+    the recoding of d (r->count > 0). table holds the odd powers.
+*/
+MONT_FIXED_INLINE void fixed_pow(mp_limb_t *rp, const mp_limb_t *ap, const mont_modulus *m,
+    const exp_recoding *r, mp_limb_t *table, mp_size_t n) {
+    const mp_limb_t *np = m->mod;
+    mp_limb_t minv = m->minv;
+    size_t entries = (size_t) 1 << (r->window - 1);
+    mp_limb_t result[MONT_FIXED_MAX_LIMBS];
+
+    //table[0] = a * R % n
+    fixed_mul(table, ap, m->r2, np, minv, n);
+
+    //table[i] = table[i - 1] * a^2
+    if (entries > 1) {
+        fixed_mul(result, table, table, np, minv, n);
+        for (size_t i = 1; i < entries; i++) {
+            fixed_mul(table + i * n, table + (i - 1) * n, result, np, minv, n);
+        }
+    }
+
+    memcpy(result, table + r->digit[0] * (size_t) n, (size_t) n * sizeof(mp_limb_t));
+    for (size_t i = 1; i < r->count; i++) {
+        for (uint32_t j = 0; j < r->shift[i]; j++) {
+            fixed_mul(result, result, result, np, minv, n);
+        }
+        fixed_mul(result, result, table + r->digit[i] * (size_t) n, np, minv, n);
+    }
+    for (uint32_t j = 0; j < r->tail; j++) {
+        fixed_mul(result, result, result, np, minv, n);
+    }
+
+    //Leave Montgomery form: result * 1 * R^-1 % n
+    mp_limb_t one[MONT_FIXED_MAX_LIMBS] = { 1 };
+    fixed_mul(rp, result, one, np, minv, n);
+    return;
+}
+
+//One non-inlined instantiation of fixed_pow per size
+#define MONT_FIXED_DEFINE(N)                                                                  \
+    void mont_fixed_pow_##N(mp_limb_t *rp, const mp_limb_t *ap, const mont_modulus *m,      \
+        const exp_recoding *r, mp_limb_t *table) {                                          \
+        fixed_pow(rp, ap, m, r, table, N);                                                  \
+    }
+MONT_FIXED_SIZES(MONT_FIXED_DEFINE)
+
+#define MONT_FIXED_ENTRY(N) [N] = mont_fixed_pow_##N,
+const mont_fixed_pow fixed_kernels[MONT_FIXED_MAX_LIMBS + 1] = { MONT_FIXED_SIZES(
+    MONT_FIXED_ENTRY) };
+
+mont_fixed_pow mont_fixed_find(mp_size_t size) {
+    if (!atomic_load(&fixed_enabled) || size < MONT_FIXED_MIN_LIMBS
+        || size > MONT_FIXED_MAX_LIMBS) {
+        return NULL;
+    }
+    return fixed_kernels[size];
+}
+
+void mont_fixed_enable(bool enable) {
+    atomic_store(&fixed_enabled, enable);
+    return;
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <gmp.h>
+
+#include "numtheory.h"
+
+//
+// Montgomery exponentiation specialized at compile time for a fixed number of limbs.
+// Every size from MONT_FIXED_MIN_LIMBS to MONT_FIXED_MAX_LIMBS gets its own copy of the
+// exponentiation loop, with the Montgomery product inlined, its loops unrolled over the
+// constant size and every intermediate in registers or on the stack.
+//
+// Below ten limbs this beats the calls into GMP's mpn functions by 10 to 40 percent,
+// from there on GMP's assembly wins, so larger moduli keep using mpn in pow_mod_mont.
+// The specialized sizes cover keygen's prime tests and decrypt's CRT primes p and q for
+// keys of up to about 1024 bits.
+//
+#define MONT_FIXED_MIN_LIMBS 2
+#define MONT_FIXED_MAX_LIMBS 9
+
+//
+// Returns the specialized exponentiation for moduli of size limbs, NULL if there is
+// none. mont_set stores it in the mont_modulus.
+//
+mont_fixed_pow mont_fixed_find(mp_size_t size);
+
+//
+// While enable is false mont_fixed_find returns NULL for every size, so ntbench can
+// time the mpn path. Affects moduli set up afterwards.
+//
+void mont_fixed_enable(bool enable);
@@ -0,0 +1,377 @@
+#include "numtheory.h"
+#include "randstate.h"
+#include "montfixed.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <gmp.h>
+
+#define NTBENCH_OPTIONS "b:r:w:i:s:h"
+
+#define MAX_SIZES 32
+
+//Operands shared by one size: a, b random, n odd modulus, e exponent
+typedef struct {
+    mpz_t a, b, n, e, prime, composite;
+} operands;
+
+typedef void (*bench_op)(mpz_t out, const operands *x, uint64_t iters);
+
+uint32_t parse_list(const char *arg, uint64_t *values, uint32_t max);
+double now_seconds(void);
+int compare_doubles(const void *a, const void *b);
+double time_op(bench_op op, mpz_t out, operands *x, uint64_t bits, uint32_t reps,
+    uint32_t warmup, uint64_t iters);
+void draw_operands(operands *x, uint64_t bits);
+bool cross_check(uint64_t bits, uint32_t count, uint64_t iters);
+
+void op_pow_mod(mpz_t out, const operands *x, uint64_t iters);
+void op_pow_mod_ws(mpz_t out, const operands *x, uint64_t iters);
+void op_pow_mod_mpn(mpz_t out, const operands *x, uint64_t iters);
+void op_mpz_powm(mpz_t out, const operands *x, uint64_t iters);
+void op_mod_inverse(mpz_t out, const operands *x, uint64_t iters);
+void op_mod_inverse_ws(mpz_t out, const operands *x, uint64_t iters);
+void op_mpz_invert(mpz_t out, const operands *x, uint64_t iters);
+void op_gcd(mpz_t out, const operands *x, uint64_t iters);
+void op_mpz_gcd(mpz_t out, const operands *x, uint64_t iters);
+void op_is_prime(mpz_t out, const operands *x, uint64_t iters);
+void op_is_prime_ws(mpz_t out, const operands *x, uint64_t iters);
+void op_is_prime_bpsw(mpz_t out, const operands *x, uint64_t iters);
+void op_mpz_probab_prime_p(mpz_t out, const operands *x, uint64_t iters);
+void op_make_prime(mpz_t out, const operands *x, uint64_t iters);
+void op_mpz_nextprime(mpz_t out, const operands *x, uint64_t iters);
+void print_help(void);
+
+//Size of the operands of the current sweep step, used by the make_prime ops
+uint64_t current_bits = 0;
+
+//Workspace shared by every call of the _ws ops, like a loop in the library would
+nt_workspace workspace;
+
+//Workspace whose Montgomery constants are always set up without the fixed size kernels
+nt_workspace mpn_workspace;
+
+typedef struct {
+    const char *name;
+    bench_op ours;
+    const char *gmp_name;
+    bench_op gmp;
+} bench_pair;
+
+bench_pair pairs[] = {
+    { "pow_mod", op_pow_mod, "mpz_powm", op_mpz_powm },
+    { "pow_mod_ws", op_pow_mod_ws, "mpz_powm", op_mpz_powm },
+    { "pow_mod_mpn", op_pow_mod_mpn, "mpz_powm", op_mpz_powm },
+    { "mod_inverse", op_mod_inverse, "mpz_invert", op_mpz_invert },
+    { "mod_inverse_ws", op_mod_inverse_ws, "mpz_invert", op_mpz_invert },
+    { "gcd", op_gcd, "mpz_gcd", op_mpz_gcd },
+    { "is_prime", op_is_prime, "mpz_probab_prime_p", op_mpz_probab_prime_p },
+    { "is_prime_ws", op_is_prime_ws, "mpz_probab_prime_p", op_mpz_probab_prime_p },
+    { "is_prime_bpsw", op_is_prime_bpsw, "mpz_probab_prime_p", op_mpz_probab_prime_p },
+    { "make_prime", op_make_prime, "mpz_nextprime", op_mpz_nextprime },
+};
+
+/*
+    Microbenchmarks the numtheory.c routines against their GMP built-in equivalents
+    after checking that both agree.
+*/
+int main(int argc, char **argv) {
+    uint64_t bits[MAX_SIZES] = { 256, 512, 1024, 2048, 4096 };
+    uint32_t bit_count = 5;
+    uint32_t reps = 20;
+    uint32_t warmup = 3;
+    uint64_t iters = 25;
+    uint64_t seed = (uint64_t) time(NULL);
+
+    int opt = 0;
+    while ((opt = getopt(argc, argv, NTBENCH_OPTIONS)) != -1) {
+        switch (opt) {
+        case 'b': bit_count = parse_list(optarg, bits, MAX_SIZES); break;
+        case 'r': reps = (uint32_t) strtoul(optarg, NULL, 10); break;
+        case 'w': warmup = (uint32_t) strtoul(optarg, NULL, 10); break;
+        case 'i': iters = (uint64_t) strtoul(optarg, NULL, 10); break;
+        case 's': seed = (uint64_t) strtoul(optarg, NULL, 10); break;
+        case 'h': print_help(); return 0;
+        default: print_help(); return -1;
+        }
+    }
+
+    if (bit_count == 0 || reps == 0 || iters == 0) {
+        print_help();
+        return -1;
+    }
+
+    randstate_init(seed);
+    nt_workspace_init(&workspace, 0);
+    nt_workspace_init(&mpn_workspace, 0);
+
+    bool ok = true;
+    for (uint32_t i = 0; i < bit_count; i++) {
+        ok = cross_check(bits[i], 16, iters) && ok;
+    }
+    printf("cross-check: %s\n\n", ok ? "ok" : "FAILED");
+
+    printf("%-14s %-20s %6s %14s %14s %8s\n", "routine", "gmp", "bits", "ours (us)",
+        "gmp (us)", "ratio");
+
+    operands x;
+    mpz_inits(x.a, x.b, x.n, x.e, x.prime, x.composite, NULL);
+    mpz_t out;
+    mpz_init(out);
+
+    for (uint32_t i = 0; i < bit_count; i++) {
+        current_bits = bits[i];
+        for (size_t j = 0; j < sizeof(pairs) / sizeof(pairs[0]); j++) {
+            double ours = time_op(pairs[j].ours, out, &x, bits[i], reps, warmup, iters);
+            double gmp = time_op(pairs[j].gmp, out, &x, bits[i], reps, warmup, iters);
+            printf("%-14s %-20s %6llu %14.2f %14.2f %8.2f\n", pairs[j].name, pairs[j].gmp_name,
+                (unsigned long long) bits[i], ours * 1e6, gmp * 1e6, ours / gmp);
+            fflush(stdout);
+        }
+    }
+
+    mpz_clear(out);
+    mpz_clears(x.a, x.b, x.n, x.e, x.prime, x.composite, NULL);
+    nt_workspace_clear(&workspace);
+    nt_workspace_clear(&mpn_workspace);
+    randstate_clear();
+    return ok ? 0 : 1;
+}
+
+/*
+    Parses a comma separated list of numbers into values. Returns how many were read.
+*/
+uint32_t parse_list(const char *arg, uint64_t *values, uint32_t max) {
+    uint32_t count = 0;
+    const char *cursor = arg;
+    while (*cursor != '\0' && count < max) {
+        char *end;
+        values[count] = (uint64_t) strtoull(cursor, &end, 10);
+        if (end == cursor || values[count] == 0) {
+            return 0;
+        }
+        count++;
+        cursor = *end == ',' ? end + 1 : end;
+    }
+    return count;
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+    Draws random operands of bits bits: a, b and e uniform, n odd with the top bit set,
+    plus a prime and a composite (product of two primes) for the primality tests.
+*/
+void draw_operands(operands *x, uint64_t bits) {
+    mpz_urandomb(x->a, state, bits);
+    mpz_urandomb(x->b, state, bits);
+    mpz_urandomb(x->e, state, bits);
+    mpz_urandomb(x->n, state, bits);
+    mpz_setbit(x->n, bits - 1);
+    mpz_setbit(x->n, 0);
+
+    mpz_urandomb(x->prime, state, bits);
+    mpz_setbit(x->prime, bits - 1);
+    mpz_nextprime(x->prime, x->prime);
+
+    mpz_urandomb(x->composite, state, bits / 2);
+    mpz_setbit(x->composite, bits / 2 - 1);
+    mpz_nextprime(x->composite, x->composite);
+    mpz_mul(x->composite, x->composite, x->prime);
+    return;
+}
+
+/*
+    Median seconds per call of op over reps calls after warmup untimed calls.
+    Fresh operands are drawn before every call and are not timed.
+*/
+double time_op(bench_op op, mpz_t out, operands *x, uint64_t bits, uint32_t reps,
+    uint32_t warmup, uint64_t iters) {
+    for (uint32_t i = 0; i < warmup; i++) {
+        draw_operands(x, bits);
+        op(out, x, iters);
+    }
+
+    double *samples = (double *) calloc(reps, sizeof(double));
+    for (uint32_t i = 0; i < reps; i++) {
+        draw_operands(x, bits);
+        double start = now_seconds();
+        op(out, x, iters);
+        samples[i] = now_seconds() - start;
+    }
+    qsort(samples, reps, sizeof(double), compare_doubles);
+    double median = samples[reps / 2];
+    free(samples);
+    return median;
+}
+
+/*
+    Checks the numtheory routines against GMP on count random operand sets of bits bits.
+*/
+bool cross_check(uint64_t bits, uint32_t count, uint64_t iters) {
+    operands x;
+    mpz_inits(x.a, x.b, x.n, x.e, x.prime, x.composite, NULL);
+    mpz_t ours, theirs;
+    mpz_inits(ours, theirs, NULL);
+    bool ok = true;
+
+    for (uint32_t i = 0; i < count && ok; i++) {
+        draw_operands(&x, bits);
+
+        pow_mod(ours, x.a, x.e, x.n);
+        mpz_powm(theirs, x.a, x.e, x.n);
+        ok = ok && mpz_cmp(ours, theirs) == 0;
+        pow_mod_ws(ours, x.a, x.e, x.n, &workspace);
+        ok = ok && mpz_cmp(ours, theirs) == 0;
+        op_pow_mod_mpn(ours, &x, iters);
+        ok = ok && mpz_cmp(ours, theirs) == 0;
+
+        mod_inverse(ours, x.a, x.n);
+        if (mpz_invert(theirs, x.a, x.n) == 0) {
+            mpz_set_ui(theirs, 0); //mod_inverse reports no inverse as 0
+        }
+        ok = ok && mpz_cmp(ours, theirs) == 0;
+        mod_inverse_ws(ours, x.a, x.n, &workspace);
+        ok = ok && mpz_cmp(ours, theirs) == 0;
+
+        gcd(ours, x.a, x.b);
+        mpz_gcd(theirs, x.a, x.b);
+        ok = ok && mpz_cmp(ours, theirs) == 0;
+        gcd_ws(ours, x.a, x.b, &workspace);
+        ok = ok && mpz_cmp(ours, theirs) == 0;
+
+        ok = ok && is_prime(x.prime, iters) && !is_prime(x.composite, iters);
+        ok = ok && is_prime_ws(x.prime, iters, state, &workspace)
+             && !is_prime_ws(x.composite, iters, state, &workspace);
+        ok = ok && is_prime_bpsw(x.prime) && !is_prime_bpsw(x.composite);
+
+        make_prime(ours, bits, iters);
+        ok = ok && mpz_probab_prime_p(ours, 30) > 0 && mpz_sizeinbase(ours, 2) == bits + 1;
+
+        if (!ok) {
+            printf("cross-check failed at %llu bits\n", (unsigned long long) bits);
+        }
+    }
+
+    mpz_clears(ours, theirs, NULL);
+    mpz_clears(x.a, x.b, x.n, x.e, x.prime, x.composite, NULL);
+    return ok;
+}
+
+void op_pow_mod(mpz_t out, const operands *x, uint64_t iters) {
+    (void) iters;
+    pow_mod(out, x->a, x->e, x->n);
+}
+
+void op_pow_mod_ws(mpz_t out, const operands *x, uint64_t iters) {
+    (void) iters;
+    pow_mod_ws(out, x->a, x->e, x->n, &workspace);
+}
+
+/*
+    pow_mod_ws on GMP's mpn functions even where a fixed size kernel exists.
+*/
+void op_pow_mod_mpn(mpz_t out, const operands *x, uint64_t iters) {
+    (void) iters;
+    mont_fixed_enable(false);
+    pow_mod_ws(out, x->a, x->e, x->n, &mpn_workspace);
+    mont_fixed_enable(true);
+}
+
+void op_mpz_powm(mpz_t out, const operands *x, uint64_t iters) {
+    (void) iters;
+    mpz_powm(out, x->a, x->e, x->n);
+}
+
+void op_mod_inverse(mpz_t out, const operands *x, uint64_t iters) {
+    (void) iters;
+    mod_inverse(out, x->a, x->n);
+}
+
+void op_mod_inverse_ws(mpz_t out, const operands *x, uint64_t iters) {
+    (void) iters;
+    mod_inverse_ws(out, x->a, x->n, &workspace);
+}
+
+void op_mpz_invert(mpz_t out, const operands *x, uint64_t iters) {
+    (void) iters;
+    mpz_invert(out, x->a, x->n);
+}
+
+void op_gcd(mpz_t out, const operands *x, uint64_t iters) {
+    (void) iters;
+    gcd(out, x->a, x->b);
+}
+
+void op_mpz_gcd(mpz_t out, const operands *x, uint64_t iters) {
+    (void) iters;
+    mpz_gcd(out, x->a, x->b);
+}
+
+//Primality tests run on the prime, the expensive case where every round is needed
+void op_is_prime(mpz_t out, const operands *x, uint64_t iters) {
+    mpz_set_ui(out, is_prime(x->prime, iters));
+}
+
+void op_is_prime_ws(mpz_t out, const operands *x, uint64_t iters) {
+    mpz_set_ui(out, is_prime_ws(x->prime, iters, state, &workspace));
+}
+
+void op_is_prime_bpsw(mpz_t out, const operands *x, uint64_t iters) {
+    (void) iters;
+    mpz_set_ui(out, is_prime_bpsw(x->prime));
+}
+
+void op_mpz_probab_prime_p(mpz_t out, const operands *x, uint64_t iters) {
+    mpz_set_ui(out, (unsigned long) mpz_probab_prime_p(x->prime, (int) iters));
+}
+
+void op_make_prime(mpz_t out, const operands *x, uint64_t iters) {
+    (void) x;
+    make_prime(out, current_bits, iters);
+}
+
+//GMP has no random prime generator, a random start plus mpz_nextprime is the equivalent
+void op_mpz_nextprime(mpz_t out, const operands *x, uint64_t iters) {
+    (void) x;
+    (void) iters;
+    mpz_urandomb(out, state, current_bits);
+    mpz_setbit(out, current_bits);
+    mpz_nextprime(out, out);
+}
+
+/*
+    Prints help message
+*/
+void print_help(void) {
+    printf("SYNOPSIS\n"
+           "   Microbenchmarks pow_mod, mod_inverse, gcd, is_prime and make_prime against\n"
+           "   mpz_powm, mpz_invert, mpz_gcd, mpz_probab_prime_p and mpz_nextprime.\n"
+           "   The _ws rows reuse one workspace across every call. pow_mod_mpn is\n"
+           "   pow_mod_ws without the fixed size kernels of montfixed.c.\n"
+           "   Results are checked against GMP first. Times are medians per call.\n\n"
+
+           "USAGE\n"
+           "   ./ntbench [OPTIONS]\n\n"
+
+           "OPTIONS\n"
+           "   -h              Display program help and usage.\n"
+           "   -b bits,...     Operand sizes to sweep (default: 256,512,1024,2048,4096).\n"
+           "   -r reps         Timed calls per routine and size (default: 20).\n"
+           "   -w warmup       Untimed calls before timing (default: 3).\n"
+           "   -i iterations   Miller-Rabin iterations for both sides (default: 25).\n"
+           "   -s seed         Random seed (default: current time).\n");
+}
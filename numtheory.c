@@ -1,18 +1,121 @@
 #include "numtheory.h"
 #include "randstate.h"
+#include "montfixed.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if GMP_NAIL_BITS != 0
+#error "The Montgomery kernel in pow_mod requires a GMP build without nail bits"
+#endif
+
+//make_prime sieves candidates against every odd prime below this bound (3511 primes)
+#define SIEVE_PRIME_LIMIT 32768
+//Below this size candidates are drawn one at a time, the sieve primes could be candidates
+#define SIEVE_MIN_BITS 32
+
+uint32_t *small_primes = NULL;
+size_t small_prime_count = 0;
+pthread_once_t small_primes_once = PTHREAD_ONCE_INIT;
+
+//Widest window pick_window hands out
+#define EXP_MAX_WINDOW 6
 
 //Helper functions not in header file
-void mod_inverse_swap(mpz_t, mpz_t, mpz_t);
-void set_r_s_values(mpz_t, mpz_t, const mpz_t n);
-void create_random_number(mpz_t a, const mpz_t n);
-bool witness(mpz_t a, const mpz_t n);
+void mod_inverse_swap(mpz_t, mpz_t, mpz_t, mpz_t temp_swap, mpz_t temp_q);
+uint64_t set_r_s_values(mpz_t s, const mpz_t n);
+void create_random_number(mpz_t a, const mpz_t n, gmp_randstate_t rs, mpz_t range);
+bool witness(mpz_t a, const mpz_t n, nt_workspace *w);
+uint32_t pick_window(size_t bits);
+void exp_recode_digits(exp_recoding *r, const mpz_t d, size_t bits);
+void mont_set(mont_modulus *m, const mpz_t n, mpz_t temp);
+void nt_workspace_reserve(nt_workspace *w, mp_size_t size);
+void mpz_to_limbs(mp_limb_t *rp, mp_size_t size, const mpz_t x);
+void mont_redc(mp_limb_t *rp, mp_limb_t *tp, const mont_modulus *m);
+void mont_mul(mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp, const mont_modulus *m,
+    mp_limb_t *tp);
+void mont_sqr(mp_limb_t *rp, const mp_limb_t *ap, const mont_modulus *m, mp_limb_t *tp);
+void pow_mod_generic(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n, nt_workspace *w);
+void build_small_primes(void);
+bool strong_probable_prime_base2(const mpz_t n, nt_workspace *w);
+bool strong_lucas_probable_prime(const mpz_t n, nt_workspace *w);
+void lucas_halve(mpz_t x, const mpz_t n);
+bool sieve_interval(mpz_t p, const mpz_t start, const mpz_t limit, uint64_t iters,
+    gmp_randstate_t rs, nt_workspace *w);
+
+/*
+    Sizes every temporary of w for moduli of up to bits bits. bits = 0 leaves them
+    empty, they grow on first use.
+*/
+void nt_workspace_init(nt_workspace *w, mp_bitcnt_t bits) {
+    //Products of two residues before they are reduced
+    for (int i = 0; i < NT_WORKSPACE_TEMPS; i++) {
+        mpz_init2(w->temp[i], 2 * bits);
+    }
+    for (int i = 0; i < 3; i++) {
+        mpz_init2(w->pow[i], 2 * bits);
+    }
+    mpz_init2(w->exp_d, bits);
+
+    w->size = 0;
+    w->mont.size = 0;
+    w->mont.mod = NULL;
+    mpz_init2(w->mont.mod_z, bits);
+    w->mont_valid = false;
+    w->exp_bits = 0;
+    w->exp.shift = (uint32_t *) calloc(1, sizeof(uint32_t));
+    w->exp.digit = (uint32_t *) calloc(1, sizeof(uint32_t));
+    w->exp_valid = false;
+    mont_scratch_init(&w->scratch, 1, EXP_MAX_WINDOW);
+    nt_workspace_reserve(w, (mp_size_t) ((bits + GMP_NUMB_BITS - 1) / GMP_NUMB_BITS));
+    return;
+}
+
+void nt_workspace_clear(nt_workspace *w) {
+    for (int i = 0; i < NT_WORKSPACE_TEMPS; i++) {
+        mpz_clear(w->temp[i]);
+    }
+    mpz_clears(w->pow[0], w->pow[1], w->pow[2], w->exp_d, NULL);
+    mont_clear(&w->mont);
+    exp_recoding_clear(&w->exp);
+    mont_scratch_clear(&w->scratch);
+    return;
+}
+
+/*
+    Grows the Montgomery buffers of w to moduli of size limbs.
+*/
+void nt_workspace_reserve(nt_workspace *w, mp_size_t size) {
+    if (size <= w->size) {
+        return;
+    }
+    w->size = size;
+    w->mont.mod = (mp_limb_t *) realloc(w->mont.mod, (size_t) size * 2 * sizeof(mp_limb_t));
+    w->mont_valid = false;
+    mont_scratch_clear(&w->scratch);
+    mont_scratch_init(&w->scratch, size, EXP_MAX_WINDOW);
+    return;
+}
 
 /*
     Function to calculate and set g to the GCD of a & b using Euclid's Method.
 */
 void gcd(mpz_t g, const mpz_t a, const mpz_t b) {
-    mpz_t temp, c, d;
-    mpz_inits(temp, c, d, NULL); //temp = 0
+    nt_workspace w;
+    nt_workspace_init(&w, 0);
+    gcd_ws(g, a, b, &w);
+    nt_workspace_clear(&w);
+    return;
+}
+
+/*
+    gcd on w's temporaries.
+*/
+void gcd_ws(mpz_t g, const mpz_t a, const mpz_t b, nt_workspace *w) {
+    mpz_ptr temp = w->temp[0], c = w->temp[1], d = w->temp[2];
 
     //Below required such that a, b are maintained
     mpz_set(c, a); //c = a
@@ -25,8 +128,6 @@ void gcd(mpz_t g, const mpz_t a, const mpz_t b) {
         mpz_set(c, temp); //c = temp;
     }
     mpz_set(g, c); //g = a;
-
-    mpz_clears(temp, c, d, NULL);
     return;
 }
 
@@ -34,10 +135,7 @@ void gcd(mpz_t g, const mpz_t a, const mpz_t b) {
     Swap function for mod_inverse.
     mpz_t variables act as pointers, where values swapped are dereferenced
 */
-void mod_inverse_swap(mpz_t x, mpz_t x_prime, mpz_t q) {
-    mpz_t temp_swap, temp_q;
-    mpz_inits(temp_swap, temp_q, NULL);
-
+void mod_inverse_swap(mpz_t x, mpz_t x_prime, mpz_t q, mpz_t temp_swap, mpz_t temp_q) {
     mpz_set(temp_swap, x_prime); //temp = x_prime;
 
     //Below is x_prime = x - (q * x_prime)
@@ -46,8 +144,6 @@ void mod_inverse_swap(mpz_t x, mpz_t x_prime, mpz_t q) {
     mpz_set(x_prime, x); //x_prime = x
 
     mpz_set(x, temp_swap); // x = temp
-
-    mpz_clears(temp_swap, temp_q, NULL);
     return;
 }
 
@@ -55,31 +151,36 @@ void mod_inverse_swap(mpz_t x, mpz_t x_prime, mpz_t q) {
     Modular inverse function. (a % n )^-1 with output in o.
 */
 void mod_inverse(mpz_t o, const mpz_t a, const mpz_t n) {
-    mpz_t r, r_prime, t, t_prime;
-    mpz_inits(r, r_prime, t, t_prime, NULL);
+    nt_workspace w;
+    nt_workspace_init(&w, 0);
+    mod_inverse_ws(o, a, n, &w);
+    nt_workspace_clear(&w);
+    return;
+}
+
+/*
+    mod_inverse on w's temporaries.
+*/
+void mod_inverse_ws(mpz_t o, const mpz_t a, const mpz_t n, nt_workspace *w) {
+    mpz_ptr r = w->temp[0], r_prime = w->temp[1], t = w->temp[2], t_prime = w->temp[3];
+    mpz_ptr quotient = w->temp[4], temp_swap = w->temp[5], temp_q = w->temp[6];
 
-    mpz_add(r, r, n); //r = n
-    mpz_add(r_prime, r_prime, a); //r' = a
-    mpz_add_ui(t_prime, t_prime, 1); //t' = 1
-        //t = 0
+    mpz_set(r, n); //r = n
+    mpz_set(r_prime, a); //r' = a
+    mpz_set_ui(t, 0); //t = 0
+    mpz_set_ui(t_prime, 1); //t' = 1
 
     //while (r_prime != 0)
     while (mpz_cmp_ui(r_prime, 0) != 0) {
-        mpz_t quotient;
-        mpz_init(quotient);
-
         mpz_fdiv_q(quotient, r, r_prime); //quotient = r/r_prime;
 
-        mod_inverse_swap(r, r_prime, quotient);
-        mod_inverse_swap(t, t_prime, quotient);
-
-        mpz_clear(quotient);
+        mod_inverse_swap(r, r_prime, quotient, temp_swap, temp_q);
+        mod_inverse_swap(t, t_prime, quotient, temp_swap, temp_q);
     }
 
     //if (r > 1)
     if (mpz_cmp_ui(r, 1) > 0) {
         mpz_set_ui(o, 0);
-        mpz_clears(r, r_prime, t, t_prime, NULL);
         return;
     }
 
@@ -89,16 +190,312 @@ void mod_inverse(mpz_t o, const mpz_t a, const mpz_t n) {
     }
 
     mpz_set(o, t); //o = t
-    mpz_clears(r, r_prime, t, t_prime, NULL);
     return;
 }
 
 /*
-    Performs power mod of a^d % n and outputs in o.
+    Picks the window width for an exponent of *bits* bits.
 */
-void pow_mod(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n) {
-    mpz_t v, p, e;
-    mpz_inits(v, p, e, NULL);
+uint32_t pick_window(size_t bits) {
+    if (bits > 671) {
+        return EXP_MAX_WINDOW;
+    } else if (bits > 239) {
+        return 5;
+    } else if (bits > 79) {
+        return 4;
+    } else if (bits > 23) {
+        return 3;
+    } else if (bits > 7) {
+        return 2;
+    }
+    return 1;
+}
+
+/*
+    Recodes d >= 0 into sliding window digits. d = 0 gives no digits.
+*/
+void exp_recode(exp_recoding *r, const mpz_t d) {
+    size_t bits = mpz_sgn(d) == 0 ? 0 : mpz_sizeinbase(d, 2);
+    r->shift = (uint32_t *) calloc(bits + 1, sizeof(uint32_t));
+    r->digit = (uint32_t *) calloc(bits + 1, sizeof(uint32_t));
+    exp_recode_digits(r, d, bits);
+    return;
+}
+
+/*
+    Fills in the recoding of d, which has bits bits, into shift and digit arrays that
+    hold at least bits + 1 entries.
+*/
+void exp_recode_digits(exp_recoding *r, const mpz_t d, size_t bits) {
+    r->window = pick_window(bits);
+    r->count = 0;
+    r->tail = 0;
+
+    uint32_t pending = 0; //Squarings since the last digit
+    size_t i = bits; //One past the bit being looked at
+    while (i > 0) {
+        //if bit i - 1 is 0, it only adds a squaring
+        if (mpz_tstbit(d, i - 1) == 0) {
+            pending++;
+            i--;
+            continue;
+        }
+        //Window [j, i - 1] ending on a set bit
+        size_t j = i > r->window ? i - r->window : 0;
+        while (mpz_tstbit(d, j) == 0) {
+            j++;
+        }
+        uint32_t value = 0;
+        for (size_t b = i; b > j; b--) {
+            value = (value << 1) | (uint32_t) mpz_tstbit(d, b - 1);
+        }
+        r->shift[r->count] = pending + (uint32_t) (i - j);
+        r->digit[r->count] = value >> 1; //value is odd, table index = (value - 1) / 2
+        r->count++;
+        pending = 0;
+        i = j;
+    }
+    r->tail = pending;
+    r->shift[0] = 0; //Nothing to square before the leading digit
+    return;
+}
+
+bool exp_recoding_load(exp_recoding *r, uint32_t window, size_t count, uint32_t tail,
+    const uint32_t *shift, const uint32_t *digit) {
+    r->window = window;
+    r->count = count;
+    r->tail = tail;
+    r->shift = (uint32_t *) calloc(count + 1, sizeof(uint32_t));
+    r->digit = (uint32_t *) calloc(count + 1, sizeof(uint32_t));
+    bool valid = window >= 1 && window <= EXP_MAX_WINDOW;
+    for (size_t i = 0; valid && i < count; i++) {
+        //table holds 2^(window - 1) odd powers
+        valid = digit[i] < ((uint32_t) 1 << (window - 1));
+        r->shift[i] = shift[i];
+        r->digit[i] = digit[i];
+    }
+    if (!valid) {
+        exp_recoding_clear(r);
+    }
+    return valid;
+}
+
+void exp_recoding_clear(exp_recoding *r) {
+    free(r->shift);
+    free(r->digit);
+    return;
+}
+
+/*
+    Copies x (0 <= x < 2^(64*size)) into size limbs, zero padded.
+*/
+void mpz_to_limbs(mp_limb_t *rp, mp_size_t size, const mpz_t x) {
+    mp_size_t used = (mp_size_t) mpz_size(x);
+    if (used > 0) {
+        mpn_copyi(rp, mpz_limbs_read(x), used);
+    }
+    if (size > used) {
+        mpn_zero(rp + used, size - used);
+    }
+    return;
+}
+
+/*
+    Sets up the Montgomery constants for odd n > 1.
+*/
+void mont_init(mont_modulus *m, const mpz_t n) {
+    m->mod = (mp_limb_t *) calloc(mpz_size(n) * 2, sizeof(mp_limb_t));
+    mpz_init(m->mod_z);
+
+    mpz_t temp;
+    mpz_init(temp);
+    mont_set(m, n, temp);
+    mpz_clear(temp);
+    return;
+}
+
+/*
+    Computes the Montgomery constants for odd n > 1 into m, whose mod buffer must hold
+    2 * mpz_size(n) limbs, and picks the kernel specialized for its size if there is one.
+    temp is clobbered.
+*/
+void mont_set(mont_modulus *m, const mpz_t n, mpz_t temp) {
+    m->size = (mp_size_t) mpz_size(n);
+    m->r2 = m->mod + m->size;
+    mpz_to_limbs(m->mod, m->size, n);
+
+    //Newton iteration for n^-1 % 2^64, every step doubles the correct low bits
+    mp_limb_t n0 = m->mod[0];
+    mp_limb_t inv = n0; //Correct to 3 bits since n0 * n0 = 1 % 8 for odd n0
+    for (int i = 0; i < 5; i++) {
+        inv *= 2 - n0 * inv;
+    }
+    m->minv = -inv;
+
+    mpz_set(m->mod_z, n);
+
+    mpz_set_ui(temp, 0);
+    mpz_setbit(temp, (mp_bitcnt_t) (2 * GMP_NUMB_BITS * m->size)); //temp = R^2
+    mpz_mod(temp, temp, n);
+    mpz_to_limbs(m->r2, m->size, temp);
+
+    m->fixed = mont_fixed_find(m->size);
+    return;
+}
+
+bool mont_load(mont_modulus *m, const mp_limb_t *mod, const mp_limb_t *r2, mp_size_t size,
+    mp_limb_t minv) {
+    //Top limb set, odd, and minv really is -mod^-1
+    if (size < 1 || mod[size - 1] == 0 || (mod[0] & 1) == 0 || mod[0] * minv != (mp_limb_t) -1
+        || (size == 1 && mod[0] == 1)) {
+        return false;
+    }
+    m->size = size;
+    m->minv = minv;
+    m->mod = (mp_limb_t *) calloc((size_t) size * 2, sizeof(mp_limb_t));
+    m->r2 = m->mod + size;
+    memcpy(m->mod, mod, (size_t) size * sizeof(mp_limb_t));
+    memcpy(m->r2, r2, (size_t) size * sizeof(mp_limb_t));
+    mpz_init(m->mod_z);
+    mpz_import(m->mod_z, (size_t) size, -1, sizeof(mp_limb_t), 0, 0, mod);
+    m->fixed = mont_fixed_find(size);
+    return true;
+}
+
+void mont_clear(mont_modulus *m) {
+    free(m->mod);
+    mpz_clear(m->mod_z);
+    return;
+}
+
+/*
+    Montgomery reduction: rp = tp * R^-1 % n for tp < n * R (2 * size limbs, clobbered).
+    The carry of each row is parked in the limb the row just cleared and added back at the end.
+*/
+void mont_redc(mp_limb_t *rp, mp_limb_t *tp, const mont_modulus *m) {
+    mp_size_t size = m->size;
+    for (mp_size_t i = 0; i < size; i++) {
+        mp_limb_t u = tp[i] * m->minv; //tp[i] + u * n[0] = 0 % 2^64
+        tp[i] = mpn_addmul_1(tp + i, m->mod, size, u);
+    }
+    mp_limb_t carry = mpn_add_n(rp, tp + size, tp, size);
+    //if (rp >= n) rp -= n
+    if (carry != 0 || mpn_cmp(rp, m->mod, size) >= 0) {
+        mpn_sub_n(rp, rp, m->mod, size);
+    }
+    return;
+}
+
+/*
+    rp = ap * bp * R^-1 % n using tp (2 * size limbs) as scratch. rp may alias ap or bp.
+*/
+void mont_mul(mp_limb_t *rp, const mp_limb_t *ap, const mp_limb_t *bp, const mont_modulus *m,
+    mp_limb_t *tp) {
+    mpn_mul_n(tp, ap, bp, m->size);
+    mont_redc(rp, tp, m);
+    return;
+}
+
+/*
+    rp = ap * ap * R^-1 % n using tp (2 * size limbs) as scratch. rp may alias ap.
+*/
+void mont_sqr(mp_limb_t *rp, const mp_limb_t *ap, const mont_modulus *m, mp_limb_t *tp) {
+    mpn_sqr(tp, ap, m->size);
+    mont_redc(rp, tp, m);
+    return;
+}
+
+/*
+    Sizes scratch for moduli of up to size limbs and windows of up to window bits.
+*/
+void mont_scratch_init(mont_scratch *s, mp_size_t size, uint32_t window) {
+    size_t entries = (size_t) 1 << (window - 1);
+    s->size = size;
+    s->window = window;
+    //table (entries * size), result (size), product (2 * size)
+    s->limbs = (mp_limb_t *) calloc((entries + 3) * (size_t) size, sizeof(mp_limb_t));
+    mpz_init2(s->base, (mp_bitcnt_t) (2 * GMP_NUMB_BITS * size));
+    return;
+}
+
+void mont_scratch_clear(mont_scratch *s) {
+    free(s->limbs);
+    mpz_clear(s->base);
+    return;
+}
+
+/*
+    o = a^d % n in Montgomery form, where r is the recoding of d.
+    The odd powers of a are tabulated, then each digit costs its squarings and one product.
+*/
+void pow_mod_mont(mpz_t o, const mpz_t a, const mont_modulus *m, const exp_recoding *r,
+    mont_scratch *s) {
+    stats_add(STATS_MODEXPS, 1);
+    //if d == 0, a^0 = 1
+    if (r->count == 0) {
+        mpz_set_ui(o, 1);
+        return;
+    }
+
+    mp_size_t size = m->size;
+    size_t entries = (size_t) 1 << (r->window - 1);
+    mp_limb_t *table = s->limbs;
+    mp_limb_t *result = table + entries * (size_t) size;
+    mp_limb_t *tp = result + size;
+
+    //if a is negative or a >= n, reduce it first
+    if (mpz_sgn(a) < 0 || (mp_size_t) mpz_size(a) > size
+        || ((mp_size_t) mpz_size(a) == size && mpn_cmp(mpz_limbs_read(a), m->mod, size) >= 0)) {
+        mpz_mod(s->base, a, m->mod_z); //base = a % n
+        mpz_to_limbs(result, size, s->base);
+    } else {
+        mpz_to_limbs(result, size, a);
+    }
+
+    if (m->fixed != NULL) {
+        m->fixed(result, result, m, r, table);
+    } else {
+        //table[0] = a * R % n
+        mont_mul(table, result, m->r2, m, tp);
+
+        //table[i] = table[i - 1] * a^2
+        if (entries > 1) {
+            mont_sqr(result, table, m, tp);
+            for (size_t i = 1; i < entries; i++) {
+                mont_mul(table + i * size, table + (i - 1) * size, result, m, tp);
+            }
+        }
+
+        mpn_copyi(result, table + r->digit[0] * (size_t) size, size);
+        for (size_t i = 1; i < r->count; i++) {
+            for (uint32_t j = 0; j < r->shift[i]; j++) {
+                mont_sqr(result, result, m, tp);
+            }
+            mont_mul(result, result, table + r->digit[i] * (size_t) size, m, tp);
+        }
+        for (uint32_t j = 0; j < r->tail; j++) {
+            mont_sqr(result, result, m, tp);
+        }
+
+        //Leave Montgomery form: result * R^-1 % n
+        mpn_copyi(tp, result, size);
+        mpn_zero(tp + size, size);
+        mont_redc(result, tp, m);
+    }
+
+    mp_limb_t *op = mpz_limbs_write(o, size);
+    mpn_copyi(op, result, size);
+    mpz_limbs_finish(o, size);
+    return;
+}
+
+/*
+    Original right-to-left square and multiply, kept for even moduli where Montgomery
+    reduction does not apply.
+*/
+void pow_mod_generic(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n, nt_workspace *w) {
+    mpz_ptr v = w->pow[0], p = w->pow[1], e = w->pow[2];
+    stats_add(STATS_MODEXPS, 1);
 
     mpz_set_ui(v, 1); //v = 1
     mpz_set(p, a); //p = a
@@ -119,119 +516,402 @@ void pow_mod(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n) {
     }
 
     mpz_set(o, v); // o = v
-    mpz_clears(v, p, e, NULL);
     return;
 }
 
 /*
-    Sets r and s values for is_prime.
+    Performs power mod of a^d % n and outputs in o.
+    Odd moduli use the Montgomery sliding window kernel.
 */
-void set_r_s_values(mpz_t r, mpz_t s, const mpz_t n) {
-    //s = n - 1
-    mpz_set(s, n);
-    mpz_sub_ui(s, s, 1);
-    //r = 0 *Should already be 0*
+void pow_mod(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n) {
+    nt_workspace w;
+    nt_workspace_init(&w, 0);
+    pow_mod_ws(o, a, d, n, &w);
+    nt_workspace_clear(&w);
+    return;
+}
+
+/*
+    pow_mod on w's buffers. The Montgomery constants and the recoding of d are only
+    rebuilt when n or d differ from the previous call.
+*/
+void pow_mod_ws(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n, nt_workspace *w) {
+    //if n is even, or n <= 1
+    if (mpz_even_p(n) != 0 || mpz_cmp_ui(n, 1) <= 0) {
+        pow_mod_generic(o, a, d, n, w);
+        return;
+    }
 
-    //while (is_even(s))
-    while (mpz_even_p(s) != 0) {
-        mpz_fdiv_q_ui(s, s, 2); //s = s / 2;
-        mpz_add_ui(r, r, 1); //r++
+    if (!w->mont_valid || mpz_cmp(w->mont.mod_z, n) != 0) {
+        nt_workspace_reserve(w, (mp_size_t) mpz_size(n));
+        mont_set(&w->mont, n, w->pow[0]);
+        w->mont_valid = true;
     }
 
+    if (!w->exp_valid || mpz_cmp(w->exp_d, d) != 0) {
+        size_t bits = mpz_sgn(d) == 0 ? 0 : mpz_sizeinbase(d, 2);
+        if (bits > w->exp_bits) {
+            w->exp.shift = (uint32_t *) realloc(w->exp.shift, (bits + 1) * sizeof(uint32_t));
+            w->exp.digit = (uint32_t *) realloc(w->exp.digit, (bits + 1) * sizeof(uint32_t));
+            w->exp_bits = bits;
+        }
+        exp_recode_digits(&w->exp, d, bits);
+        mpz_set(w->exp_d, d);
+        w->exp_valid = true;
+    }
+
+    pow_mod_mont(o, a, &w->mont, &w->exp, &w->scratch);
     return;
 }
 
+/*
+    Sets s for is_prime such that n - 1 = s * 2^r, and returns r.
+*/
+uint64_t set_r_s_values(mpz_t s, const mpz_t n) {
+    //s = n - 1
+    mpz_sub_ui(s, n, 1);
+    uint64_t r = mpz_scan1(s, 0); //Trailing zero bits of s
+    mpz_fdiv_q_2exp(s, s, r); //s = s / 2^r
+    return r;
+}
+
 /*
     Creates random number in range [2, n - 2] and puts the random value in a.
-    Seed is based off of state from randstate.h
+    Drawn from rs, which is state from randstate.h unless a thread brings its own.
 */
-void create_random_number(mpz_t a, const mpz_t n) {
-    mpz_t range;
-    mpz_init(range);
-    mpz_set(range, n); //range = n
-    mpz_sub_ui(range, range, 4); //range = range - 4
+void create_random_number(mpz_t a, const mpz_t n, gmp_randstate_t rs, mpz_t range) {
+    mpz_sub_ui(range, n, 4); //range = n - 4
 
-    mpz_urandomm(a, state, range); //get_random_num(a); [0, range]
+    mpz_urandomm(a, rs, range); //get_random_num(a); [0, range]
     mpz_add_ui(a, a, 2); //a += 2
-
-    mpz_clear(range);
     return;
 }
 
 /*
-    Witness function for Miller-Rabin Test
+    Witness function for Miller-Rabin Test. Squares with mpz_mul and mpz_mod so the
+    exponent pow_mod_ws caches stays s for every witness against n.
 */
-bool witness(mpz_t a, const mpz_t n) {
-    mpz_t r, s, x, y, two, temp;
-    mpz_inits(r, s, x, y, two, temp, NULL);
-    mpz_set_ui(two, 2); //two = 2
+bool witness(mpz_t a, const mpz_t n, nt_workspace *w) {
+    mpz_ptr s = w->temp[2], x = w->temp[3], y = w->temp[4], temp = w->temp[5];
+    stats_add(STATS_MR_ROUNDS, 1);
 
     //temp = n - 1
     mpz_sub_ui(temp, n, 1);
 
-    set_r_s_values(r, s, n);
+    uint64_t r = set_r_s_values(s, n);
 
-    pow_mod(x, a, s, n);
+    pow_mod_ws(x, a, s, n, w);
 
-    mpz_t i;
-    //for (int i = 0; i < r; i++)
-    for (mpz_init(i); mpz_cmp(i, r) < 0; mpz_add_ui(i, i, 1)) {
-        pow_mod(y, x, two, n);
+    for (uint64_t i = 0; i < r; i++) {
+        mpz_mul(y, x, x); //y = x^2 % n
+        mpz_mod(y, y, n);
         //if (y == 1 && x != 1 && x != n - 1)
         if (mpz_cmp_ui(y, 1) == 0 && mpz_cmp_ui(x, 1) != 0 && mpz_cmp(x, temp) != 0) {
-            mpz_clears(i, r, s, x, y, two, temp, NULL);
             return true;
         }
         mpz_set(x, y); //x = y
     }
-    mpz_clear(i);
     //return x != 1
-    bool return_value = mpz_cmp_ui(x, 1) != 0;
-    mpz_clears(r, s, x, y, two, temp, NULL);
-    return return_value;
+    return mpz_cmp_ui(x, 1) != 0;
 }
 
 /*
     Uses Miller-Rabin test to determine if number is prime.
-    No use of init_set functions to avoid accidental allocation.
 */
 bool is_prime(const mpz_t n, uint64_t iters) {
-    mpz_t temp_mod;
-    mpz_init(temp_mod);
-    mpz_mod_ui(temp_mod, n, 2); //temp_mod = n % 2
+    return is_prime_r(n, iters, state);
+}
+
+/*
+    Uses Miller-Rabin test to determine if number is prime, drawing the witnesses from rs.
+*/
+bool is_prime_r(const mpz_t n, uint64_t iters, gmp_randstate_t rs) {
+    nt_workspace w;
+    nt_workspace_init(&w, mpz_sizeinbase(n, 2));
+    bool prime = is_prime_ws(n, iters, rs, &w);
+    nt_workspace_clear(&w);
+    return prime;
+}
 
+/*
+    is_prime_r on w's temporaries.
+*/
+bool is_prime_ws(const mpz_t n, uint64_t iters, gmp_randstate_t rs, nt_workspace *w) {
     //if n < 2 || (n != 2 && n % 2 == 0)
-    if (mpz_cmp_ui(n, 2) < 0 || (mpz_cmp_ui(n, 2) != 0 && mpz_cmp_ui(temp_mod, 0) == 0)) {
-        mpz_clear(temp_mod);
+    if (mpz_cmp_ui(n, 2) < 0 || (mpz_cmp_ui(n, 2) != 0 && mpz_even_p(n))) {
         return false;
     }
     //if (n == 2 || n == 3)
     if (mpz_cmp_ui(n, 2) == 0 || mpz_cmp_ui(n, 3) == 0) {
-        mpz_clear(temp_mod);
         return true;
     }
 
-    mpz_clear(temp_mod);
+    mpz_ptr a = w->temp[0], range = w->temp[1];
+    for (uint64_t i = 0; i < iters; i++) {
+        create_random_number(a, n, rs, range);
+        if (witness(a, n, w)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+    Strong probable prime test to base 2 (one Miller-Rabin round with a = 2) for odd n > 2.
+*/
+bool strong_probable_prime_base2(const mpz_t n, nt_workspace *w) {
+    mpz_ptr d = w->temp[0], x = w->temp[1], n_minus_one = w->temp[2];
+    stats_add(STATS_MR_ROUNDS, 1);
+
+    mpz_sub_ui(n_minus_one, n, 1); //n_minus_one = n - 1
+    mp_bitcnt_t s = mpz_scan1(n_minus_one, 0); //n - 1 = d * 2^s
+    mpz_fdiv_q_2exp(d, n_minus_one, s);
+
+    mpz_set_ui(x, 2);
+    pow_mod_ws(x, x, d, n, w); //x = 2^d % n
+
+    //if (x == 1 || x == n - 1)
+    bool probable = mpz_cmp_ui(x, 1) == 0 || mpz_cmp(x, n_minus_one) == 0;
+    for (mp_bitcnt_t r = 1; r < s && !probable; r++) {
+        mpz_mul(x, x, x); //x = x * x % n
+        mpz_mod(x, x, n);
+        if (mpz_cmp(x, n_minus_one) == 0) {
+            probable = true;
+        } else if (mpz_cmp_ui(x, 1) == 0) {
+            break; //Nontrivial square root of 1
+        }
+    }
+    return probable;
+}
+
+/*
+    x = x / 2 % n for odd n and 0 <= x < n.
+*/
+void lucas_halve(mpz_t x, const mpz_t n) {
+    if (mpz_odd_p(x)) {
+        mpz_add(x, x, n); //x + n is even
+    }
+    mpz_fdiv_q_2exp(x, x, 1);
+    return;
+}
+
+/*
+    Strong Lucas probable prime test with Selfridge's parameters for odd n > 2:
+    D is the first of 5, -7, 9, -11, ... with (D/n) = -1, P = 1, Q = (1 - D) / 4.
+    With n + 1 = d * 2^s, n passes if U_d = 0 or V_(d*2^r) = 0 for some 0 <= r < s.
+*/
+bool strong_lucas_probable_prime(const mpz_t n, nt_workspace *w) {
+    stats_add(STATS_LUCAS_TESTS, 1);
+    //A square never has (D/n) = -1, the search for D would not end
+    if (mpz_perfect_square_p(n)) {
+        return false;
+    }
 
-    mpz_t i, a;
-    mpz_inits(i, a, NULL);
+    mpz_ptr D = w->temp[0], d = w->temp[1], U = w->temp[2], V = w->temp[3];
+    mpz_ptr Qk = w->temp[4], Q = w->temp[5], temp = w->temp[6];
 
-    //for (int i = 0; i < iters; i++)
-    for (; mpz_cmp_ui(i, iters) < 0; mpz_add_ui(i, i, 1)) {
-        create_random_number(a, n);
-        if (witness(a, n)) {
-            mpz_clears(i, a, NULL);
+    int64_t d_value = 5;
+    while (true) {
+        mpz_set_si(D, d_value);
+        int jacobi = mpz_jacobi(D, n);
+        if (jacobi == -1) {
+            break;
+        }
+        //(D/n) = 0 means D shares a factor with n
+        mpz_abs(temp, D);
+        if (jacobi == 0 && mpz_cmp(temp, n) != 0) {
             return false;
         }
+        d_value = d_value > 0 ? -(d_value + 2) : -d_value + 2;
     }
 
-    mpz_clears(i, a, NULL);
-    return true;
+    mpz_set_si(Q, (1 - d_value) / 4);
+    mpz_mod(Q, Q, n); //Q = (1 - D) / 4 % n
+
+    mpz_add_ui(d, n, 1); //n + 1 = d * 2^s
+    mp_bitcnt_t s = mpz_scan1(d, 0);
+    mpz_fdiv_q_2exp(d, d, s);
+
+    //k = 1: U_1 = 1, V_1 = P = 1, Q^1 = Q
+    mpz_set_ui(U, 1);
+    mpz_set_ui(V, 1);
+    mpz_set(Qk, Q);
+
+    for (size_t bit = mpz_sizeinbase(d, 2) - 1; bit > 0; bit--) {
+        //k = 2k: U_2k = U_k * V_k, V_2k = V_k^2 - 2Q^k, Q^2k = (Q^k)^2
+        mpz_mul(U, U, V);
+        mpz_mod(U, U, n);
+        mpz_mul(V, V, V);
+        mpz_submul_ui(V, Qk, 2);
+        mpz_mod(V, V, n);
+        mpz_mul(Qk, Qk, Qk);
+        mpz_mod(Qk, Qk, n);
+
+        if (mpz_tstbit(d, bit - 1)) {
+            //k = k + 1: U_k+1 = (P * U_k + V_k) / 2, V_k+1 = (D * U_k + P * V_k) / 2
+            mpz_mul(temp, D, U);
+            mpz_add(U, U, V);
+            mpz_mod(U, U, n);
+            lucas_halve(U, n);
+            mpz_add(V, V, temp);
+            mpz_mod(V, V, n);
+            lucas_halve(V, n);
+            mpz_mul(Qk, Qk, Q);
+            mpz_mod(Qk, Qk, n);
+        }
+    }
+
+    bool probable = mpz_sgn(U) == 0 || mpz_sgn(V) == 0;
+    for (mp_bitcnt_t r = 1; r < s && !probable; r++) {
+        //V_2k = V_k^2 - 2Q^k
+        mpz_mul(V, V, V);
+        mpz_submul_ui(V, Qk, 2);
+        mpz_mod(V, V, n);
+        mpz_mul(Qk, Qk, Qk);
+        mpz_mod(Qk, Qk, n);
+        probable = mpz_sgn(V) == 0;
+    }
+    return probable;
+}
+
+/*
+    Baillie-PSW test: trial division by the small primes, a strong probable prime test
+    to base 2 and a strong Lucas test. No composite passing both tests is known.
+*/
+bool is_prime_bpsw(const mpz_t n) {
+    nt_workspace w;
+    nt_workspace_init(&w, mpz_sizeinbase(n, 2));
+    bool prime = is_prime_bpsw_ws(n, &w);
+    nt_workspace_clear(&w);
+    return prime;
+}
+
+/*
+    is_prime_bpsw on w's temporaries.
+*/
+bool is_prime_bpsw_ws(const mpz_t n, nt_workspace *w) {
+    //if n < 2 || (n != 2 && n % 2 == 0)
+    if (mpz_cmp_ui(n, 2) < 0 || (mpz_cmp_ui(n, 2) != 0 && mpz_even_p(n))) {
+        return false;
+    }
+    if (mpz_cmp_ui(n, 2) == 0) {
+        return true;
+    }
+
+    pthread_once(&small_primes_once, build_small_primes);
+    for (size_t i = 0; i < small_prime_count; i++) {
+        if (mpz_cmp_ui(n, small_primes[i]) == 0) {
+            return true;
+        }
+        if (mpz_divisible_ui_p(n, small_primes[i])) {
+            return false;
+        }
+    }
+
+    return strong_probable_prime_base2(n, w) && strong_lucas_probable_prime(n, w);
+}
+
+/*
+    Runs the primality test make_prime was asked for: BPSW when iters is PRIME_BPSW,
+    otherwise iters rounds of Miller-Rabin with witnesses from rs.
+    Counts n as a prime candidate, and as rejected if it fails.
+*/
+bool check_prime(const mpz_t n, uint64_t iters, gmp_randstate_t rs, nt_workspace *w) {
+    uint64_t span = trace_begin();
+    bool prime = iters == PRIME_BPSW ? is_prime_bpsw_ws(n, w) : is_prime_ws(n, iters, rs, w);
+    trace_span("is_prime", span, "bits", mpz_sizeinbase(n, 2));
+    stats_add(STATS_PRIME_CANDIDATES, 1);
+    stats_add(STATS_PRIME_TEST_REJECTS, prime ? 0 : 1);
+    return prime;
+}
+
+/*
+    Builds the table of odd primes below SIEVE_PRIME_LIMIT with the sieve of Eratosthenes.
+    Runs once per process.
+*/
+void build_small_primes(void) {
+    uint8_t *composite = (uint8_t *) calloc(SIEVE_PRIME_LIMIT, sizeof(uint8_t));
+    small_primes = (uint32_t *) calloc(SIEVE_PRIME_LIMIT / 2, sizeof(uint32_t));
+    for (uint32_t i = 3; i < SIEVE_PRIME_LIMIT; i += 2) {
+        if (composite[i]) {
+            continue;
+        }
+        small_primes[small_prime_count++] = i;
+        for (uint32_t j = i * i; j < SIEVE_PRIME_LIMIT; j += 2 * i) {
+            composite[j] = 1;
+        }
+    }
+    free(composite);
+    return;
+}
+
+/*
+    A bit is set in the bitmap for every candidate a small prime divides, the offsets of
+    the others are listed in order. Candidates are only sieved above SIEVE_PRIME_LIMIT,
+    below it the sieve primes could be candidates themselves.
+    Sieved out candidates are counted here, check_prime counts the rest.
+*/
+size_t sieve_candidates(uint32_t *offsets, const mpz_t start, const mpz_t limit) {
+    uint64_t bitmap[PRIME_SIEVE_WIDTH / 64] = { 0 };
+
+    pthread_once(&small_primes_once, build_small_primes);
+    bool sieve = mpz_sizeinbase(start, 2) > SIEVE_MIN_BITS;
+    for (size_t i = 0; sieve && i < small_prime_count; i++) {
+        uint64_t prime = small_primes[i];
+        uint64_t r = mpz_fdiv_ui(start, prime); //r = start % prime
+        //First j with (start + 2j) % prime == 0: j = -r * 2^-1 % prime
+        uint64_t j = ((prime - r) % prime) * ((prime + 1) / 2) % prime;
+        for (; j < PRIME_SIEVE_WIDTH; j += prime) {
+            bitmap[j / 64] |= (uint64_t) 1 << (j % 64);
+        }
+    }
+
+    //Offsets from start to limit, only the last interval below limit is cut short
+    mpz_t room;
+    mpz_init(room);
+    mpz_sub(room, limit, start);
+    mpz_cdiv_q_2exp(room, room, 1); //room = ceil((limit - start) / 2)
+    uint64_t width = mpz_sgn(room) <= 0 ? 0
+                     : (mpz_cmp_ui(room, PRIME_SIEVE_WIDTH) < 0 ? mpz_get_ui(room)
+                                                                 : PRIME_SIEVE_WIDTH);
+    mpz_clear(room);
+
+    size_t count = 0;
+    for (uint64_t j = 0; j < width; j++) {
+        if (!(bitmap[j / 64] & ((uint64_t) 1 << (j % 64)))) {
+            offsets[count++] = (uint32_t) j;
+        }
+    }
+    stats_add(STATS_PRIME_CANDIDATES, width - count);
+    stats_add(STATS_SIEVE_REJECTS, width - count);
+    return count;
+}
+
+/*
+    Sieves the interval from start with sieve_candidates and hands the survivors to
+    check_prime in order. Returns true with the first prime found in p, false if there
+    is none.
+*/
+bool sieve_interval(mpz_t p, const mpz_t start, const mpz_t limit, uint64_t iters,
+    gmp_randstate_t rs, nt_workspace *w) {
+    uint32_t offsets[PRIME_SIEVE_WIDTH];
+    size_t count = sieve_candidates(offsets, start, limit);
+    for (size_t i = 0; i < count; i++) {
+        mpz_add_ui(p, start, 2 * (uint64_t) offsets[i]); //p = start + 2j
+        if (check_prime(p, iters, rs, w)) {
+            return true;
+        }
+    }
+    return false;
 }
 
 /*
     Puts a random prime *bits* bits long into *p* using *iters* number of iterations to 
-    check for primality using the Miller-Rabin test.
+    check for primality using the Miller-Rabin test, or the BPSW test if iters is PRIME_BPSW.
+    Large sizes pick one random odd start point and sieve consecutive intervals from it,
+    so Miller-Rabin only runs on candidates with no small factor. The search starts over
+    from a new random point when it runs past 2^(bits + 1).
+    Every candidate is tested on one workspace.
 */
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
     mpz_t temp;
@@ -239,10 +919,40 @@ void make_prime(mpz_t p, uint64_t bits, uint64_t iters) {
     //temp = 2^bits;
     mpz_ui_pow_ui(temp, 2, bits);
 
-    do {
-        mpz_urandomb(p, state, bits);
-        mpz_add(p, p, temp);
-    } while (!is_prime(p, iters));
-    mpz_clear(temp);
+    nt_workspace w;
+    nt_workspace_init(&w, bits + 1);
+
+    if (bits < SIEVE_MIN_BITS) {
+        do {
+            mpz_urandomb(p, state, bits);
+            mpz_add(p, p, temp);
+        } while (!check_prime(p, iters, state, &w));
+        nt_workspace_clear(&w);
+        mpz_clear(temp);
+        return;
+    }
+
+    pthread_once(&small_primes_once, build_small_primes);
+
+    mpz_t start, limit;
+    mpz_inits(start, limit, NULL);
+    mpz_mul_2exp(limit, temp, 1); //limit = 2^(bits + 1)
+
+    bool found = false;
+    while (!found) {
+        mpz_urandomb(start, state, bits);
+        mpz_add(start, start, temp); //start = 2^bits + random
+        mpz_setbit(start, 0); //Make start odd
+
+        while (!found && mpz_cmp(start, limit) < 0) {
+            uint64_t span = trace_begin();
+            found = sieve_interval(p, start, limit, iters, state, &w);
+            trace_span("sieve_interval", span, "bits", bits);
+            mpz_add_ui(start, start, 2 * PRIME_SIEVE_WIDTH); //Next interval
+        }
+    }
+
+    nt_workspace_clear(&w);
+    mpz_clears(start, limit, temp, NULL);
     return;
 }
@@ -11,6 +11,175 @@ void mod_inverse(mpz_t o, const mpz_t a, const mpz_t n);
 
 void pow_mod(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n);
 
+//
+// Sliding window recoding of an exponent d, read from the most significant bit:
+// result = table[digit[0]], then for each following digit square shift[i] times
+// and multiply by table[digit[i]], then square tail more times.
+// table[i] holds base^(2i + 1).
+//
+typedef struct {
+    uint32_t window;
+    size_t count;
+    uint32_t *shift;
+    uint32_t *digit;
+    uint32_t tail;
+} exp_recoding;
+
+typedef struct mont_modulus mont_modulus;
+
+//
+// Exponentiation loop compiled for one modulus size (see montfixed.h): rp = ap^d % n
+// for ap < n, with table room for the odd powers of r's window.
+//
+typedef void (*mont_fixed_pow)(mp_limb_t *rp, const mp_limb_t *ap, const mont_modulus *m,
+    const exp_recoding *r, mp_limb_t *table);
+
+//
+// Montgomery constants for an odd modulus n > 1. Every residue x is kept as
+// x*R % n with R = 2^(64*size), so a modular product needs one REDC and no division.
+//
+struct mont_modulus {
+    mp_size_t size; //Limbs in the modulus
+    mp_limb_t minv; //-n^-1 % 2^64
+    mp_limb_t *mod; //n as size limbs
+    mp_limb_t *r2; //R^2 % n, converts into Montgomery form
+    mpz_t mod_z; //n, for reducing out of range bases
+    mont_fixed_pow fixed; //Specialized kernel for size limbs, NULL to use mpn
+};
+
+//
+// Working memory for pow_mod_mont. One per thread.
+//
+typedef struct {
+    mp_size_t size; //Largest modulus in limbs
+    uint32_t window; //Largest window
+    mp_limb_t *limbs;
+    mpz_t base;
+} mont_scratch;
+
+//
+// Temporaries for the _ws variants of the numtheory routines, so a loop can call them
+// without allocating. nt_workspace_init sizes everything for moduli of up to bits bits,
+// larger operands grow it once. pow_mod_ws keeps the Montgomery constants and exponent
+// recoding of its last call and reuses them while n and d stay the same.
+// Not safe for concurrent use, one per thread.
+//
+#define NT_WORKSPACE_TEMPS 8
+
+typedef struct {
+    mp_size_t size; //Largest modulus in limbs the buffers below hold
+    mpz_t temp[NT_WORKSPACE_TEMPS];
+    mpz_t pow[3]; //pow_mod_ws only, so it can run under the other routines
+    mont_modulus mont;
+    bool mont_valid;
+    exp_recoding exp;
+    size_t exp_bits; //Largest exponent in bits exp holds
+    mpz_t exp_d; //Exponent exp is the recoding of
+    bool exp_valid;
+    mont_scratch scratch;
+} nt_workspace;
+
+void nt_workspace_init(nt_workspace *w, mp_bitcnt_t bits);
+
+void nt_workspace_clear(nt_workspace *w);
+
+//
+// gcd, mod_inverse and pow_mod with their temporaries taken from w.
+//
+void gcd_ws(mpz_t g, const mpz_t a, const mpz_t b, nt_workspace *w);
+
+void mod_inverse_ws(mpz_t o, const mpz_t a, const mpz_t n, nt_workspace *w);
+
+void pow_mod_ws(mpz_t o, const mpz_t a, const mpz_t d, const mpz_t n, nt_workspace *w);
+
+void mont_init(mont_modulus *m, const mpz_t n);
+
+void mont_clear(mont_modulus *m);
+
+//
+// Sets up m from constants an earlier mont_init computed (see keyfile.h) instead of
+// dividing for them again: mod and r2 hold size limbs each, minv is -mod^-1 % 2^64.
+// Returns false without setting up m if they cannot belong to an odd modulus > 1.
+// Must be cleared with mont_clear otherwise.
+//
+bool mont_load(mont_modulus *m, const mp_limb_t *mod, const mp_limb_t *r2, mp_size_t size,
+    mp_limb_t minv);
+
+void exp_recode(exp_recoding *r, const mpz_t d);
+
+//
+// Sets up r from the fields of an earlier exp_recode, copying count shifts and digits.
+// Returns false without setting up r if the window or a digit is out of range.
+// Must be cleared with exp_recoding_clear otherwise.
+//
+bool exp_recoding_load(exp_recoding *r, uint32_t window, size_t count, uint32_t tail,
+    const uint32_t *shift, const uint32_t *digit);
+
+void exp_recoding_clear(exp_recoding *r);
+
+void mont_scratch_init(mont_scratch *s, mp_size_t size, uint32_t window);
+
+void mont_scratch_clear(mont_scratch *s);
+
+//
+// o = a^d % n using precomputed Montgomery constants m for n and the recoding r of d.
+// s must be sized for at least m->size limbs and r->window.
+//
+void pow_mod_mont(mpz_t o, const mpz_t a, const mont_modulus *m, const exp_recoding *r,
+    mont_scratch *s);
+
 bool is_prime(const mpz_t n, uint64_t iters);
 
+//
+// is_prime drawing its Miller-Rabin witnesses from rs instead of the global state,
+// so threads with their own random state can test concurrently.
+//
+bool is_prime_r(const mpz_t n, uint64_t iters, gmp_randstate_t rs);
+
+//
+// is_prime_r and is_prime_bpsw with their temporaries taken from w. Every round
+// against the same n shares one set of Montgomery constants.
+//
+bool is_prime_ws(const mpz_t n, uint64_t iters, gmp_randstate_t rs, nt_workspace *w);
+
+bool is_prime_bpsw_ws(const mpz_t n, nt_workspace *w);
+
+//
+// Baillie-PSW primality test: a strong probable prime test to base 2 plus a strong
+// Lucas test. Deterministic, and no composite is known to pass it.
+//
+bool is_prime_bpsw(const mpz_t n);
+
+//
+// Passing PRIME_BPSW as iters to make_prime (or ss_make_pub) uses is_prime_bpsw
+// instead of Miller-Rabin rounds.
+//
+#define PRIME_BPSW 0
+
 void make_prime(mpz_t p, uint64_t bits, uint64_t iters);
+
+//Odd candidates covered by one sieve interval of a prime search
+#define PRIME_SIEVE_WIDTH 8192
+
+//
+// Sieves the PRIME_SIEVE_WIDTH odd candidates start + 2j below limit against the small
+// primes. Every make_prime interval is sieved this way. Candidates of up to 32 bits are
+// all listed, the small primes could be among them.
+//
+// Provides:
+//  offsets: j of every candidate no small prime divides, in increasing order
+//
+// Requires:
+//  offsets: room for PRIME_SIEVE_WIDTH entries
+//  start: odd, at least 2
+//
+// Returns the number of offsets.
+//
+size_t sieve_candidates(uint32_t *offsets, const mpz_t start, const mpz_t limit);
+
+//
+// Tests a candidate the way make_prime does: iters rounds of Miller-Rabin with witnesses
+// from rs, or BPSW if iters is PRIME_BPSW, on w's temporaries. Counted in the stats.
+// Safe to call from several threads that each own their rs and w.
+//
+bool check_prime(const mpz_t n, uint64_t iters, gmp_randstate_t rs, nt_workspace *w);
@@ -0,0 +1,216 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t lo; //Next item the owner takes from the front
+    size_t hi; //One past the last item, thieves take from the back
+} work_deque;
+
+typedef struct {
+    work_pool *pool;
+    uint32_t id;
+} worker_arg;
+
+struct work_pool {
+    uint32_t threads;
+    pthread_t *workers;
+    worker_arg *args;
+    work_deque *deques;
+
+    pthread_mutex_t lock;
+    pthread_cond_t start; //Signalled when a new generation of work is posted
+    pthread_cond_t done; //Signalled when a worker finishes the current generation
+    uint64_t generation;
+    uint32_t finished;
+    bool shutdown;
+
+    work_pool_task task;
+    void *arg;
+};
+
+bool take_own(work_deque *deque, size_t *index);
+bool steal_other(work_pool *pool, uint32_t id, size_t *index);
+void *worker_main(void *arg);
+
+/*
+    Pops the next item from the front of the worker's own deque.
+*/
+bool take_own(work_deque *deque, size_t *index) {
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->lo < deque->hi) {
+        *index = deque->lo++;
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/*
+    Steals one item from the back of another worker's deque, starting with the neighbour.
+*/
+bool steal_other(work_pool *pool, uint32_t id, size_t *index) {
+    for (uint32_t i = 1; i < pool->threads; i++) {
+        work_deque *victim = &pool->deques[(id + i) % pool->threads];
+        bool found = false;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->lo < victim->hi) {
+            *index = --victim->hi;
+            found = true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if (found) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+    Worker loop: waits for a generation of work, drains its own deque, steals until
+    every deque is empty and reports back.
+*/
+void *worker_main(void *arg) {
+    worker_arg *self = (worker_arg *) arg;
+    work_pool *pool = self->pool;
+    uint64_t seen = 0;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        while (!pool->shutdown && pool->generation == seen) {
+            pthread_cond_wait(&pool->start, &pool->lock);
+        }
+        if (pool->shutdown) {
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        seen = pool->generation;
+        work_pool_task task = pool->task;
+        void *task_arg = pool->arg;
+        pthread_mutex_unlock(&pool->lock);
+
+        size_t index;
+        while (take_own(&pool->deques[self->id], &index)
+               || steal_other(pool, self->id, &index)) {
+            task(task_arg, index, self->id);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        pool->finished++;
+        pthread_cond_signal(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+work_pool *work_pool_create(uint32_t threads) {
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    work_pool *pool = (work_pool *) calloc(1, sizeof(work_pool));
+    if (pool == NULL) {
+        return NULL;
+    }
+    pool->threads = threads;
+    pool->workers = (pthread_t *) calloc(threads, sizeof(pthread_t));
+    pool->args = (worker_arg *) calloc(threads, sizeof(worker_arg));
+    pool->deques = (work_deque *) calloc(threads, sizeof(work_deque));
+    if (pool->workers == NULL || pool->args == NULL || pool->deques == NULL) {
+        free(pool->workers);
+        free(pool->args);
+        free(pool->deques);
+        free(pool);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (uint32_t i = 0; i < threads; i++) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->args[i].pool = pool;
+        pool->args[i].id = i;
+    }
+
+    for (uint32_t i = 0; i < threads; i++) {
+        if (pthread_create(&pool->workers[i], NULL, worker_main, &pool->args[i]) != 0) {
+            pool->threads = i; //Only join the workers that started
+            work_pool_delete(&pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void work_pool_delete(work_pool **pool) {
+    if (pool == NULL || *pool == NULL) {
+        return;
+    }
+    work_pool *p = *pool;
+
+    pthread_mutex_lock(&p->lock);
+    p->shutdown = true;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    for (uint32_t i = 0; i < p->threads; i++) {
+        pthread_join(p->workers[i], NULL);
+    }
+
+    for (uint32_t i = 0; i < p->threads; i++) {
+        pthread_mutex_destroy(&p->deques[i].lock);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->start);
+    pthread_cond_destroy(&p->done);
+
+    free(p->workers);
+    free(p->args);
+    free(p->deques);
+    free(p);
+    *pool = NULL;
+    return;
+}
+
+/*
+    Splits [0, count) into contiguous slices, one per worker deque, then wakes the
+    workers and waits until each of them has run out of work.
+*/
+void work_pool_run(work_pool *pool, size_t count, work_pool_task task, void *arg) {
+    if (count == 0) {
+        return;
+    }
+
+    size_t slice = count / pool->threads;
+    size_t extra = count % pool->threads;
+    size_t start = 0;
+    for (uint32_t i = 0; i < pool->threads; i++) {
+        size_t length = slice + (i < extra ? 1 : 0);
+        pthread_mutex_lock(&pool->deques[i].lock);
+        pool->deques[i].lo = start;
+        pool->deques[i].hi = start + length;
+        pthread_mutex_unlock(&pool->deques[i].lock);
+        start += length;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->finished = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    while (pool->finished < pool->threads) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return;
+}
+
+uint32_t work_pool_threads(const work_pool *pool) {
+    return pool->threads;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct work_pool work_pool;
+
+//
+// Task run by the pool once for every index in [0, count).
+//
+// arg:    the argument passed to work_pool_run
+// index:  the index of the work item
+// worker: the id in [0, threads) of the worker running it, for per-thread scratch space
+//
+typedef void (*work_pool_task)(void *arg, size_t index, uint32_t worker);
+
+//
+// Creates a pool of worker threads. Each worker owns a deque of work items and
+// steals from the back of the other workers' deques once its own runs dry.
+//
+// threads: number of worker threads (at least 1)
+//
+// Returns NULL if the threads could not be started.
+//
+work_pool *work_pool_create(uint32_t threads);
+
+//
+// Stops and joins all workers and frees the pool. Sets *pool to NULL.
+//
+void work_pool_delete(work_pool **pool);
+
+//
+// Runs task for every index in [0, count) across the workers and blocks until
+// all of them have finished. Items may complete in any order.
+//
+// Worker w starts on the contiguous slice of count / threads indices that follows the
+// slices of the workers before it, the first count % threads slices one index longer,
+// and runs it front to back. Idle workers steal from the back of other slices.
+//
+void work_pool_run(work_pool *pool, size_t count, work_pool_task task, void *arg);
+
+//
+// Returns the number of worker threads in the pool.
+//
+uint32_t work_pool_threads(const work_pool *pool);
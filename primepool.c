@@ -0,0 +1,258 @@
+#include "primepool.h"
+#include "numtheory.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+//Entries a pool is read into at first, it doubles when full
+#define POOL_INITIAL_ENTRIES 64
+
+typedef struct {
+    uint64_t bits;
+    mpz_t prime;
+    bool removed; //Taken, a duplicate of a taken prime, or failed its check
+} pool_entry;
+
+typedef struct {
+    pool_entry *entries;
+    size_t count;
+    size_t capacity;
+    bool changed; //Lines were dropped while reading
+} pool_entries;
+
+//Helper functions not in header file
+FILE *open_pool(const char *path, int flags);
+bool read_pool(FILE *file, pool_entries *pool);
+void clear_pool(pool_entries *pool);
+bool write_pool(FILE *file, const pool_entries *pool);
+pool_entry *find_prime(
+    pool_entries *pool, uint64_t bits, const pool_entry *skip, const pool_entry *after);
+bool usable_pair(const mpz_t p, const mpz_t q);
+void remove_prime(pool_entries *pool, const pool_entry *entry);
+
+/*
+    Opens the pool at path with flags, created readable by its owner only, and waits
+    for an exclusive lock on it. Returns NULL if it cannot be opened.
+*/
+FILE *open_pool(const char *path, int flags) {
+    int fd = open(path, flags, S_IRUSR | S_IWUSR);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (flags & O_CREAT) {
+        fchmod(fd, S_IRUSR | S_IWUSR); //Also for a pool created by hand
+    }
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return NULL;
+        }
+    }
+    const char *mode = (flags & O_APPEND) ? "a" : ((flags & O_RDWR) ? "r+" : "r");
+    FILE *file = fdopen(fd, mode);
+    if (file == NULL) {
+        close(fd); //Also releases the lock
+    }
+    return file;
+}
+
+/*
+    Reads every entry of the pool. Returns false if out of memory.
+*/
+bool read_pool(FILE *file, pool_entries *pool) {
+    *pool = (pool_entries) { 0 };
+    char *line = NULL;
+    size_t line_size = 0;
+    bool ok = true;
+    while (ok && getline(&line, &line_size, file) != -1) {
+        char *hex = strchr(line, ' ');
+        if (hex == NULL) {
+            pool->changed = true;
+            continue;
+        }
+        *hex++ = '\0';
+        hex[strcspn(hex, "\r\n")] = '\0';
+
+        if (pool->count == pool->capacity) {
+            size_t grown = pool->capacity == 0 ? POOL_INITIAL_ENTRIES : 2 * pool->capacity;
+            pool_entry *entries = (pool_entry *) realloc(pool->entries, grown * sizeof(pool_entry));
+            if (entries == NULL) {
+                ok = false;
+                break;
+            }
+            pool->entries = entries;
+            pool->capacity = grown;
+        }
+        pool_entry *entry = &pool->entries[pool->count];
+        char *end = NULL;
+        entry->bits = strtoull(line, &end, 10);
+        entry->removed = false;
+        mpz_init(entry->prime);
+        if (end == line || *end != '\0' || mpz_set_str(entry->prime, hex, 16) != 0) {
+            mpz_clear(entry->prime);
+            pool->changed = true;
+            continue;
+        }
+        pool->count++;
+    }
+    free(line);
+    return ok;
+}
+
+void clear_pool(pool_entries *pool) {
+    for (size_t i = 0; i < pool->count; i++) {
+        mpz_clear(pool->entries[i].prime);
+    }
+    free(pool->entries);
+    *pool = (pool_entries) { 0 };
+    return;
+}
+
+/*
+    Replaces the pool's contents with the entries that were not removed.
+*/
+bool write_pool(FILE *file, const pool_entries *pool) {
+    rewind(file);
+    for (size_t i = 0; i < pool->count; i++) {
+        if (!pool->entries[i].removed) {
+            gmp_fprintf(file, "%" PRIu64 " %Zx\n", pool->entries[i].bits, pool->entries[i].prime);
+        }
+    }
+    if (fflush(file) != 0) {
+        return false;
+    }
+    return ftruncate(fileno(file), ftell(file)) == 0 && fsync(fileno(file)) == 0;
+}
+
+/*
+    Returns the oldest entry of bits after the entry after (from the start if NULL) that
+    is not skip and passes its checks, removing the ones that fail on the way. NULL if
+    there is none.
+*/
+pool_entry *find_prime(
+    pool_entries *pool, uint64_t bits, const pool_entry *skip, const pool_entry *after) {
+    for (size_t i = after == NULL ? 0 : (size_t) (after - pool->entries) + 1; i < pool->count;
+         i++) {
+        pool_entry *entry = &pool->entries[i];
+        if (entry->removed || entry->bits != bits || entry == skip) {
+            continue;
+        }
+        if (mpz_sizeinbase(entry->prime, 2) != bits + 1 || !is_prime_bpsw(entry->prime)) {
+            entry->removed = true;
+            continue;
+        }
+        return entry;
+    }
+    return NULL;
+}
+
+/*
+    The condition ss_make_pub retries q on: p mod (q-1) and q mod (p-1) must not be 0.
+*/
+bool usable_pair(const mpz_t p, const mpz_t q) {
+    mpz_t temp, mod;
+    mpz_inits(temp, mod, NULL);
+    mpz_sub_ui(temp, q, 1);
+    mpz_mod(mod, p, temp);
+    bool usable = mpz_cmp_ui(mod, 0) != 0;
+    mpz_sub_ui(temp, p, 1);
+    mpz_mod(mod, q, temp);
+    usable = usable && mpz_cmp_ui(mod, 0) != 0;
+    mpz_clears(temp, mod, NULL);
+    return usable;
+}
+
+/*
+    Removes entry and every other copy of its prime, in case two fills produced the same
+    primes from the same seed.
+*/
+void remove_prime(pool_entries *pool, const pool_entry *entry) {
+    for (size_t i = 0; i < pool->count; i++) {
+        if (pool->entries[i].bits == entry->bits
+            && mpz_cmp(pool->entries[i].prime, entry->prime) == 0) {
+            pool->entries[i].removed = true;
+        }
+    }
+    return;
+}
+
+bool prime_pool_add(
+    const char *path, uint64_t pbits, const mpz_t p, uint64_t qbits, const mpz_t q) {
+    FILE *file = open_pool(path, O_WRONLY | O_APPEND | O_CREAT);
+    if (file == NULL) {
+        printf("%s: %s\n", path, strerror(errno));
+        return false;
+    }
+    gmp_fprintf(file, "%" PRIu64 " %Zx\n%" PRIu64 " %Zx\n", pbits, p, qbits, q);
+    bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    fclose(file);
+    if (!ok) {
+        printf("%s: Error writing the prime pool\n", path);
+    }
+    return ok;
+}
+
+bool prime_pool_take(const char *path, uint64_t nbits, mpz_t p, mpz_t q) {
+    FILE *file = open_pool(path, O_RDWR);
+    if (file == NULL) {
+        return false; //No pool yet
+    }
+    pool_entries pool;
+    pool_entry *pe = NULL;
+    pool_entry *qe = NULL;
+    bool taken = false;
+    if (read_pool(file, &pool) && nbits >= 5) {
+        uint64_t range = nbits / 5;
+        uint64_t first = (uint64_t) random() % range;
+        for (uint64_t i = 0; qe == NULL && i < range; i++) {
+            uint64_t pbits = (first + i) % range + range; //[nbits/5, 2*nbits/5)
+            uint64_t qbits = nbits - 2 * pbits;
+            pe = find_prime(&pool, pbits, NULL, NULL);
+            qe = pe == NULL ? NULL : find_prime(&pool, qbits, pe, NULL);
+            while (qe != NULL && !usable_pair(pe->prime, qe->prime)) {
+                qe = find_prime(&pool, qbits, pe, qe); //Another q may still suit this p
+            }
+        }
+        if (qe != NULL) {
+            remove_prime(&pool, pe);
+            remove_prime(&pool, qe);
+            taken = true;
+        }
+
+        bool removed = pool.changed;
+        for (size_t i = 0; i < pool.count; i++) {
+            removed = removed || pool.entries[i].removed;
+        }
+        if (removed && !write_pool(file, &pool)) {
+            printf("%s: Error writing the prime pool\n", path);
+            taken = false; //The primes may still be in the file
+        }
+        if (taken) {
+            mpz_set(p, pe->prime);
+            mpz_set(q, qe->prime);
+        }
+    }
+    clear_pool(&pool);
+    fclose(file);
+    return taken;
+}
+
+uint64_t prime_pool_count(const char *path) {
+    FILE *file = open_pool(path, O_RDONLY);
+    if (file == NULL) {
+        return 0;
+    }
+    uint64_t count = 0;
+    int c;
+    while ((c = fgetc(file)) != EOF) {
+        count += c == '\n' ? 1 : 0;
+    }
+    fclose(file);
+    return count;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <gmp.h>
+
+//
+// Pool of primes generated ahead of time by keygen --fill-pool, so keygen -P can make
+// a key without searching for primes. Primes are secret key material: the file is
+// created readable by its owner only and every prime is removed when it is taken, so
+// no two keys share one.
+//
+// Layout: one text line per prime, its size and the prime in hex, separated by a space.
+// The size is the bits argument of make_prime, the prime has bits + 1 bits, so pairs
+// are matched against the pbits and qbits ss_make_pub picks. Lines that do not parse
+// are dropped the next time primes are taken.
+//
+// Every access holds an exclusive flock on the file, so keygen runs and fills may run
+// at the same time.
+//
+
+#define PRIME_POOL_DEFAULT "ss.pool"
+
+//
+// Appends p and q, sizes pbits and qbits, to the pool at path, creating it if needed.
+//
+// Returns false, with an error printed, if the pool cannot be opened or written.
+//
+bool prime_pool_add(const char *path, uint64_t pbits, const mpz_t p, uint64_t qbits, const mpz_t q);
+
+//
+// Takes a pair for an nbits key out of the pool at path, under the constraints of
+// ss_make_pub: pbits in [nbits/5, 2*nbits/5), qbits = nbits - 2*pbits, and neither
+// p mod (q-1) nor q mod (p-1) is 0. The first pbits tried is random like ss_make_pub's,
+// the others follow in order. Both primes are checked with the Baillie-PSW test before
+// they are used, entries that fail are dropped.
+//
+// Provides:
+//  p, q: the primes, unchanged if none were taken
+//
+// Returns false if the pool is missing or holds no pair for nbits, the caller then
+// generates the key as usual.
+//
+bool prime_pool_take(const char *path, uint64_t nbits, mpz_t p, mpz_t q);
+
+//
+// Returns the number of primes in the pool at path, 0 if there is none.
+//
+uint64_t prime_pool_count(const char *path);
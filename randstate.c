@@ -1,5 +1,7 @@
 #include "randstate.h"
 
+uint64_t splitmix64(uint64_t x);
+
 void randstate_init(uint64_t seed) {
     gmp_randinit_mt(state);
     gmp_randseed_ui(state, seed);
@@ -10,3 +12,23 @@ void randstate_clear(void) {
     gmp_randclear(state);
     return;
 }
+
+/*
+    SplitMix64 finalizer, scatters nearby seeds and stream ids across the whole 64-bit range.
+*/
+uint64_t splitmix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+void randstate_init_stream(gmp_randstate_t rs, uint64_t seed, uint64_t stream) {
+    mpz_t stream_seed;
+    mpz_init(stream_seed);
+    mpz_set_ui(stream_seed, (unsigned long) splitmix64(seed ^ splitmix64(stream)));
+    gmp_randinit_mt(rs);
+    gmp_randseed(rs, stream_seed);
+    mpz_clear(stream_seed);
+    return;
+}
@@ -19,3 +19,10 @@ void randstate_init(uint64_t seed);
 // Must be called after all key generation or number theory operations are used.
 //
 void randstate_clear(void);
+
+//
+// Initializes rs as an independent random stream derived from seed and a stream id.
+// The same seed and stream always give the same sequence. Used by threads that cannot
+// share the global state. Must be freed with gmp_randclear.
+//
+void randstate_init_stream(gmp_randstate_t rs, uint64_t seed, uint64_t stream);
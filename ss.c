@@ -1,14 +1,164 @@
 #include "ss.h"
 #include "numtheory.h"
 #include "randstate.h"
+#include "pool.h"
+#include "container.h"
+#include "aead.h"
+#include "stats.h"
+#include "trace.h"
+#include "primepool.h"
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <time.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 void get_n_from_p_q(mpz_t n, const mpz_t p, const mpz_t q);
-void lcm(mpz_t o, const mpz_t a, const mpz_t b);
+void lcm(mpz_t o, const mpz_t a, const mpz_t b, nt_workspace *w);
 void get_k(size_t *k, const mpz_t var);
+bool write_decrypted_block(FILE *outfile, const mpz_t m, uint8_t *read_contents, size_t k,
+    uint64_t index, uint64_t *bytes);
+
+//Blocks buffered per worker thread for each batch of a file operation
+#define SS_BATCH_PER_THREAD 64
+
+//Per-thread working memory of a key context
+struct ss_scratch {
+    mont_scratch mont;
+    mpz_t mp, mq, temp;
+    mont_batch_scratch batch;
+    mpz_t lane_p[MONT_BATCH_MAX_LANES], lane_q[MONT_BATCH_MAX_LANES]; //CRT halves of a group
+};
+
+//Key context shared by every block of a file operation. The unused context is NULL.
+//Each task handles a group of up to lanes consecutive blocks.
+typedef struct {
+    mpz_t *blocks;
+    size_t count;
+    uint64_t base; //Index of blocks[0] in the file, for the trace
+    uint32_t lanes;
+    ss_pub_ctx *pub;
+    ss_priv_ctx *priv;
+} block_job;
+
+void reserve_scratch(
+    ss_scratch **scratch, uint32_t *count, uint32_t want, mp_size_t size, uint32_t window);
+void clear_scratch(ss_scratch *scratch, uint32_t count);
+void encrypt_with(mpz_t c, const mpz_t m, ss_pub_ctx *ctx, uint32_t worker);
+void decrypt_with(mpz_t m, const mpz_t c, ss_priv_ctx *ctx, uint32_t worker);
+void crt_combine(mpz_t m, const mpz_t mp, const mpz_t mq, const ss_priv_ctx *ctx, mpz_t temp);
+uint32_t select_pub_batch(ss_pub_ctx *ctx, const ss_file_opts *opts);
+uint32_t select_priv_batch(ss_priv_ctx *ctx, const ss_file_opts *opts);
+uint32_t get_worker_count(const work_pool *pool);
+
+work_pool *create_block_pool(const ss_file_opts *opts);
+size_t get_batch_size(const work_pool *pool);
+mpz_t *create_blocks(size_t count);
+void delete_blocks(mpz_t *blocks, size_t count);
+void run_blocks(work_pool *pool, size_t count, work_pool_task task, block_job *job);
+void encrypt_block_task(void *arg, size_t index, uint32_t worker);
+void decrypt_block_task(void *arg, size_t index, uint32_t worker);
+
+//Plaintext read by ss_encrypt_file. Regular files are mapped and blocks are imported
+//straight from the mapping; everything else (pipes, terminals) goes through buffer.
+typedef struct {
+    FILE *file;
+    uint8_t *map; //NULL when reading through buffer
+    size_t map_size;
+    size_t pos; //Offset of the next unread byte in map
+    uint8_t *buffer;
+} block_source;
+
+void open_block_source(block_source *src, FILE *infile, size_t k);
+void close_block_source(block_source *src);
+size_t read_blocks(
+    block_source *src, mpz_t *blocks, size_t batch, size_t k, uint64_t base, uint64_t *bytes);
+
+//Plaintext bytes per hybrid chunk, and chunks buffered per worker thread for each batch
+#define SS_HYBRID_CHUNK             (1u << 16)
+#define SS_HYBRID_CHUNKS_PER_THREAD 4
+
+//A batch of hybrid chunks sealed or opened in place. Chunk i of the batch sits at
+//data + i * (chunk + AEAD_TAG_SIZE) as lengths[i] bytes of data followed by its tag.
+typedef struct {
+    uint8_t *data;
+    size_t *lengths;
+    size_t count;
+    uint64_t first; //Index of the batch's first chunk in the file
+    bool ends; //The batch's last chunk is the last chunk of the file
+    uint32_t chunk;
+    const uint8_t *key;
+    const uint8_t *aad;
+    size_t aad_len;
+    _Atomic bool failed; //Set by open_chunk_task if a tag does not match
+} chunk_job;
+
+void encrypt_hybrid(FILE *infile, FILE *outfile, ss_pub_ctx *ctx, const ss_file_opts *opts);
+bool decrypt_hybrid(FILE *infile, FILE *outfile, ss_priv_ctx *ctx,
+    const container_header *header, const ss_file_opts *opts);
+bool decrypt_range(FILE *infile, FILE *outfile, ss_priv_ctx *ctx,
+    const container_header *header, const ss_file_opts *opts);
+bool write_block_slice(FILE *outfile, const mpz_t m, uint8_t *read_contents, size_t k,
+    uint64_t *skip, uint64_t *remaining, uint64_t index, uint64_t *bytes);
+bool at_eof(FILE *infile);
+void chunk_nonce(uint8_t *nonce, uint64_t index, bool last);
+void run_chunks(work_pool *pool, work_pool_task task, chunk_job *job);
+void seal_chunk_task(void *arg, size_t index, uint32_t worker);
+void open_chunk_task(void *arg, size_t index, uint32_t worker);
+
+//Files of a batch list, one per task. Each worker has its own key context, the unused
+//array is NULL.
+typedef struct {
+    const batch_list *list;
+    ss_pub_ctx *pub;
+    ss_priv_ctx *priv;
+    ss_file_opts opts; //Every file runs on the thread of its task
+    _Atomic size_t failed;
+} file_job;
+
+bool open_batch_file(const batch_file *file, FILE **infile, FILE **outfile);
+void run_files(work_pool *pool, work_pool_task task, file_job *job);
+void encrypt_file_task(void *arg, size_t index, uint32_t worker);
+void decrypt_file_task(void *arg, size_t index, uint32_t worker);
+
+//Random stream of ss_make_pub_threaded that picks the bit split between p and q
+#define KEYGEN_STREAM_PARAMS UINT64_MAX
+
+//One prime searched for by several workers. Each interval is sieved once from the
+//search's own random stream and its survivors are dealt round robin, survivor i to
+//worker i % workers. The lowest survivor that passes wins.
+typedef struct {
+    uint64_t bits;
+    uint64_t iters;
+    uint32_t workers;
+    gmp_randstate_t rs; //Start points of the intervals
+    gmp_randstate_t *worker_rs; //Miller-Rabin witnesses, one stream per worker
+    nt_workspace *ws;
+    mpz_t start;
+    mpz_t limit;
+    uint32_t *offsets; //Survivors of the current interval
+    size_t count;
+    bool started;
+    bool found;
+    _Atomic size_t best; //Lowest survivor that passed so far, count if none did
+    mpz_t result;
+} prime_search;
+
+typedef struct {
+    prime_search *searches[2];
+    uint32_t count;
+} keygen_job;
+
+void prime_search_init(prime_search *search, uint64_t bits, uint64_t iters, uint64_t seed,
+    uint64_t stream, uint32_t workers);
+void prime_search_clear(prime_search *search);
+void next_interval(prime_search *search);
+void prime_search_task(void *arg, size_t index, uint32_t worker);
+void find_primes(work_pool *pool, prime_search **searches, uint32_t count);
 
 gmp_randstate_t state;
 
@@ -44,6 +194,201 @@ void ss_make_pub(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters) {
     return;
 }
 
+/*
+    Stream stream draws the start points, streams stream + 1 + w the witnesses of worker w.
+*/
+void prime_search_init(prime_search *search, uint64_t bits, uint64_t iters, uint64_t seed,
+    uint64_t stream, uint32_t workers) {
+    search->bits = bits;
+    search->iters = iters;
+    search->workers = workers;
+    randstate_init_stream(search->rs, seed, stream);
+    search->worker_rs = (gmp_randstate_t *) calloc(workers, sizeof(gmp_randstate_t));
+    search->ws = (nt_workspace *) calloc(workers, sizeof(nt_workspace));
+    for (uint32_t w = 0; w < workers; w++) {
+        randstate_init_stream(search->worker_rs[w], seed, stream + 1 + w);
+        nt_workspace_init(&search->ws[w], bits + 1);
+    }
+    mpz_inits(search->start, search->limit, search->result, NULL);
+    mpz_setbit(search->limit, bits + 1); //limit = 2^(bits + 1)
+    search->offsets = (uint32_t *) calloc(PRIME_SIEVE_WIDTH, sizeof(uint32_t));
+    search->count = 0;
+    search->started = false;
+    search->found = false;
+    atomic_init(&search->best, 0);
+    return;
+}
+
+void prime_search_clear(prime_search *search) {
+    gmp_randclear(search->rs);
+    for (uint32_t w = 0; w < search->workers; w++) {
+        gmp_randclear(search->worker_rs[w]);
+        nt_workspace_clear(&search->ws[w]);
+    }
+    free(search->worker_rs);
+    free(search->ws);
+    free(search->offsets);
+    mpz_clears(search->start, search->limit, search->result, NULL);
+    return;
+}
+
+/*
+    Sieves the interval after the current one, like make_prime, or one from a new random
+    start point at first and once the search runs past 2^(bits + 1).
+*/
+void next_interval(prime_search *search) {
+    if (search->started) {
+        mpz_add_ui(search->start, search->start, 2 * PRIME_SIEVE_WIDTH);
+    }
+    if (!search->started || mpz_cmp(search->start, search->limit) >= 0) {
+        mpz_urandomb(search->start, search->rs, search->bits);
+        mpz_setbit(search->start, search->bits); //start = 2^bits + random
+        mpz_setbit(search->start, 0); //Make start odd
+        search->started = true;
+    }
+    uint64_t span = trace_begin();
+    search->count = sieve_candidates(search->offsets, search->start, search->limit);
+    trace_span("sieve_interval", span, "bits", search->bits);
+    atomic_store(&search->best, search->count);
+    return;
+}
+
+/*
+    Worker w of a search tests survivors w, w + workers, w + 2 * workers, ... of the
+    current interval until one passes or a lower survivor already has. Every survivor
+    below the winner is tested to the end, so the winner is the lowest survivor that
+    passes whatever the thread timing.
+*/
+void prime_search_task(void *arg, size_t index, uint32_t worker) {
+    (void) worker;
+    keygen_job *job = (keygen_job *) arg;
+    prime_search *search = job->searches[index % job->count];
+    uint32_t w = (uint32_t) (index / job->count);
+
+    mpz_t candidate;
+    mpz_init(candidate);
+    for (size_t i = w; i < atomic_load(&search->best); i += search->workers) {
+        mpz_add_ui(candidate, search->start, 2 * (uint64_t) search->offsets[i]);
+        if (check_prime(candidate, search->iters, search->worker_rs[w], &search->ws[w])) {
+            size_t best = atomic_load(&search->best);
+            while (i < best && !atomic_compare_exchange_weak(&search->best, &best, i)) {
+            }
+            break;
+        }
+    }
+    mpz_clear(candidate);
+    return;
+}
+
+/*
+    Runs the searches that have not found their prime yet one interval at a time, all
+    of them on the pool together, until every search has found one.
+*/
+void find_primes(work_pool *pool, prime_search **searches, uint32_t count) {
+    while (true) {
+        keygen_job job = { .count = 0 };
+        for (uint32_t i = 0; i < count; i++) {
+            if (!searches[i]->found) {
+                next_interval(searches[i]);
+                job.searches[job.count++] = searches[i];
+            }
+        }
+        if (job.count == 0) {
+            return;
+        }
+
+        //Every search has the same number of workers
+        size_t tasks = (size_t) job.count * job.searches[0]->workers;
+        if (pool == NULL) {
+            for (size_t i = 0; i < tasks; i++) {
+                prime_search_task(&job, i, 0);
+            }
+        } else {
+            work_pool_run(pool, tasks, prime_search_task, &job);
+        }
+
+        for (uint32_t i = 0; i < job.count; i++) {
+            prime_search *search = job.searches[i];
+            size_t best = atomic_load(&search->best);
+            if (best < search->count) {
+                mpz_add_ui(search->result, search->start, 2 * (uint64_t) search->offsets[best]);
+                search->found = true;
+            }
+        }
+    }
+}
+
+/*
+    Makes public key like ss_make_pub, but sieves for p and q at the same time and has
+    threads workers test the survivors of each interval. The start points and the bit
+    split come from random streams derived from seed instead of random(), so a given
+    seed and thread count always produce the same key.
+*/
+void ss_make_pub_threaded(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters,
+    uint32_t threads, uint64_t seed) {
+    if (threads == 0) {
+        threads = 1;
+    }
+
+    gmp_randstate_t params;
+    randstate_init_stream(params, seed, KEYGEN_STREAM_PARAMS);
+    uint64_t pbits = gmp_urandomm_ui(params, nbits / 5) + (nbits / 5); //[nbits/5, 2*nbits/5]
+    uint64_t qbits = nbits - (2 * pbits);
+    gmp_randclear(params);
+
+    work_pool *pool = threads > 1 ? work_pool_create(threads) : NULL;
+
+    //Stream ids: bit 32 picks the prime, bits 33 and up count reruns of the q search
+    prime_search p_search, q_search;
+    prime_search_init(&p_search, pbits, iters, seed, 0, threads);
+    prime_search_init(&q_search, qbits, iters, seed, (uint64_t) 1 << 32, threads);
+    prime_search *searches[2] = { &p_search, &q_search };
+    find_primes(pool, searches, 2);
+    mpz_set(p, p_search.result);
+
+    mpz_t temp_p, temp_q, mod_p, mod_q;
+    mpz_inits(temp_p, temp_q, mod_p, mod_q, NULL);
+    mpz_sub_ui(temp_p, p, 1);
+
+    for (uint64_t round = 1;; round++) {
+        mpz_set(q, q_search.result);
+        mpz_sub_ui(temp_q, q, 1);
+        mpz_mod(mod_p, p, temp_q);
+        mpz_mod(mod_q, q, temp_p);
+        if (mpz_cmp_ui(mod_p, 0) != 0 && mpz_cmp_ui(mod_q, 0) != 0) {
+            break;
+        }
+
+        //Rerun only the q search on a fresh set of streams
+        prime_search_clear(&q_search);
+        prime_search_init(
+            &q_search, qbits, iters, seed, (round << 33) | ((uint64_t) 1 << 32), threads);
+        find_primes(pool, searches + 1, 1);
+    }
+
+    get_n_from_p_q(n, p, q);
+
+    mpz_clears(temp_p, temp_q, mod_p, mod_q, NULL);
+    prime_search_clear(&p_search);
+    prime_search_clear(&q_search);
+    work_pool_delete(&pool);
+    return;
+}
+
+bool ss_make_pub_pooled(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters,
+    uint32_t threads, uint64_t seed, const char *pool) {
+    if (prime_pool_take(pool, nbits, p, q)) {
+        get_n_from_p_q(n, p, q);
+        return true;
+    }
+    if (threads > 0) {
+        ss_make_pub_threaded(p, q, n, nbits, iters, threads, seed);
+    } else {
+        ss_make_pub(p, q, n, nbits, iters);
+    }
+    return false;
+}
+
 /*
     Sets n from p and q
     n = p*p*q
@@ -85,6 +430,8 @@ void ss_read_pub(mpz_t n, char username[], FILE *pbfile) {
 void ss_make_priv(mpz_t d, mpz_t pq, const mpz_t p, const mpz_t q) {
     mpz_t n, temp_p, temp_q, lambda;
     mpz_inits(n, temp_p, temp_q, lambda, NULL);
+    nt_workspace w;
+    nt_workspace_init(&w, mpz_sizeinbase(p, 2) + mpz_sizeinbase(q, 2));
 
     mpz_mul(temp_p, p, p); //temp_p = p*p
     mpz_mul(n, temp_p, q); //n = q * (p * p)
@@ -92,25 +439,47 @@ void ss_make_priv(mpz_t d, mpz_t pq, const mpz_t p, const mpz_t q) {
     mpz_sub_ui(temp_q, q, 1); //temp_q = q - 1
 
     mpz_mul(pq, p, q); //pq = p * q
-    lcm(lambda, temp_p, temp_q); //lambda = lcm(p-1, q-1)
+    lcm(lambda, temp_p, temp_q, &w); //lambda = lcm(p-1, q-1)
 
-    mod_inverse(d, n, lambda);
+    mod_inverse_ws(d, n, lambda, &w);
 
+    nt_workspace_clear(&w);
     mpz_clears(n, temp_p, temp_q, lambda, NULL);
     return;
 }
 
 /*
-    Calculate the lowest common multiple of a and b
-    o = lcm(a,b)
+    Makes CRT private key components from d, p and q:
+     - dp = d mod (p - 1)
+     - dq = d mod (q - 1)
+     - qinv = q^-1 mod p
 */
-void lcm(mpz_t o, const mpz_t a, const mpz_t b) {
+void ss_make_priv_crt(mpz_t dp, mpz_t dq, mpz_t qinv, const mpz_t d, const mpz_t p, const mpz_t q) {
     mpz_t temp;
     mpz_init(temp);
+
+    mpz_sub_ui(temp, p, 1); //temp = p - 1
+    mpz_mod(dp, d, temp); //dp = d % (p - 1)
+
+    mpz_sub_ui(temp, q, 1); //temp = q - 1
+    mpz_mod(dq, d, temp); //dq = d % (q - 1)
+
+    mpz_mod(temp, q, p); //temp = q % p
+    mod_inverse(qinv, temp, p); //qinv = q^-1 % p
+
+    mpz_clear(temp);
+    return;
+}
+
+/*
+    Calculate the lowest common multiple of a and b
+    o = lcm(a,b)
+*/
+void lcm(mpz_t o, const mpz_t a, const mpz_t b, nt_workspace *w) {
+    mpz_ptr temp = w->temp[NT_WORKSPACE_TEMPS - 1]; //gcd_ws leaves the last temporary alone
     mpz_mul(o, a, b); //o = a*b
-    gcd(temp, a, b); //temp = gcd(a, b)
+    gcd_ws(temp, a, b, w); //temp = gcd(a, b)
     mpz_fdiv_q(o, o, temp); //o = o/temp = (a*b)/gcd(a,b)
-    mpz_clear(temp);
     return;
 }
 
@@ -125,6 +494,25 @@ void ss_write_priv(const mpz_t pq, const mpz_t d, FILE *pvfile) {
     return;
 }
 
+/*
+    Writes pq, d and then the CRT components p, q, dp, dq, qinv to pvfile
+*/
+void ss_write_priv_crt(const mpz_t pq, const mpz_t d, const mpz_t p, const mpz_t q,
+    const mpz_t dp, const mpz_t dq, const mpz_t qinv, FILE *pvfile) {
+    ss_write_priv(pq, d, pvfile);
+    mpz_out_str(pvfile, 16, p);
+    fputc('\n', pvfile);
+    mpz_out_str(pvfile, 16, q);
+    fputc('\n', pvfile);
+    mpz_out_str(pvfile, 16, dp);
+    fputc('\n', pvfile);
+    mpz_out_str(pvfile, 16, dq);
+    fputc('\n', pvfile);
+    mpz_out_str(pvfile, 16, qinv);
+    fputc('\n', pvfile);
+    return;
+}
+
 /*
     Reads and places pq and d into pvfile
 */
@@ -135,6 +523,225 @@ void ss_read_priv(mpz_t pq, mpz_t d, FILE *pvfile) {
     return;
 }
 
+/*
+    Reads pq and d, then the CRT components if the file has them.
+    Returns false for old two-field keys or if the components do not match pq.
+*/
+bool ss_read_priv_crt(mpz_t pq, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    FILE *pvfile) {
+    ss_read_priv(pq, d, pvfile);
+
+    if (mpz_inp_str(p, pvfile, 16) == 0 || mpz_inp_str(q, pvfile, 16) == 0
+        || mpz_inp_str(dp, pvfile, 16) == 0 || mpz_inp_str(dq, pvfile, 16) == 0
+        || mpz_inp_str(qinv, pvfile, 16) == 0) {
+        return false; //Two-field key
+    }
+
+    mpz_t temp;
+    mpz_init(temp);
+    mpz_mul(temp, p, q); //temp = p * q
+    bool valid = mpz_cmp(temp, pq) == 0;
+    mpz_clear(temp);
+    return valid;
+}
+
+/*
+    Grows a context's per-thread scratch array to want entries sized for size limbs and window.
+*/
+void reserve_scratch(
+    ss_scratch **scratch, uint32_t *count, uint32_t want, mp_size_t size, uint32_t window) {
+    if (want <= *count) {
+        return;
+    }
+    *scratch = (ss_scratch *) realloc(*scratch, want * sizeof(ss_scratch));
+    for (uint32_t i = *count; i < want; i++) {
+        ss_scratch *s = &(*scratch)[i];
+        mont_scratch_init(&s->mont, size, window);
+        mpz_inits(s->mp, s->mq, s->temp, NULL);
+        mont_batch_scratch_init(&s->batch);
+        for (uint32_t l = 0; l < MONT_BATCH_MAX_LANES; l++) {
+            mpz_inits(s->lane_p[l], s->lane_q[l], NULL);
+        }
+    }
+    *count = want;
+    return;
+}
+
+void clear_scratch(ss_scratch *scratch, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        mont_scratch_clear(&scratch[i].mont);
+        mpz_clears(scratch[i].mp, scratch[i].mq, scratch[i].temp, NULL);
+        mont_batch_scratch_clear(&scratch[i].batch);
+        for (uint32_t l = 0; l < MONT_BATCH_MAX_LANES; l++) {
+            mpz_clears(scratch[i].lane_p[l], scratch[i].lane_q[l], NULL);
+        }
+    }
+    free(scratch);
+    return;
+}
+
+/*
+    Derives everything encryption needs from n once:
+     - k from sqrt(n), the ciphertext width from n
+     - Montgomery constants for n and the window recoding of the exponent n
+     - n laid out for the best batch engine of this CPU
+*/
+void ss_pub_ctx_init(ss_pub_ctx *ctx, const mpz_t n) {
+    mpz_init_set(ctx->n, n);
+
+    mpz_t root;
+    mpz_init(root);
+    mpz_sqrt(root, n);
+    get_k(&ctx->k, root);
+    mpz_clear(root);
+
+    ctx->width = (uint32_t) ((mpz_sizeinbase(n, 2) + 7) / 8);
+    mont_init(&ctx->mont, n);
+    exp_recode(&ctx->exp, n);
+    ss_pub_ctx_finish(ctx);
+    return;
+}
+
+/*
+    n laid out for the best batch engine of this CPU, and the scratch of the calling thread.
+*/
+void ss_pub_ctx_finish(ss_pub_ctx *ctx) {
+    mont_batch_init(&ctx->batch, ctx->n, MONT_BATCH_AUTO);
+
+    ctx->scratch = NULL;
+    ctx->scratch_count = 0;
+    reserve_scratch(&ctx->scratch, &ctx->scratch_count, 1, ctx->mont.size, ctx->exp.window);
+    return;
+}
+
+/*
+    The constants are valid, they were checked or derived when src was set up.
+*/
+void ss_pub_ctx_copy(ss_pub_ctx *dst, const ss_pub_ctx *src) {
+    mpz_init_set(dst->n, src->n);
+    dst->k = src->k;
+    dst->width = src->width;
+    mont_load(&dst->mont, src->mont.mod, src->mont.r2, src->mont.size, src->mont.minv);
+    exp_recoding_load(&dst->exp, src->exp.window, src->exp.count, src->exp.tail,
+        src->exp.shift, src->exp.digit);
+    ss_pub_ctx_finish(dst);
+    return;
+}
+
+void ss_pub_ctx_clear(ss_pub_ctx *ctx) {
+    clear_scratch(ctx->scratch, ctx->scratch_count);
+    mont_batch_clear(&ctx->batch);
+    exp_recoding_clear(&ctx->exp);
+    mont_clear(&ctx->mont);
+    mpz_clear(ctx->n);
+    return;
+}
+
+/*
+    Derives everything decryption needs from pq and d once.
+*/
+void ss_priv_ctx_init(ss_priv_ctx *ctx, const mpz_t pq, const mpz_t d) {
+    mpz_init_set(ctx->pq, pq);
+    mpz_init_set(ctx->d, d);
+    mpz_inits(ctx->p, ctx->q, ctx->dp, ctx->dq, ctx->qinv, NULL);
+    ctx->crt = false;
+    get_k(&ctx->k, pq);
+
+    mont_init(&ctx->mont_pq, pq);
+    exp_recode(&ctx->exp_d, d);
+    ss_priv_ctx_finish(ctx);
+    return;
+}
+
+/*
+    Derives everything CRT decryption needs once: Montgomery constants for p and q
+    and the recodings of dp and dq.
+*/
+void ss_priv_ctx_init_crt(ss_priv_ctx *ctx, const mpz_t pq, const mpz_t d, const mpz_t p,
+    const mpz_t q, const mpz_t dp, const mpz_t dq, const mpz_t qinv) {
+    mpz_init_set(ctx->pq, pq);
+    mpz_init_set(ctx->d, d);
+    mpz_init_set(ctx->p, p);
+    mpz_init_set(ctx->q, q);
+    mpz_init_set(ctx->dp, dp);
+    mpz_init_set(ctx->dq, dq);
+    mpz_init_set(ctx->qinv, qinv);
+    ctx->crt = true;
+    get_k(&ctx->k, pq);
+
+    mont_init(&ctx->mont_p, p);
+    mont_init(&ctx->mont_q, q);
+    exp_recode(&ctx->exp_dp, dp);
+    exp_recode(&ctx->exp_dq, dq);
+    ss_priv_ctx_finish(ctx);
+    return;
+}
+
+/*
+    The batch engines and the scratch of the calling thread: for p and q in CRT
+    contexts, for pq otherwise.
+*/
+void ss_priv_ctx_finish(ss_priv_ctx *ctx) {
+    ctx->scratch = NULL;
+    ctx->scratch_count = 0;
+    if (!ctx->crt) {
+        mont_batch_init(&ctx->batch_pq, ctx->pq, MONT_BATCH_AUTO);
+        reserve_scratch(
+            &ctx->scratch, &ctx->scratch_count, 1, ctx->mont_pq.size, ctx->exp_d.window);
+        return;
+    }
+
+    mont_batch_init(&ctx->batch_p, ctx->p, MONT_BATCH_AUTO);
+    mont_batch_init(&ctx->batch_q, ctx->q, MONT_BATCH_AUTO);
+    mp_size_t size = ctx->mont_p.size > ctx->mont_q.size ? ctx->mont_p.size : ctx->mont_q.size;
+    uint32_t window
+        = ctx->exp_dp.window > ctx->exp_dq.window ? ctx->exp_dp.window : ctx->exp_dq.window;
+    reserve_scratch(&ctx->scratch, &ctx->scratch_count, 1, size, window);
+    return;
+}
+
+void ss_priv_ctx_copy(ss_priv_ctx *dst, const ss_priv_ctx *src) {
+    mpz_init_set(dst->pq, src->pq);
+    mpz_init_set(dst->d, src->d);
+    mpz_init_set(dst->p, src->p);
+    mpz_init_set(dst->q, src->q);
+    mpz_init_set(dst->dp, src->dp);
+    mpz_init_set(dst->dq, src->dq);
+    mpz_init_set(dst->qinv, src->qinv);
+    dst->crt = src->crt;
+    dst->k = src->k;
+
+    const mont_modulus *mont[3] = { &src->mont_pq, &src->mont_p, &src->mont_q };
+    const exp_recoding *exp[3] = { &src->exp_d, &src->exp_dp, &src->exp_dq };
+    mont_modulus *mont_dst[3] = { &dst->mont_pq, &dst->mont_p, &dst->mont_q };
+    exp_recoding *exp_dst[3] = { &dst->exp_d, &dst->exp_dp, &dst->exp_dq };
+    for (int i = src->crt ? 1 : 0; i < (src->crt ? 3 : 1); i++) {
+        mont_load(mont_dst[i], mont[i]->mod, mont[i]->r2, mont[i]->size, mont[i]->minv);
+        exp_recoding_load(exp_dst[i], exp[i]->window, exp[i]->count, exp[i]->tail,
+            exp[i]->shift, exp[i]->digit);
+    }
+    ss_priv_ctx_finish(dst);
+    return;
+}
+
+void ss_priv_ctx_clear(ss_priv_ctx *ctx) {
+    clear_scratch(ctx->scratch, ctx->scratch_count);
+    if (ctx->crt) {
+        mont_clear(&ctx->mont_p);
+        mont_clear(&ctx->mont_q);
+        exp_recoding_clear(&ctx->exp_dp);
+        exp_recoding_clear(&ctx->exp_dq);
+        mont_batch_clear(&ctx->batch_p);
+        mont_batch_clear(&ctx->batch_q);
+    } else {
+        mont_clear(&ctx->mont_pq);
+        exp_recoding_clear(&ctx->exp_d);
+        mont_batch_clear(&ctx->batch_pq);
+    }
+    mpz_clears(ctx->pq, ctx->d, ctx->p, ctx->q, ctx->dp, ctx->dq, ctx->qinv, NULL);
+    return;
+}
+
 /*
     Encrypts message m with public key n using powermod, places result in c.
 */
@@ -144,38 +751,501 @@ void ss_encrypt(mpz_t c, const mpz_t m, const mpz_t n) {
 }
 
 /*
-    Encrypts contents on infile and outputs that to outfile using public key n.
-    Encrypts in blocks of size k.  
+    Encrypts m with the context's precomputed state on worker's scratch, places result in c.
 */
-void ss_encrypt_file(FILE *infile, FILE *outfile, const mpz_t n) {
-    mpz_t root, block_data, encrypted_data;
-    mpz_inits(root, block_data, encrypted_data, NULL);
+void encrypt_with(mpz_t c, const mpz_t m, ss_pub_ctx *ctx, uint32_t worker) {
+    pow_mod_mont(c, m, &ctx->mont, &ctx->exp, &ctx->scratch[worker].mont);
+    return;
+}
 
-    size_t k;
-    mpz_sqrt(root, n);
-    get_k(&k, root);
+/*
+    Encrypts message m with a public key context, places result in c.
+*/
+void ss_encrypt_ctx(mpz_t c, const mpz_t m, ss_pub_ctx *ctx) {
+    encrypt_with(c, m, ctx, 0);
+    return;
+}
 
-    uint8_t *write_contents = (uint8_t *) calloc(k, sizeof(uint8_t));
+/*
+    Encrypts contents on infile and outputs that to outfile using the public key context.
+    Encrypts in blocks of size k, a batch of blocks at a time so the blocks of a
+    batch can be exponentiated in parallel. Batches are written in block order.
+    Indexed containers get their index once the block count is known.
+*/
+void ss_encrypt_file(FILE *infile, FILE *outfile, ss_pub_ctx *ctx, const ss_file_opts *opts) {
+    if (opts != NULL && opts->format == SS_FORMAT_HYBRID) {
+        encrypt_hybrid(infile, outfile, ctx, opts);
+        return;
+    }
 
-    size_t read_bytes;
-    do {
-        write_contents[0] = 0xFF; //Prepend 0xFF byte
-        read_bytes = fread(write_contents + 1, sizeof(uint8_t), k - 1, infile);
-        if (read_bytes == 0) {
-            break; //Nothing read
+    size_t k = ctx->k;
+
+    block_source src;
+    open_block_source(&src, infile, k);
+
+    work_pool *pool = create_block_pool(opts);
+    size_t batch = get_batch_size(pool);
+    mpz_t *blocks = create_blocks(batch);
+    block_job job = { .blocks = blocks, .lanes = select_pub_batch(ctx, opts), .pub = ctx };
+    reserve_scratch(&ctx->scratch, &ctx->scratch_count, get_worker_count(pool), ctx->mont.size,
+        ctx->exp.window);
+
+    bool indexed = opts != NULL && opts->format == SS_FORMAT_INDEXED;
+    if (indexed && ftell(outfile) < 0) {
+        //The block count in the header has to be patched before the index is any use
+        fprintf(stderr, "Output is not seekable, writing it without an index.\n");
+        indexed = false;
+    }
+    bool binary = opts == NULL || opts->format == SS_FORMAT_BINARY
+                  || opts->format == SS_FORMAT_INDEXED;
+    container_header header = { .version = CONTAINER_VERSION,
+        .width = ctx->width,
+        .blocks = CONTAINER_BLOCKS_UNKNOWN,
+        .indexed = indexed };
+    uint8_t *block_buffer = NULL;
+    long header_offset = -1;
+    uint64_t total_blocks = 0;
+    uint64_t total_bytes = 0;
+    if (binary) {
+        block_buffer = (uint8_t *) calloc(header.width, sizeof(uint8_t));
+        container_write_header(outfile, &header, &header_offset);
+        stats_add(STATS_BYTES_OUT, CONTAINER_HEADER_SIZE);
+    }
+
+    size_t count = batch;
+    while (count == batch) {
+        uint64_t start = stats_now();
+        uint64_t bytes = 0;
+        count = read_blocks(&src, blocks, batch, k, total_blocks, &bytes);
+        stats_add_time(STATS_IO_NS, start);
+        total_bytes += bytes;
+
+        start = stats_now();
+        job.base = total_blocks;
+        run_blocks(pool, count, encrypt_block_task, &job);
+        stats_add_time(STATS_ARITH_NS, start);
+
+        start = stats_now();
+        uint64_t written = 0;
+        for (size_t i = 0; i < count; i++) {
+            uint64_t span = trace_begin();
+            if (binary) {
+                container_export_block(blocks[i], block_buffer, header.width);
+                trace_span("export", span, "block", total_blocks + i);
+                span = trace_begin();
+                fwrite(block_buffer, sizeof(uint8_t), header.width, outfile);
+                written += header.width;
+            } else {
+                written += mpz_out_str(outfile, 16, blocks[i]);
+                fputc('\n', outfile);
+                written++;
+            }
+            trace_span("write", span, "block", total_blocks + i);
+        }
+        stats_add_time(STATS_IO_NS, start);
+        stats_add(STATS_BYTES_OUT, written);
+        stats_add(STATS_BLOCKS, count);
+        total_blocks += count;
+    }
+
+    if (binary) {
+        bool patched = container_patch_blocks(outfile, header_offset, total_blocks);
+        free(block_buffer);
+        if (indexed) {
+            if (!patched || !container_write_index(outfile, (uint32_t) (k - 1), total_bytes)) {
+                fprintf(stderr, "Error writing the block index.\n");
+            }
+            stats_add(STATS_BYTES_OUT, CONTAINER_INDEX_TRAILER_SIZE);
+        }
+    }
+
+    delete_blocks(blocks, batch);
+    work_pool_delete(&pool);
+    close_block_source(&src);
+    return;
+}
+
+void ss_encrypt_blocks(
+    mpz_t *blocks, size_t count, ss_pub_ctx *ctx, work_pool *pool, const ss_file_opts *opts) {
+    block_job job = { .blocks = blocks, .lanes = select_pub_batch(ctx, opts), .pub = ctx };
+    reserve_scratch(&ctx->scratch, &ctx->scratch_count, get_worker_count(pool), ctx->mont.size,
+        ctx->exp.window);
+    run_blocks(pool, count, encrypt_block_task, &job);
+    return;
+}
+
+void ss_decrypt_blocks(
+    mpz_t *blocks, size_t count, ss_priv_ctx *ctx, work_pool *pool, const ss_file_opts *opts) {
+    block_job job = { .blocks = blocks, .lanes = select_priv_batch(ctx, opts), .priv = ctx };
+    reserve_scratch(&ctx->scratch, &ctx->scratch_count, get_worker_count(pool),
+        ctx->scratch[0].mont.size, ctx->scratch[0].mont.window);
+    run_blocks(pool, count, decrypt_block_task, &job);
+    return;
+}
+
+/*
+    Opens the input and output of a batch file, or reports which one failed.
+*/
+bool open_batch_file(const batch_file *file, FILE **infile, FILE **outfile) {
+    *infile = fopen(file->input, "r");
+    if (*infile == NULL) {
+        printf("%s: No such file or directory\n", file->input);
+        return false;
+    }
+    *outfile = fopen(file->output, "w");
+    if (*outfile == NULL) {
+        printf("%s: No such file or directory\n", file->output);
+        fclose(*infile);
+        return false;
+    }
+    return true;
+}
+
+/*
+    Runs task on every file of the job, on the pool if there is one.
+*/
+void run_files(work_pool *pool, work_pool_task task, file_job *job) {
+    if (pool == NULL) {
+        for (size_t i = 0; i < job->list->count; i++) {
+            task(job, i, 0);
+        }
+        return;
+    }
+    work_pool_run(pool, job->list->count, task, job);
+    return;
+}
+
+void encrypt_file_task(void *arg, size_t index, uint32_t worker) {
+    file_job *job = (file_job *) arg;
+    FILE *infile, *outfile;
+    if (!open_batch_file(&job->list->files[index], &infile, &outfile)) {
+        atomic_fetch_add(&job->failed, 1);
+        return;
+    }
+    uint64_t span = trace_begin();
+    ss_encrypt_file(infile, outfile, &job->pub[worker], &job->opts);
+    trace_span("file", span, "file", index);
+    fclose(infile);
+    fclose(outfile);
+    return;
+}
+
+void decrypt_file_task(void *arg, size_t index, uint32_t worker) {
+    file_job *job = (file_job *) arg;
+    FILE *infile, *outfile;
+    if (!open_batch_file(&job->list->files[index], &infile, &outfile)) {
+        atomic_fetch_add(&job->failed, 1);
+        return;
+    }
+    uint64_t span = trace_begin();
+    if (!ss_decrypt_file(infile, outfile, &job->priv[worker], &job->opts)) {
+        fprintf(stderr, "%s: Could not be decrypted\n", job->list->files[index].input);
+        atomic_fetch_add(&job->failed, 1);
+    }
+    trace_span("file", span, "file", index);
+    fclose(infile);
+    fclose(outfile);
+    return;
+}
+
+/*
+    The key is loaded once by the caller, every worker gets a copy of the context so
+    they never share scratch or batch engine state.
+*/
+size_t ss_encrypt_batch(const batch_list *list, ss_pub_ctx *ctx, const ss_file_opts *opts) {
+    work_pool *pool = create_block_pool(opts);
+    uint32_t workers = get_worker_count(pool);
+    file_job job = { .list = list, .opts = opts == NULL ? (ss_file_opts) { 0 } : *opts };
+    job.opts.threads = 1;
+    job.pub = (ss_pub_ctx *) calloc(workers, sizeof(ss_pub_ctx));
+    for (uint32_t w = 0; w < workers; w++) {
+        ss_pub_ctx_copy(&job.pub[w], ctx);
+    }
+
+    run_files(pool, encrypt_file_task, &job);
+
+    for (uint32_t w = 0; w < workers; w++) {
+        ss_pub_ctx_clear(&job.pub[w]);
+    }
+    free(job.pub);
+    work_pool_delete(&pool);
+    return atomic_load(&job.failed);
+}
+
+size_t ss_decrypt_batch(const batch_list *list, ss_priv_ctx *ctx, const ss_file_opts *opts) {
+    work_pool *pool = create_block_pool(opts);
+    uint32_t workers = get_worker_count(pool);
+    file_job job = { .list = list, .opts = opts == NULL ? (ss_file_opts) { 0 } : *opts };
+    job.opts.threads = 1;
+    job.priv = (ss_priv_ctx *) calloc(workers, sizeof(ss_priv_ctx));
+    for (uint32_t w = 0; w < workers; w++) {
+        ss_priv_ctx_copy(&job.priv[w], ctx);
+    }
+
+    run_files(pool, decrypt_file_task, &job);
+
+    for (uint32_t w = 0; w < workers; w++) {
+        ss_priv_ctx_clear(&job.priv[w]);
+    }
+    free(job.priv);
+    work_pool_delete(&pool);
+    return atomic_load(&job.failed);
+}
+
+/*
+    Encrypts infile into a hybrid container: a random session key is SS encrypted in
+    blocks of k - 1 bytes like any other data, then infile is sealed with
+    ChaCha20-Poly1305 under that key one chunk at a time, a batch of chunks in parallel.
+*/
+void encrypt_hybrid(FILE *infile, FILE *outfile, ss_pub_ctx *ctx, const ss_file_opts *opts) {
+    uint8_t key[AEAD_KEY_SIZE];
+    if (!aead_random(key, sizeof(key))) {
+        printf("Error reading the random source.\n");
+        return;
+    }
+
+    size_t k = ctx->k;
+    container_header header = { .version = CONTAINER_VERSION,
+        .width = ctx->width,
+        .blocks = (AEAD_KEY_SIZE + k - 2) / (k - 1),
+        .hybrid = true,
+        .cipher = CONTAINER_CIPHER_CHACHA20_POLY1305,
+        .chunk = SS_HYBRID_CHUNK };
+    uint8_t aad[CONTAINER_HYBRID_SIZE];
+    size_t aad_len = container_encode_header(&header, aad);
+    fwrite(aad, sizeof(uint8_t), aad_len, outfile);
+    stats_add(STATS_BYTES_OUT, aad_len);
+
+    mpz_t block;
+    mpz_init(block);
+    uint8_t *block_buffer = (uint8_t *) calloc(header.width, sizeof(uint8_t));
+    for (size_t pos = 0; pos < AEAD_KEY_SIZE; pos += k - 1) {
+        size_t len = AEAD_KEY_SIZE - pos < k - 1 ? AEAD_KEY_SIZE - pos : k - 1;
+        block_buffer[0] = 0xFF; //Prepend 0xFF byte
+        memcpy(block_buffer + 1, key + pos, len);
+        mpz_import(block, len + 1, 1, sizeof(uint8_t), 1, 0, block_buffer);
+        ss_encrypt_ctx(block, block, ctx);
+        container_write_block(outfile, block, block_buffer, header.width);
+        stats_add(STATS_BYTES_OUT, header.width);
+        stats_add(STATS_BLOCKS, 1);
+    }
+    mpz_clear(block);
+    free(block_buffer);
+
+    work_pool *pool = create_block_pool(opts);
+    size_t batch = (size_t) get_worker_count(pool) * SS_HYBRID_CHUNKS_PER_THREAD;
+    size_t slot = (size_t) header.chunk + AEAD_TAG_SIZE;
+    chunk_job job = { .data = (uint8_t *) malloc(batch * slot),
+        .lengths = (size_t *) calloc(batch, sizeof(size_t)),
+        .chunk = header.chunk,
+        .key = key,
+        .aad = aad,
+        .aad_len = aad_len };
+
+    //Empty input still gets one empty last chunk, so its tag vouches for the end
+    while (!job.ends) {
+        uint64_t start = stats_now();
+        uint64_t bytes = 0;
+        job.count = 0;
+        while (job.count < batch && !job.ends) {
+            size_t len = fread(job.data + job.count * slot, sizeof(uint8_t), header.chunk, infile);
+            job.lengths[job.count++] = len;
+            job.ends = len < header.chunk || at_eof(infile);
+            bytes += len;
         }
-        mpz_import(block_data, read_bytes + 1, 1, sizeof(uint8_t), 1, 0, (void *) write_contents);
-        ss_encrypt(encrypted_data, block_data, n);
-        mpz_out_str(outfile, 16, encrypted_data);
-        fputc('\n', outfile);
-    } while (read_bytes == (k - 1));
+        stats_add_time(STATS_IO_NS, start);
+        stats_add(STATS_BYTES_IN, bytes);
 
-    free(write_contents);
+        start = stats_now();
+        run_chunks(pool, seal_chunk_task, &job);
+        stats_add_time(STATS_ARITH_NS, start);
 
-    mpz_clears(root, block_data, encrypted_data, NULL);
+        start = stats_now();
+        for (size_t i = 0; i < job.count; i++) {
+            fwrite(job.data + i * slot, sizeof(uint8_t), job.lengths[i] + AEAD_TAG_SIZE, outfile);
+        }
+        stats_add_time(STATS_IO_NS, start);
+        stats_add(STATS_BYTES_OUT, bytes + job.count * AEAD_TAG_SIZE);
+        stats_add(STATS_CHUNKS, job.count);
+        job.first += job.count;
+    }
+
+    memset(key, 0, sizeof(key));
+    free(job.data);
+    free(job.lengths);
+    work_pool_delete(&pool);
+    return;
+}
+
+/*
+    Checks whether infile has no bytes left without consuming any.
+*/
+bool at_eof(FILE *infile) {
+    int c = getc(infile);
+    if (c == EOF) {
+        return true;
+    }
+    ungetc(c, infile);
+    return false;
+}
+
+/*
+    Nonce of chunk index: last || 0x000000 || index (big-endian).
+*/
+void chunk_nonce(uint8_t *nonce, uint64_t index, bool last) {
+    memset(nonce, 0, AEAD_NONCE_SIZE);
+    nonce[0] = last ? 1 : 0;
+    for (int i = 0; i < 8; i++) {
+        nonce[AEAD_NONCE_SIZE - 1 - i] = (uint8_t) (index >> (8 * i));
+    }
+    return;
+}
+
+/*
+    Runs task on every chunk of the job, on the pool if there is one.
+*/
+void run_chunks(work_pool *pool, work_pool_task task, chunk_job *job) {
+    if (pool == NULL) {
+        for (size_t i = 0; i < job->count; i++) {
+            task(job, i, 0);
+        }
+        return;
+    }
+    work_pool_run(pool, job->count, task, job);
     return;
 }
 
+/*
+    Encrypts one chunk of a job in place and appends its tag.
+*/
+void seal_chunk_task(void *arg, size_t index, uint32_t worker) {
+    (void) worker;
+    chunk_job *job = (chunk_job *) arg;
+    uint8_t *data = job->data + index * ((size_t) job->chunk + AEAD_TAG_SIZE);
+    size_t len = job->lengths[index];
+
+    uint64_t span = trace_begin();
+    uint8_t nonce[AEAD_NONCE_SIZE];
+    chunk_nonce(nonce, job->first + index, job->ends && index + 1 == job->count);
+    aead_seal(data, data + len, data, len, job->aad, job->aad_len, job->key, nonce);
+    trace_span("seal", span, "chunk", job->first + index);
+    return;
+}
+
+/*
+    Checks the tag of one chunk of a job and decrypts it in place.
+*/
+void open_chunk_task(void *arg, size_t index, uint32_t worker) {
+    (void) worker;
+    chunk_job *job = (chunk_job *) arg;
+    uint8_t *data = job->data + index * ((size_t) job->chunk + AEAD_TAG_SIZE);
+    size_t len = job->lengths[index];
+
+    uint64_t span = trace_begin();
+    uint8_t nonce[AEAD_NONCE_SIZE];
+    chunk_nonce(nonce, job->first + index, job->ends && index + 1 == job->count);
+    if (!aead_open(data, data, len, data + len, job->aad, job->aad_len, job->key, nonce)) {
+        job->failed = true;
+    }
+    trace_span("open", span, "chunk", job->first + index);
+    return;
+}
+
+/*
+    Maps infile from its current position when it is a regular file, otherwise sets up
+    a k byte buffer for fread.
+*/
+void open_block_source(block_source *src, FILE *infile, size_t k) {
+    *src = (block_source) { .file = infile };
+
+    struct stat info;
+    off_t start = ftello(infile);
+    if (start >= 0 && fstat(fileno(infile), &info) == 0 && S_ISREG(info.st_mode)
+        && info.st_size > start) {
+        //mmap offsets must be page aligned, so map from the page holding start
+        off_t page = (off_t) sysconf(_SC_PAGESIZE);
+        off_t base = start - (start % page);
+        size_t size = (size_t) (info.st_size - base);
+        void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(infile), base);
+        if (map != MAP_FAILED) {
+            madvise(map, size, MADV_SEQUENTIAL);
+            madvise(map, size, MADV_WILLNEED);
+            src->map = (uint8_t *) map;
+            src->map_size = size;
+            src->pos = (size_t) (start - base);
+            return;
+        }
+    }
+
+    src->buffer = (uint8_t *) calloc(k, sizeof(uint8_t));
+    return;
+}
+
+/*
+    Unmaps src and leaves its file positioned after the last byte read.
+*/
+void close_block_source(block_source *src) {
+    if (src->map != NULL) {
+        off_t end = ftello(src->file);
+        end += (off_t) src->pos - (end % (off_t) sysconf(_SC_PAGESIZE));
+        munmap(src->map, src->map_size);
+        fseeko(src->file, end, SEEK_SET);
+    }
+    free(src->buffer);
+    return;
+}
+
+/*
+    Reads up to batch plaintext blocks of k - 1 bytes each, prefixed by 0xFF.
+    Returns the number of blocks read, less than batch once the input runs out, and
+    the plaintext bytes in them through bytes. Only the last block of the input is short.
+    base is the index of the first block in the file, for the trace. Mapped input
+    has no read span, its pages are faulted in by the import.
+*/
+size_t read_blocks(
+    block_source *src, mpz_t *blocks, size_t batch, size_t k, uint64_t base, uint64_t *bytes) {
+    size_t count = 0;
+    *bytes = 0;
+    if (src->map != NULL) {
+        size_t first = src->pos;
+        while (count < batch && src->pos < src->map_size) {
+            uint64_t span = trace_begin();
+            size_t len = src->map_size - src->pos;
+            len = len < k - 1 ? len : k - 1;
+            mpz_import(blocks[count], len, 1, sizeof(uint8_t), 1, 0, src->map + src->pos);
+            for (size_t bit = 8 * len; bit < 8 * len + 8; bit++) {
+                mpz_setbit(blocks[count], bit); //Prepend 0xFF byte
+            }
+            trace_span("import", span, "block", base + count);
+            src->pos += len;
+            count++;
+        }
+        *bytes = src->pos - first;
+        stats_add(STATS_BYTES_IN, *bytes);
+        return count;
+    }
+
+    while (count < batch) {
+        uint64_t span = trace_begin();
+        src->buffer[0] = 0xFF; //Prepend 0xFF byte
+        size_t read_bytes = fread(src->buffer + 1, sizeof(uint8_t), k - 1, src->file);
+        if (read_bytes == 0) {
+            break; //Nothing read
+        }
+        trace_span("read", span, "block", base + count);
+        span = trace_begin();
+        mpz_import(blocks[count], read_bytes + 1, 1, sizeof(uint8_t), 1, 0, src->buffer);
+        trace_span("import", span, "block", base + count);
+        count++;
+        *bytes += read_bytes;
+        if (read_bytes != (k - 1)) {
+            break; //Last partial block
+        }
+    }
+    stats_add(STATS_BYTES_IN, *bytes);
+    return count;
+}
+
 /*
     Gets k using lg(k)-1/8
 */
@@ -186,6 +1256,146 @@ void get_k(size_t *k, const mpz_t var) {
     return;
 }
 
+/*
+    Creates the worker pool for a file operation, or NULL when it should run on the calling thread.
+    Falls back to the calling thread if the workers cannot be started.
+*/
+work_pool *create_block_pool(const ss_file_opts *opts) {
+    if (opts == NULL || opts->threads <= 1) {
+        return NULL;
+    }
+    return work_pool_create(opts->threads);
+}
+
+/*
+    Number of threads that run blocks, 1 for the calling thread.
+*/
+uint32_t get_worker_count(const work_pool *pool) {
+    return pool == NULL ? 1 : work_pool_threads(pool);
+}
+
+/*
+    Number of blocks buffered per batch, enough to keep every worker busy.
+*/
+size_t get_batch_size(const work_pool *pool) {
+    return (size_t) get_worker_count(pool) * SS_BATCH_PER_THREAD;
+}
+
+/*
+    Allocates and initializes count mpz_t blocks.
+*/
+mpz_t *create_blocks(size_t count) {
+    mpz_t *blocks = (mpz_t *) calloc(count, sizeof(mpz_t));
+    for (size_t i = 0; i < count; i++) {
+        mpz_init(blocks[i]);
+    }
+    return blocks;
+}
+
+/*
+    Clears and frees count mpz_t blocks.
+*/
+void delete_blocks(mpz_t *blocks, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        mpz_clear(blocks[i]);
+    }
+    free(blocks);
+    return;
+}
+
+/*
+    Runs task on the first count blocks of the job in groups of job->lanes blocks,
+    on the pool if there is one.
+*/
+void run_blocks(work_pool *pool, size_t count, work_pool_task task, block_job *job) {
+    job->count = count;
+    size_t groups = (count + job->lanes - 1) / job->lanes;
+    if (pool == NULL) {
+        for (size_t i = 0; i < groups; i++) {
+            task(job, i, 0);
+        }
+        return;
+    }
+    work_pool_run(pool, groups, task, job);
+    return;
+}
+
+/*
+    Sets up the batch engine of a public key context for a file operation.
+    Returns the blocks per task: the engine's lanes, or 1 without an engine.
+*/
+uint32_t select_pub_batch(ss_pub_ctx *ctx, const ss_file_opts *opts) {
+    mont_batch_retarget(&ctx->batch, opts == NULL ? MONT_BATCH_AUTO : opts->isa);
+    return ctx->batch.isa == MONT_BATCH_SCALAR ? 1 : ctx->batch.lanes;
+}
+
+/*
+    Same as select_pub_batch for a private key context. CRT contexts only batch if both
+    p and q got the same engine.
+*/
+uint32_t select_priv_batch(ss_priv_ctx *ctx, const ss_file_opts *opts) {
+    mont_batch_isa want = opts == NULL ? MONT_BATCH_AUTO : opts->isa;
+    if (!ctx->crt) {
+        mont_batch_retarget(&ctx->batch_pq, want);
+        return ctx->batch_pq.isa == MONT_BATCH_SCALAR ? 1 : ctx->batch_pq.lanes;
+    }
+    mont_batch_retarget(&ctx->batch_p, want);
+    mont_batch_retarget(&ctx->batch_q, want);
+    if (ctx->batch_p.isa == MONT_BATCH_SCALAR || ctx->batch_p.isa != ctx->batch_q.isa) {
+        return 1;
+    }
+    return ctx->batch_p.lanes;
+}
+
+/*
+    Encrypts one group of blocks of a job in place, in lockstep if it has several.
+*/
+void encrypt_block_task(void *arg, size_t index, uint32_t worker) {
+    block_job *job = (block_job *) arg;
+    size_t first = index * job->lanes;
+    size_t count = job->count - first < job->lanes ? job->count - first : job->lanes;
+    uint64_t span = trace_begin();
+    if (job->lanes == 1) {
+        encrypt_with(job->blocks[first], job->blocks[first], job->pub, worker);
+    } else {
+        mont_batch_pow(job->blocks + first, (uint32_t) count, &job->pub->batch,
+            &job->pub->exp, &job->pub->scratch[worker].batch);
+    }
+    trace_span("exponentiate", span, "block", job->base + first);
+    return;
+}
+
+/*
+    Decrypts one group of blocks of a job in place, in lockstep if it has several.
+    CRT groups exponentiate all their p halves, then all their q halves, then recombine.
+*/
+void decrypt_block_task(void *arg, size_t index, uint32_t worker) {
+    block_job *job = (block_job *) arg;
+    ss_priv_ctx *ctx = job->priv;
+    size_t first = index * job->lanes;
+    size_t count = job->count - first < job->lanes ? job->count - first : job->lanes;
+    uint64_t span = trace_begin();
+    ss_scratch *s = &ctx->scratch[worker];
+    if (job->lanes == 1) {
+        decrypt_with(job->blocks[first], job->blocks[first], ctx, worker);
+    } else if (!ctx->crt) {
+        mont_batch_pow(job->blocks + first, (uint32_t) count, &ctx->batch_pq, &ctx->exp_d,
+            &s->batch);
+    } else {
+        for (size_t l = 0; l < count; l++) {
+            mpz_set(s->lane_p[l], job->blocks[first + l]); //Reduced mod p by mont_batch_pow
+            mpz_set(s->lane_q[l], job->blocks[first + l]);
+        }
+        mont_batch_pow(s->lane_p, (uint32_t) count, &ctx->batch_p, &ctx->exp_dp, &s->batch);
+        mont_batch_pow(s->lane_q, (uint32_t) count, &ctx->batch_q, &ctx->exp_dq, &s->batch);
+        for (size_t l = 0; l < count; l++) {
+            crt_combine(job->blocks[first + l], s->lane_p[l], s->lane_q[l], ctx, s->temp);
+        }
+    }
+    trace_span("exponentiate", span, "block", job->base + first);
+    return;
+}
+
 /*
     Decrypts using power mod with c, d and pq, outputting to m.
 */
@@ -195,39 +1405,430 @@ void ss_decrypt(mpz_t m, const mpz_t c, const mpz_t d, const mpz_t pq) {
 }
 
 /*
-    Decrypts infile in blocks of size k using private keys d and pq and outputs message into outfile. 
+    Decrypts c using the CRT components, outputting to m:
+     - mp = c^dp % p
+     - mq = c^dq % q
+     - m = mq + q * ((qinv * (mp - mq)) % p)
 */
-void ss_decrypt_file(FILE *infile, FILE *outfile, const mpz_t d, const mpz_t pq) {
-    mpz_t c, m;
-    mpz_inits(c, m, NULL);
+void ss_decrypt_crt(mpz_t m, const mpz_t c, const mpz_t p, const mpz_t q, const mpz_t dp,
+    const mpz_t dq, const mpz_t qinv) {
+    mpz_t mp, mq, temp;
+    mpz_inits(mp, mq, temp, NULL);
 
-    size_t k;
-    get_k(&k, pq);
+    mpz_mod(temp, c, p); //temp = c % p
+    pow_mod(mp, temp, dp, p); //mp = temp^dp % p
+    mpz_mod(temp, c, q); //temp = c % q
+    pow_mod(mq, temp, dq, q); //mq = temp^dq % q
 
-    uint8_t *read_contents = (uint8_t *) calloc(k, sizeof(uint8_t));
+    mpz_sub(temp, mp, mq); //temp = mp - mq
+    mpz_mul(temp, temp, qinv); //temp = temp * qinv
+    mpz_mod(temp, temp, p); //temp = temp % p (non-negative)
+    mpz_mul(temp, temp, q); //temp = temp * q
+    mpz_add(m, mq, temp); //m = mq + temp
 
-    while (mpz_inp_str(c, infile, 16) > 0) {
-        ss_decrypt(m, c, d, pq);
+    mpz_clears(mp, mq, temp, NULL);
+    return;
+}
+
+/*
+    Decrypts c with the context's precomputed state on worker's scratch, outputting to m.
+    CRT contexts recombine the halves like ss_decrypt_crt.
+*/
+void decrypt_with(mpz_t m, const mpz_t c, ss_priv_ctx *ctx, uint32_t worker) {
+    ss_scratch *s = &ctx->scratch[worker];
+    if (!ctx->crt) {
+        pow_mod_mont(m, c, &ctx->mont_pq, &ctx->exp_d, &s->mont);
+        return;
+    }
+
+    pow_mod_mont(s->mp, c, &ctx->mont_p, &ctx->exp_dp, &s->mont); //mp = c^dp % p
+    pow_mod_mont(s->mq, c, &ctx->mont_q, &ctx->exp_dq, &s->mont); //mq = c^dq % q
+    crt_combine(m, s->mp, s->mq, ctx, s->temp);
+    return;
+}
+
+/*
+    Recombines the CRT halves mp = m % p and mq = m % q into m. m must not alias mq.
+*/
+void crt_combine(mpz_t m, const mpz_t mp, const mpz_t mq, const ss_priv_ctx *ctx, mpz_t temp) {
+    mpz_sub(temp, mp, mq); //temp = mp - mq
+    mpz_mul(temp, temp, ctx->qinv); //temp = temp * qinv
+    mpz_mod(temp, temp, ctx->p); //temp = temp % p (non-negative)
+    mpz_mul(temp, temp, ctx->q); //temp = temp * q
+    mpz_add(m, mq, temp); //m = mq + temp
+    return;
+}
+
+/*
+    Decrypts c with a private key context, outputting to m.
+*/
+void ss_decrypt_ctx(mpz_t m, const mpz_t c, ss_priv_ctx *ctx) {
+    decrypt_with(m, c, ctx, 0);
+    return;
+}
+
+/*
+    Exports decrypted block m into read_contents and writes it to outfile with one fwrite,
+    skipping the 0xFF prefix byte. The prefix marks where the data starts, so everything
+    after it is written, 0x00 bytes included. read_contents must hold the bytes of the modulus. Adds the number of bytes written to
+    *bytes. Returns false without writing anything if the block does not start with 0xFF
+    or is longer than k bytes, as a block that was corrupted or encrypted for another key
+    decrypts to anything below pq. index is the block's index in the file, for the trace.
+*/
+bool write_decrypted_block(FILE *outfile, const mpz_t m, uint8_t *read_contents, size_t k,
+    uint64_t index, uint64_t *bytes) {
+    uint64_t span = trace_begin();
+    size_t size = 0;
+    mpz_export((void *) read_contents, &size, 1, sizeof(uint8_t), 1, 0, m);
+    trace_span("export", span, "block", index);
+    if (size == 0 || size > k || read_contents[0] != 0xFF) {
+        return false;
+    }
+
+    span = trace_begin();
+    *bytes += fwrite(read_contents + 1, sizeof(uint8_t), size - 1, outfile);
+    trace_span("write", span, "block", index);
+    return true;
+}
+
+/*
+    Decrypts infile in blocks of size k using the private key context and outputs message
+    into outfile. Reads infile a batch of encrypted blocks at a time, decrypts the batch
+    and writes the blocks to outfile in their original order.
+    Binary containers are detected from their magic, anything else is read as hex.
+    Both are decrypted byte exact (see container.h). A range is decrypted with decrypt_range.
+*/
+bool ss_decrypt_file(FILE *infile, FILE *outfile, ss_priv_ctx *ctx, const ss_file_opts *opts) {
+    container_header header = { 0 };
+    uint8_t *block_buffer = NULL;
+    bool binary = container_detect(infile);
+    if (binary && !container_read_header(infile, &header)) {
+        fprintf(stderr, "Error parsing input file.\n");
+        return false;
+    }
+    if (opts != NULL && opts->range) {
+        if (!header.indexed) {
+            fprintf(stderr, "Only indexed containers can be decrypted in part.\n");
+            return false;
+        }
+        return decrypt_range(infile, outfile, ctx, &header, opts);
+    }
+    if (binary) {
+        stats_add(STATS_BYTES_IN, header.hybrid ? CONTAINER_HYBRID_SIZE : CONTAINER_HEADER_SIZE);
+        if (header.hybrid) {
+            return decrypt_hybrid(infile, outfile, ctx, &header, opts);
+        }
+        block_buffer = (uint8_t *) calloc(header.width, sizeof(uint8_t));
+    }
 
-        mpz_export((void *) read_contents, &k, 1, sizeof(uint8_t), 1, 0, m);
+    //A corrupted block can decrypt to anything below pq, not just k bytes
+    size_t size = (mpz_sizeinbase(ctx->pq, 2) + 7) / 8;
+    uint8_t *read_contents = (uint8_t *) calloc(size, sizeof(uint8_t));
 
-        for (int i = 1; i < (uint8_t) k; i++) {
-            uint8_t read_character = read_contents[i];
-            if (read_character == 0x00) {
+    work_pool *pool = create_block_pool(opts);
+    size_t batch = get_batch_size(pool);
+    mpz_t *blocks = create_blocks(batch);
+    block_job job = { .blocks = blocks, .lanes = select_priv_batch(ctx, opts), .priv = ctx };
+    reserve_scratch(&ctx->scratch, &ctx->scratch_count, get_worker_count(pool),
+        ctx->scratch[0].mont.size, ctx->scratch[0].mont.window);
+
+    uint64_t total_blocks = 0;
+    bool valid = true;
+    size_t count;
+    do {
+        uint64_t start = stats_now();
+        uint64_t bytes = 0;
+        count = 0;
+        while (count < batch) {
+            uint64_t span = trace_begin();
+            if (binary) {
+                if (total_blocks + count == header.blocks
+                    || fread(block_buffer, sizeof(uint8_t), header.width, infile)
+                           != header.width) {
+                    break;
+                }
+                trace_span("read", span, "block", total_blocks + count);
+                span = trace_begin();
+                container_import_block(blocks[count], block_buffer, header.width);
+                trace_span("import", span, "block", total_blocks + count);
+                bytes += header.width;
+            } else {
+                size_t len = mpz_inp_str(blocks[count], infile, 16);
+                if (len == 0) {
+                    break;
+                }
+                trace_span("read", span, "block", total_blocks + count);
+                bytes += len;
+            }
+            count++;
+        }
+        stats_add_time(STATS_IO_NS, start);
+        stats_add(STATS_BYTES_IN, bytes);
+
+        start = stats_now();
+        job.base = total_blocks;
+        run_blocks(pool, count, decrypt_block_task, &job);
+        stats_add_time(STATS_ARITH_NS, start);
+
+        start = stats_now();
+        bytes = 0;
+        for (size_t i = 0; valid && i < count; i++) {
+            valid = write_decrypted_block(
+                outfile, blocks[i], read_contents, ctx->k, total_blocks + i, &bytes);
+        }
+        total_blocks += count;
+        stats_add_time(STATS_IO_NS, start);
+        stats_add(STATS_BYTES_OUT, bytes);
+        stats_add(STATS_BLOCKS, count);
+    } while (count == batch && valid);
+
+    delete_blocks(blocks, batch);
+    work_pool_delete(&pool);
+    free(read_contents);
+    free(block_buffer);
+
+    bool truncated = binary && header.blocks != CONTAINER_BLOCKS_UNKNOWN
+                     && total_blocks != header.blocks;
+    if (!valid) {
+        fprintf(stderr, "Error decrypting input file, a block does not match the key.\n");
+        return false;
+    }
+    if (ferror(infile) || truncated) {
+        fprintf(stderr, "Error parsing input file.\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+    Decrypts the plaintext bytes [range_start, range_start + range_len) of an indexed
+    container whose header has been read, cut off at the end of the plaintext. Every block
+    but the last holds the trailer's payload bytes, so only the blocks holding the range
+    are read and decrypted.
+*/
+bool decrypt_range(FILE *infile, FILE *outfile, ss_priv_ctx *ctx,
+    const container_header *header, const ss_file_opts *opts) {
+    stats_add(STATS_BYTES_IN, CONTAINER_HEADER_SIZE);
+    container_index index;
+    if (!container_read_index(infile, header, &index)) {
+        fprintf(stderr, "Error reading the block index.\n");
+        return false;
+    }
+    stats_add(STATS_BYTES_IN, CONTAINER_INDEX_TRAILER_SIZE);
+
+    uint64_t skip = opts->range_start;
+    if (skip >= index.size || opts->range_len == 0) {
+        return true; //Nothing to write
+    }
+    uint64_t remaining = index.size - skip < opts->range_len ? index.size - skip : opts->range_len;
+    uint64_t first = skip / index.payload;
+    uint64_t end = (skip + remaining - 1) / index.payload + 1;
+    if (fseek(infile, index.first_block + (long) (first * header->width), SEEK_SET) != 0) {
+        fprintf(stderr, "Error reading the block index.\n");
+        return false;
+    }
+    skip -= first * index.payload;
+
+    size_t size = (mpz_sizeinbase(ctx->pq, 2) + 7) / 8;
+    uint8_t *read_contents = (uint8_t *) calloc(size, sizeof(uint8_t));
+    uint8_t *block_buffer = (uint8_t *) calloc(header->width, sizeof(uint8_t));
+
+    work_pool *pool = create_block_pool(opts);
+    size_t batch = get_batch_size(pool);
+    mpz_t *blocks = create_blocks(batch);
+    block_job job = { .blocks = blocks, .lanes = select_priv_batch(ctx, opts), .priv = ctx };
+    reserve_scratch(&ctx->scratch, &ctx->scratch_count, get_worker_count(pool),
+        ctx->scratch[0].mont.size, ctx->scratch[0].mont.window);
+
+    uint64_t block = first;
+    bool valid = true;
+    while (valid && remaining > 0 && block < end) {
+        uint64_t start = stats_now();
+        size_t want = end - block < batch ? (size_t) (end - block) : batch;
+        size_t count = 0;
+        while (count < want) {
+            uint64_t span = trace_begin();
+            if (fread(block_buffer, sizeof(uint8_t), header->width, infile) != header->width) {
                 break;
             }
-            fputc(read_character, outfile);
+            trace_span("read", span, "block", block + count);
+            span = trace_begin();
+            container_import_block(blocks[count], block_buffer, header->width);
+            trace_span("import", span, "block", block + count);
+            count++;
+        }
+        stats_add_time(STATS_IO_NS, start);
+        stats_add(STATS_BYTES_IN, count * header->width);
+
+        start = stats_now();
+        job.base = block;
+        run_blocks(pool, count, decrypt_block_task, &job);
+        stats_add_time(STATS_ARITH_NS, start);
+
+        start = stats_now();
+        uint64_t bytes = 0;
+        for (size_t i = 0; valid && i < count && remaining > 0; i++) {
+            valid = write_block_slice(outfile, blocks[i], read_contents, ctx->k, &skip,
+                &remaining, block + i, &bytes);
+        }
+        stats_add_time(STATS_IO_NS, start);
+        stats_add(STATS_BYTES_OUT, bytes);
+        stats_add(STATS_BLOCKS, count);
+        block += count;
+        if (count < want) {
+            break; //Truncated
         }
     }
 
+    delete_blocks(blocks, batch);
+    work_pool_delete(&pool);
     free(read_contents);
+    free(block_buffer);
 
-    if (ferror(infile)) {
-        printf("Error parsing input file.\n");
-        mpz_clears(c, m, NULL);
-        return;
+    if (!valid) {
+        fprintf(stderr, "Error decrypting input file, a block does not match the key.\n");
+        return false;
+    }
+    if (remaining > 0) {
+        fprintf(stderr, "Error parsing input file.\n");
+        return false;
+    }
+    return true;
+}
+
+/*
+    Writes the part of decrypted block m that lies in a range: drops the first
+    *skip plaintext bytes, writes up to *remaining of the rest and counts both down.
+    Adds the number of bytes written to *bytes. Returns false like write_decrypted_block
+    if the block does not start with 0xFF or is longer than k bytes.
+    index is the block's index in the file, for the trace.
+*/
+bool write_block_slice(FILE *outfile, const mpz_t m, uint8_t *read_contents, size_t k,
+    uint64_t *skip, uint64_t *remaining, uint64_t index, uint64_t *bytes) {
+    uint64_t span = trace_begin();
+    size_t size = 0;
+    mpz_export((void *) read_contents, &size, 1, sizeof(uint8_t), 1, 0, m);
+    trace_span("export", span, "block", index);
+    if (size == 0 || size > k || read_contents[0] != 0xFF) {
+        return false;
     }
 
-    mpz_clears(c, m, NULL);
-    return;
+    size_t len = size - 1; //Without the 0xFF prefix
+    if (*skip >= len) {
+        *skip -= len;
+        return true;
+    }
+    uint8_t *data = read_contents + 1 + *skip;
+    len -= (size_t) *skip;
+    *skip = 0;
+    len = *remaining < len ? (size_t) *remaining : len;
+
+    span = trace_begin();
+    *bytes += fwrite(data, sizeof(uint8_t), len, outfile);
+    trace_span("write", span, "block", index);
+    *remaining -= len;
+    return true;
+}
+
+/*
+    Decrypts the rest of a hybrid container whose header has been read: recovers the
+    session key from the SS blocks, then opens the chunks a batch at a time.
+    A batch is only written once every tag in it matches, so output stops before the
+    first chunk that was tampered with, cut off or encrypted for another key.
+*/
+bool decrypt_hybrid(FILE *infile, FILE *outfile, ss_priv_ctx *ctx,
+    const container_header *header, const ss_file_opts *opts) {
+    //Each block carries 0xFF followed by the next bytes of the session key
+    uint8_t key[AEAD_KEY_SIZE];
+    size_t key_len = 0;
+    bool key_ok = header->blocks <= AEAD_KEY_SIZE;
+    mpz_t block;
+    mpz_init(block);
+    uint8_t *block_buffer = (uint8_t *) calloc(header->width, sizeof(uint8_t));
+    for (uint64_t i = 0; key_ok && i < header->blocks; i++) {
+        key_ok = container_read_block(infile, block, block_buffer, header->width);
+        if (key_ok) {
+            stats_add(STATS_BYTES_IN, header->width);
+            stats_add(STATS_BLOCKS, 1);
+            ss_decrypt_ctx(block, block, ctx);
+            size_t size = (mpz_sizeinbase(block, 2) + 7) / 8;
+            key_ok = size > 1 && size <= header->width && key_len + size - 1 <= AEAD_KEY_SIZE;
+        }
+        if (key_ok) {
+            size_t size = 0;
+            mpz_export(block_buffer, &size, 1, sizeof(uint8_t), 1, 0, block);
+            key_ok = block_buffer[0] == 0xFF;
+            memcpy(key + key_len, block_buffer + 1, size - 1);
+            key_len += size - 1;
+        }
+    }
+    mpz_clear(block);
+    free(block_buffer);
+    if (!key_ok || key_len != AEAD_KEY_SIZE) {
+        fprintf(stderr, "Error parsing input file.\n");
+        return false;
+    }
+
+    uint8_t aad[CONTAINER_HYBRID_SIZE];
+    size_t aad_len = container_encode_header(header, aad);
+
+    work_pool *pool = create_block_pool(opts);
+    size_t batch = (size_t) get_worker_count(pool) * SS_HYBRID_CHUNKS_PER_THREAD;
+    size_t slot = (size_t) header->chunk + AEAD_TAG_SIZE;
+    chunk_job job = { .data = (uint8_t *) malloc(batch * slot),
+        .lengths = (size_t *) calloc(batch, sizeof(size_t)),
+        .chunk = header->chunk,
+        .key = key,
+        .aad = aad,
+        .aad_len = aad_len };
+
+    bool truncated = false;
+    while (!job.ends && !job.failed && !truncated) {
+        uint64_t start = stats_now();
+        uint64_t bytes = 0;
+        job.count = 0;
+        while (job.count < batch && !job.ends) {
+            size_t len = fread(job.data + job.count * slot, sizeof(uint8_t), slot, infile);
+            bytes += len;
+            if (len < AEAD_TAG_SIZE) {
+                truncated = true;
+                break;
+            }
+            job.lengths[job.count++] = len - AEAD_TAG_SIZE;
+            job.ends = len < slot || at_eof(infile);
+        }
+        stats_add_time(STATS_IO_NS, start);
+        stats_add(STATS_BYTES_IN, bytes);
+        if (truncated) {
+            break;
+        }
+
+        start = stats_now();
+        run_chunks(pool, open_chunk_task, &job);
+        stats_add_time(STATS_ARITH_NS, start);
+
+        if (!job.failed) {
+            start = stats_now();
+            for (size_t i = 0; i < job.count; i++) {
+                fwrite(job.data + i * slot, sizeof(uint8_t), job.lengths[i], outfile);
+            }
+            stats_add_time(STATS_IO_NS, start);
+            stats_add(STATS_BYTES_OUT, bytes - job.count * AEAD_TAG_SIZE);
+            stats_add(STATS_CHUNKS, job.count);
+        }
+        job.first += job.count;
+    }
+
+    bool ok = !truncated && !ferror(infile) && !job.failed;
+    if (truncated || ferror(infile)) {
+        fprintf(stderr, "Error parsing input file.\n");
+    } else if (job.failed) {
+        fprintf(stderr, "Error authenticating input file.\n");
+    }
+
+    memset(key, 0, sizeof(key));
+    free(job.data);
+    free(job.lengths);
+    work_pool_delete(&pool);
+    return ok;
 }
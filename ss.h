@@ -5,6 +5,79 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "numtheory.h"
+#include "montbatch.h"
+#include "batch.h"
+#include "pool.h"
+
+//
+// Ciphertext formats written by ss_encrypt_file. ss_decrypt_file detects the format.
+//
+//  SS_FORMAT_BINARY:  header followed by fixed-width big-endian blocks (see container.h)
+//  SS_FORMAT_HEX:     one hexadecimal block per line
+//  SS_FORMAT_HYBRID:  only a random session key is SS encrypted, the data is encrypted with
+//                     ChaCha20-Poly1305 under it (see the hybrid container in container.h)
+//  SS_FORMAT_INDEXED: binary blocks followed by a trailer with their plaintext size, so a
+//                     byte range can be decrypted on its own (see container.h). Needs a
+//                     seekable output, written as SS_FORMAT_BINARY otherwise
+//
+typedef enum { SS_FORMAT_BINARY = 0, SS_FORMAT_HEX, SS_FORMAT_HYBRID, SS_FORMAT_INDEXED } ss_format;
+
+//
+// Options shared by the file encryption and decryption functions.
+// A NULL options pointer behaves like all fields set to 0.
+//
+//  threads: worker threads exponentiating blocks or sealing hybrid chunks
+//           (0 or 1 runs on the calling thread)
+//  format:  ciphertext format written by ss_encrypt_file
+//  isa:     vector unit exponentiating several blocks in lockstep (MONT_BATCH_AUTO picks
+//           the best one, MONT_BATCH_SCALAR exponentiates one block at a time)
+//  range:   ss_decrypt_file only writes the plaintext bytes [range_start, range_start +
+//           range_len), which must come from an indexed container. Only the blocks
+//           holding them are read and decrypted
+//
+typedef struct {
+    uint32_t threads;
+    ss_format format;
+    mont_batch_isa isa;
+    bool range;
+    uint64_t range_start, range_len;
+} ss_file_opts;
+
+typedef struct ss_scratch ss_scratch;
+
+//
+// Public key state derived once from n and reused for every block encrypted with it.
+// Not safe for concurrent use, the file functions add per-thread scratch themselves.
+//
+typedef struct {
+    mpz_t n;
+    size_t k; //Plaintext block size in bytes, including the 0xFF prefix
+    uint32_t width; //Encrypted block size in bytes
+    mont_modulus mont; //Montgomery constants for n
+    exp_recoding exp; //Window recoding of the exponent n
+    mont_batch batch; //n laid out for the batch engine
+    ss_scratch *scratch; //Per-thread working memory
+    uint32_t scratch_count;
+} ss_pub_ctx;
+
+//
+// Private key state derived once from a loaded key and reused for every block.
+// CRT contexts only set up p and q, plain contexts only pq.
+// Not safe for concurrent use, the file functions add per-thread scratch themselves.
+//
+typedef struct {
+    mpz_t pq, d;
+    bool crt;
+    mpz_t p, q, dp, dq, qinv;
+    size_t k; //Plaintext block size in bytes, including the 0xFF prefix
+    mont_modulus mont_pq, mont_p, mont_q;
+    exp_recoding exp_d, exp_dp, exp_dq;
+    mont_batch batch_pq, batch_p, batch_q;
+    ss_scratch *scratch; //Per-thread working memory
+    uint32_t scratch_count;
+} ss_priv_ctx;
+
 //
 // Generates the components for a new SS key.
 //
@@ -15,11 +88,43 @@
 //
 // Requires:
 //  nbits: minimum # of bits in n
-//  iters: iterations of Miller-Rabin to use for primality check
+//  iters: iterations of Miller-Rabin to use for primality check, or PRIME_BPSW
 //  all mpz_t arguments to be initialized
 //
 void ss_make_pub(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters);
 
+//
+// Generates the components for a new SS key on several threads. p and q are searched
+// for at the same time. Each interval is sieved once from a random stream of the search
+// and the workers test its survivors in parallel, the lowest one that passes wins.
+// Does not use the global random state or random().
+//
+// Provides:
+//  p:  first prime
+//  q: second prime
+//  n: public modulus/exponent
+//
+// Requires:
+//  nbits: minimum # of bits in n
+//  iters: iterations of Miller-Rabin to use for primality check, or PRIME_BPSW
+//  threads: number of worker threads
+//  seed: seed every random stream is derived from. The same seed and thread count
+//        always produce the same key, with PRIME_BPSW the thread count does not matter
+//  all mpz_t arguments to be initialized
+//
+void ss_make_pub_threaded(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters,
+    uint32_t threads, uint64_t seed);
+
+//
+// Generates the components for a new SS key from a pair of primes taken out of the
+// prime pool at pool (see primepool.h). Falls back to ss_make_pub_threaded, or
+// ss_make_pub if threads is 0, when the pool is missing or holds no pair for nbits.
+//
+// Returns true if p and q came from the pool.
+//
+bool ss_make_pub_pooled(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters,
+    uint32_t threads, uint64_t seed, const char *pool);
+
 //
 // Generates components for a new SS private key.
 //
@@ -34,6 +139,23 @@ void ss_make_pub(mpz_t p, mpz_t q, mpz_t n, uint64_t nbits, uint64_t iters);
 //
 void ss_make_priv(mpz_t d, mpz_t pq, const mpz_t p, const mpz_t q);
 
+//
+// Generates the CRT components of an SS private key so decryption can work
+// modulo p and q separately instead of modulo pq.
+//
+// Provides:
+//  dp:   d mod (p - 1)
+//  dq:   d mod (q - 1)
+//  qinv: q^-1 mod p
+//
+// Requires:
+//  d: private exponent from ss_make_priv
+//  p: first prime number
+//  q: second prime number
+//  all mpz_t arguments to be initialized
+//
+void ss_make_priv_crt(mpz_t dp, mpz_t dq, mpz_t qinv, const mpz_t d, const mpz_t p, const mpz_t q);
+
 //
 // Export SS public key to output stream
 //
@@ -54,6 +176,19 @@ void ss_write_pub(const mpz_t n, const char username[], FILE *pbfile);
 //
 void ss_write_priv(const mpz_t pq, const mpz_t d, FILE *pvfile);
 
+//
+// Export extended SS private key (with CRT components) to output stream.
+// The first two fields are identical to ss_write_priv so older readers still work.
+//
+// Requires:
+//  pq: private modulus
+//  d:  private exponent
+//  p, q, dp, dq, qinv: CRT components from ss_make_priv_crt
+//  pvfile: open and writable file stream
+//
+void ss_write_priv_crt(const mpz_t pq, const mpz_t d, const mpz_t p, const mpz_t q,
+    const mpz_t dp, const mpz_t dq, const mpz_t qinv, FILE *pvfile);
+
 //
 // Import SS public key from input stream
 //
@@ -81,6 +216,24 @@ void ss_read_pub(mpz_t n, char username[], FILE *pbfile);
 //
 void ss_read_priv(mpz_t pq, mpz_t d, FILE *pvfile);
 
+//
+// Import SS private key from input stream, including the CRT components if present.
+//
+// Provides:
+//  pq: private modulus
+//  d:  private exponent
+//  p, q, dp, dq, qinv: CRT components (only valid if true is returned)
+//
+// Requires:
+//  pvfile: open and readable file stream
+//  all mpz_t arguments to be initialized
+//
+// Returns:
+//  true if the key carried valid CRT components, false for the two-field format
+//
+bool ss_read_priv_crt(mpz_t pq, mpz_t d, mpz_t p, mpz_t q, mpz_t dp, mpz_t dq, mpz_t qinv,
+    FILE *pvfile);
+
 //
 // Encrypt number m into number c
 //
@@ -94,6 +247,54 @@ void ss_read_priv(mpz_t pq, mpz_t d, FILE *pvfile);
 //
 void ss_encrypt(mpz_t c, const mpz_t m, const mpz_t n);
 
+//
+// Build a public key context from n. Must be cleared with ss_pub_ctx_clear.
+//
+// Requires:
+//  n: public exponent/modulus
+//
+void ss_pub_ctx_init(ss_pub_ctx *ctx, const mpz_t n);
+
+//
+// Completes a public key context whose n, k, width, mont and exp a loader has filled in
+// (see keyfile.h), the last step of ss_pub_ctx_init. Must be cleared with ss_pub_ctx_clear.
+//
+void ss_pub_ctx_finish(ss_pub_ctx *ctx);
+
+//
+// Sets up dst as an independent copy of src, taking over its constants and recoding
+// instead of deriving them again. Must be cleared with ss_pub_ctx_clear.
+//
+void ss_pub_ctx_copy(ss_pub_ctx *dst, const ss_pub_ctx *src);
+
+void ss_pub_ctx_clear(ss_pub_ctx *ctx);
+
+//
+// Encrypt number m into number c with a public key context
+//
+// Provides:
+//  c: encrypted integer
+//
+// Requires:
+//  m: original integer
+//  ctx: initialized public key context
+//
+void ss_encrypt_ctx(mpz_t c, const mpz_t m, ss_pub_ctx *ctx);
+
+//
+// Encrypt count blocks in place with a public key context: in lockstep groups on the
+// batch engine opts selects, the groups spread over the workers of pool. For callers
+// that gather blocks themselves, such as the ssd daemon.
+//
+// Requires:
+//  blocks: integers m with 0 < m < 256^k, blocks prefixed with 0xFF as the file functions do
+//  ctx: initialized public key context, not used by anything else while this runs
+//  pool: worker pool, NULL to run on the calling thread
+//  opts: file options, may be NULL, only isa is used
+//
+void ss_encrypt_blocks(
+    mpz_t *blocks, size_t count, ss_pub_ctx *ctx, work_pool *pool, const ss_file_opts *opts);
+
 //
 // Encrypt an arbitrary file
 //
@@ -103,9 +304,24 @@ void ss_encrypt(mpz_t c, const mpz_t m, const mpz_t n);
 // Requires:
 //  infile: open and readable file stream
 //  outfile: open and writable file stream
-//  n: public exponent and modulus
+//  ctx: initialized public key context
+//  opts: file options, may be NULL
 //
-void ss_encrypt_file(FILE *infile, FILE *outfile, const mpz_t n);
+void ss_encrypt_file(FILE *infile, FILE *outfile, ss_pub_ctx *ctx, const ss_file_opts *opts);
+
+//
+// Encrypts every file of a batch list with ss_encrypt_file. Files are spread over
+// opts->threads workers, each with its own copy of ctx, and every file is encrypted
+// on a single thread. The list should be ordered by batch_list_schedule.
+//
+// Requires:
+//  list: files to encrypt
+//  ctx: initialized public key context
+//  opts: file options, may be NULL
+//
+// Returns the number of files that could not be opened, each reported on stdout.
+//
+size_t ss_encrypt_batch(const batch_list *list, ss_pub_ctx *ctx, const ss_file_opts *opts);
 
 //
 // Decrypt number c into number m
@@ -121,6 +337,72 @@ void ss_encrypt_file(FILE *infile, FILE *outfile, const mpz_t n);
 //
 void ss_decrypt(mpz_t m, const mpz_t c, const mpz_t d, const mpz_t pq);
 
+//
+// Decrypt number c into number m using two half-size exponentiations
+// modulo p and q which are then recombined (Garner's formula).
+//
+// Provides:
+//  m: decrypted/original integer
+//
+// Requires:
+//  c: encrypted integer
+//  p, q, dp, dq, qinv: CRT components from ss_make_priv_crt
+//  all mpz_t arguments to be initialized
+//
+void ss_decrypt_crt(mpz_t m, const mpz_t c, const mpz_t p, const mpz_t q, const mpz_t dp,
+    const mpz_t dq, const mpz_t qinv);
+
+//
+// Build a private key context from pq and d. Must be cleared with ss_priv_ctx_clear.
+//
+void ss_priv_ctx_init(ss_priv_ctx *ctx, const mpz_t pq, const mpz_t d);
+
+//
+// Build a private key context that decrypts with the CRT components.
+// Must be cleared with ss_priv_ctx_clear.
+//
+void ss_priv_ctx_init_crt(ss_priv_ctx *ctx, const mpz_t pq, const mpz_t d, const mpz_t p,
+    const mpz_t q, const mpz_t dp, const mpz_t dq, const mpz_t qinv);
+
+//
+// Completes a private key context whose numbers, crt, k and the Montgomery constants and
+// recodings it decrypts with a loader has filled in (see keyfile.h), the last step of
+// ss_priv_ctx_init and ss_priv_ctx_init_crt. Must be cleared with ss_priv_ctx_clear.
+//
+void ss_priv_ctx_finish(ss_priv_ctx *ctx);
+
+//
+// Sets up dst as an independent copy of src, like ss_pub_ctx_copy.
+// Must be cleared with ss_priv_ctx_clear.
+//
+void ss_priv_ctx_copy(ss_priv_ctx *dst, const ss_priv_ctx *src);
+
+void ss_priv_ctx_clear(ss_priv_ctx *ctx);
+
+//
+// Decrypt number c into number m with a private key context
+//
+// Provides:
+//  m: decrypted/original integer
+//
+// Requires:
+//  c: encrypted integer
+//  ctx: initialized private key context
+//
+void ss_decrypt_ctx(mpz_t m, const mpz_t c, ss_priv_ctx *ctx);
+
+//
+// Decrypt count blocks in place with a private key context, like ss_encrypt_blocks.
+//
+// Requires:
+//  blocks: encrypted integers
+//  ctx: initialized private key context, not used by anything else while this runs
+//  pool: worker pool, NULL to run on the calling thread
+//  opts: file options, may be NULL, only isa is used
+//
+void ss_decrypt_blocks(
+    mpz_t *blocks, size_t count, ss_priv_ctx *ctx, work_pool *pool, const ss_file_opts *opts);
+
 //
 // Decrypt a file back into its original form.
 //
@@ -130,7 +412,18 @@ void ss_decrypt(mpz_t m, const mpz_t c, const mpz_t d, const mpz_t pq);
 // Requires:
 //  infile: open and readable file stream to encrypted data
 //  outfile: open and writable file stream
-//  d: private exponent
-//  pq: private modulus
+//  ctx: initialized private key context
+//  opts: file options, may be NULL
+//
+// Returns false, with the reason printed to stderr, if infile cannot be parsed, is
+// truncated or fails authentication. outfile may then hold part of the plaintext.
+//
+bool ss_decrypt_file(FILE *infile, FILE *outfile, ss_priv_ctx *ctx, const ss_file_opts *opts);
+
+//
+// Decrypts every file of a batch list with ss_decrypt_file, like ss_encrypt_batch.
+//
+// Returns the number of files that could not be opened, reported on stdout, plus the
+// number that ss_decrypt_file failed on, reported on stderr.
 //
-void ss_decrypt_file(FILE *infile, FILE *outfile, const mpz_t d, const mpz_t pq);
+size_t ss_decrypt_batch(const batch_list *list, ss_priv_ctx *ctx, const ss_file_opts *opts);
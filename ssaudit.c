@@ -0,0 +1,383 @@
+#include "argparser.h"
+#include "ss.h"
+#include "keyfile.h"
+#include "batchgcd.h"
+#include "pool.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define SSAUDIT_OPTIONS "l:t:vh"
+
+//Keys the list starts with, it doubles when full
+#define AUDIT_INITIAL_KEYS 1024
+
+//Weak keys compared pairwise to name the keys they share factors with, above this many
+//only the keys themselves are listed
+#define AUDIT_MAX_PAIRWISE 4096
+
+typedef struct {
+    char **paths;
+    mpz_t *moduli;
+    size_t count;
+    size_t capacity;
+    uint64_t unreadable;
+    char *username; //Scratch for ss_read_pub, as long as the longest file read
+    size_t username_size;
+} key_list;
+
+//Helper functions not in header file
+int ssaudit_argparser(int argc, char **argv, const char **list_path, uint32_t *threads,
+    bool *verbose, bool *help, bool *stats, stats_format *format, FILE **trace_file);
+bool add_key(key_list *keys, const char *path);
+void add_path(key_list *keys, const char *path);
+bool add_list(key_list *keys, const char *list_path);
+void clear_keys(key_list *keys);
+size_t report(const key_list *keys, mpz_t *gcds, bool verbose);
+void print_help(void);
+
+/*
+    Main function for execution.
+    Reads every key named on the command line and in the list, runs the batch GCD over
+    their moduli and reports the keys that share a factor with another key.
+    Returns 0 if there are none, 1 if there are, negative if the keys could not be read.
+*/
+int main(int argc, char **argv) {
+    const char *list_path = NULL;
+    uint32_t threads = 1;
+    bool verbose = false;
+    bool help = false;
+    bool stats = false;
+    stats_format format = STATS_TEXT;
+    FILE *trace_file = NULL;
+
+    int response = ssaudit_argparser(
+        argc, argv, &list_path, &threads, &verbose, &help, &stats, &format, &trace_file);
+    if (response != 0 || (optind == argc && list_path == NULL)) {
+        if (help || response == 0) {
+            print_help();
+        }
+        check_null_and_close(trace_file);
+        return -1;
+    }
+
+    if (stats) {
+        stats_enable();
+    }
+    if (trace_file != NULL) {
+        trace_enable();
+    }
+
+    key_list keys = { 0 };
+    uint64_t start = stats_now();
+    bool listed = list_path == NULL || add_list(&keys, list_path);
+    for (int i = optind; i < argc; i++) {
+        add_path(&keys, argv[i]);
+    }
+    stats_add_time(STATS_IO_NS, start);
+
+    int status = -2;
+    if (listed && keys.count > 0) {
+        mpz_t *gcds = (mpz_t *) malloc(keys.count * sizeof(mpz_t));
+        for (size_t i = 0; i < keys.count; i++) {
+            mpz_init(gcds[i]);
+        }
+        work_pool *pool = threads > 1 ? work_pool_create(threads) : NULL;
+
+        start = stats_now();
+        batch_gcd(gcds, keys.moduli, keys.count, pool);
+        stats_add_time(STATS_ARITH_NS, start);
+
+        size_t weak = report(&keys, gcds, verbose);
+        printf("%zu keys audited, %zu share factors, %llu unreadable\n", keys.count, weak,
+            (unsigned long long) keys.unreadable);
+        status = weak == 0 ? 0 : 1;
+
+        work_pool_delete(&pool);
+        for (size_t i = 0; i < keys.count; i++) {
+            mpz_clear(gcds[i]);
+        }
+        free(gcds);
+    } else if (listed) {
+        printf("No public keys could be read\n");
+    }
+    clear_keys(&keys);
+
+    if (stats) {
+        stats_report(stderr, "ssaudit", format);
+    }
+    if (trace_file != NULL) {
+        trace_write(trace_file);
+        fclose(trace_file);
+    }
+    return status;
+}
+
+/*
+    Parses the audit's options, the key files and directories are left from optind on.
+    Returns non-zero if failed.
+*/
+int ssaudit_argparser(int argc, char **argv, const char **list_path, uint32_t *threads,
+    bool *verbose, bool *help, bool *stats, stats_format *format, FILE **trace_file) {
+    struct option long_options[]
+        = { STATS_LONG_OPTION, TRACE_LONG_OPTION, { NULL, 0, NULL, 0 } };
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, SSAUDIT_OPTIONS, long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'l': *list_path = optarg; break;
+        case 't':
+            *threads = (uint32_t) strtoul(optarg, NULL, 10);
+            if (*threads == 0) {
+                printf("Please enter a positive number of threads\n");
+                return 1;
+            }
+            break;
+        case 'S':
+            *stats = true;
+            if (!stats_parse_format(optarg, format)) {
+                printf("Please enter text or json for --stats\n");
+                return 2;
+            }
+            break;
+        case 'T':
+            if (!open_file(trace_file, optarg, "w")) {
+                return 3;
+            }
+            break;
+        case 'v': *verbose = true; break;
+        case 'h': *help = true; return 4;
+        default: *help = true; return 5;
+        }
+    }
+    return 0;
+}
+
+/*
+    Reads the public key at path, text or binary, and appends it. A key that cannot be
+    read is reported and counted. Returns false if out of memory.
+*/
+bool add_key(key_list *keys, const char *path) {
+    FILE *pbfile = fopen(path, "r");
+    struct stat info;
+    if (pbfile == NULL || fstat(fileno(pbfile), &info) != 0) {
+        printf("%s: No such file or directory\n", path);
+        check_null_and_close(pbfile);
+        keys->unreadable++;
+        return true;
+    }
+    stats_add(STATS_BYTES_IN, (uint64_t) info.st_size);
+
+    if (keys->count == keys->capacity) {
+        size_t grown = keys->capacity == 0 ? AUDIT_INITIAL_KEYS : 2 * keys->capacity;
+        char **paths = (char **) realloc(keys->paths, grown * sizeof(char *));
+        if (paths != NULL) {
+            keys->paths = paths;
+        }
+        mpz_t *moduli = (mpz_t *) realloc(keys->moduli, grown * sizeof(mpz_t));
+        if (moduli != NULL) {
+            keys->moduli = moduli;
+        }
+        if (paths == NULL || moduli == NULL) {
+            fclose(pbfile);
+            return false;
+        }
+        keys->capacity = grown;
+    }
+    //A username can be no longer than the file, ss_read_pub does not bound it
+    if (keys->username_size < (size_t) info.st_size + 1) {
+        free(keys->username);
+        keys->username_size = (size_t) info.st_size + 1;
+        keys->username = (char *) malloc(keys->username_size);
+        if (keys->username == NULL) {
+            keys->username_size = 0;
+            fclose(pbfile);
+            return false;
+        }
+    }
+
+    mpz_t *n = &keys->moduli[keys->count];
+    mpz_init(*n);
+    if (keyfile_detect(pbfile)) {
+        ss_pub_ctx ctx;
+        if (keyfile_read_pub(pbfile, &ctx, keys->username, keys->username_size)) {
+            mpz_set(*n, ctx.n);
+            ss_pub_ctx_clear(&ctx);
+        }
+    } else {
+        ss_read_pub(*n, keys->username, pbfile);
+    }
+    fclose(pbfile);
+
+    if (mpz_cmp_ui(*n, 1) <= 0) {
+        printf("%s: Error reading the public key\n", path);
+        mpz_clear(*n);
+        keys->unreadable++;
+        return true;
+    }
+    keys->paths[keys->count] = strdup(path);
+    if (keys->paths[keys->count] == NULL) {
+        mpz_clear(*n);
+        return false;
+    }
+    keys->count++;
+    return true;
+}
+
+/*
+    Adds the key at path, or every regular file directly inside it if it is a directory.
+*/
+void add_path(key_list *keys, const char *path) {
+    struct stat info;
+    if (stat(path, &info) != 0 || !S_ISDIR(info.st_mode)) {
+        if (!add_key(keys, path)) {
+            printf("Out of memory reading %s\n", path);
+        }
+        return;
+    }
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        printf("%s: No such file or directory\n", path);
+        return;
+    }
+    size_t path_len = strlen(path);
+    struct dirent *entry;
+    bool ok = true;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        size_t name_len = strlen(entry->d_name);
+        char *file = (char *) malloc(path_len + name_len + 2);
+        if (file == NULL) {
+            ok = false;
+            break;
+        }
+        memcpy(file, path, path_len);
+        file[path_len] = '/';
+        memcpy(file + path_len + 1, entry->d_name, name_len + 1);
+        if (stat(file, &info) == 0 && S_ISREG(info.st_mode)) {
+            ok = add_key(keys, file);
+        }
+        free(file);
+    }
+    closedir(dir);
+    if (!ok) {
+        printf("Out of memory reading %s\n", path);
+    }
+    return;
+}
+
+/*
+    Adds the key or directory named on every non-empty line of the list at list_path,
+    - for stdin. Returns false if the list cannot be opened.
+*/
+bool add_list(key_list *keys, const char *list_path) {
+    FILE *list = strcmp(list_path, "-") == 0 ? stdin : fopen(list_path, "r");
+    if (list == NULL) {
+        printf("%s: No such file or directory\n", list_path);
+        return false;
+    }
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    while ((len = getline(&line, &line_size, list)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len > 0) {
+            add_path(keys, line);
+        }
+    }
+    free(line);
+    if (list != stdin) {
+        fclose(list);
+    }
+    return true;
+}
+
+void clear_keys(key_list *keys) {
+    for (size_t i = 0; i < keys->count; i++) {
+        free(keys->paths[i]);
+        mpz_clear(keys->moduli[i]);
+    }
+    free(keys->paths);
+    free(keys->moduli);
+    free(keys->username);
+    *keys = (key_list) { 0 };
+    return;
+}
+
+/*
+    Lists every key whose gcd with the others is not 1, and unless there are too many,
+    the keys each one shares a factor with. With n = p^2 * q a shared factor is p, p^2,
+    q or a product of them, each of which factors the key. A gcd of n itself means the
+    same modulus was issued twice or all of its primes were.
+    Returns the number of such keys.
+*/
+size_t report(const key_list *keys, mpz_t *gcds, bool verbose) {
+    size_t *weak = (size_t *) malloc(keys->count * sizeof(size_t));
+    size_t count = 0;
+    for (size_t i = 0; i < keys->count; i++) {
+        if (mpz_cmp_ui(gcds[i], 1) == 0) {
+            continue;
+        }
+        if (weak != NULL) {
+            weak[count] = i;
+        }
+        count++;
+        if (mpz_cmp(gcds[i], keys->moduli[i]) == 0) {
+            printf("%s: every factor is shared, the modulus was issued twice or its "
+                   "primes were\n",
+                keys->paths[i]);
+        } else {
+            printf("%s: shares a factor of %zu bits\n", keys->paths[i],
+                mpz_sizeinbase(gcds[i], 2));
+        }
+        if (verbose) {
+            gmp_printf("  gcd = %Zx\n", gcds[i]);
+        }
+    }
+
+    if (weak != NULL && count > 1 && count <= AUDIT_MAX_PAIRWISE) {
+        mpz_t g;
+        mpz_init(g);
+        for (size_t a = 0; a < count; a++) {
+            for (size_t b = a + 1; b < count; b++) {
+                mpz_gcd(g, keys->moduli[weak[a]], keys->moduli[weak[b]]);
+                if (mpz_cmp_ui(g, 1) != 0) {
+                    printf("%s and %s share a factor of %zu bits\n", keys->paths[weak[a]],
+                        keys->paths[weak[b]], mpz_sizeinbase(g, 2));
+                }
+            }
+        }
+        mpz_clear(g);
+    }
+    free(weak);
+    return count;
+}
+
+/*
+    Help statement
+*/
+void print_help(void) {
+    printf("SYNOPSIS\n"
+           "   Audits SS public keys for prime factors shared between keys, which let\n"
+           "   anyone factor them. All keys are checked at once with a batch GCD.\n\n"
+
+           "USAGE\n"
+           "   ./ssaudit [OPTIONS] [pbfile | directory]...\n\n"
+
+           "OPTIONS\n"
+           "   -h              Display program help and usage.\n"
+           "   -v              Also print every shared factor found.\n"
+           "   -l list         Also audit the key files and directories named one per\n"
+           "                   line in list, - for stdin.\n"
+           "   -t threads      Worker threads for the product and remainder trees\n"
+           "                   (default: 1).\n"
+           "   --stats[=fmt]   Print operation counters, I/O and arithmetic time and\n"
+           "                   throughput to stderr, fmt is text (default) or json.\n"
+           "   --trace=file    Write a Chrome trace event timeline to file.\n\n"
+
+           "EXIT STATUS\n"
+           "   0 if no key shares a factor, 1 if some do, negative on errors.\n");
+}
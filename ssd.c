@@ -0,0 +1,811 @@
+#include "argparser.h"
+#include "ss.h"
+#include "ssd.h"
+#include "container.h"
+#include "keyfile.h"
+#include "pool.h"
+#include "gmpalloc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#define SSD_OPTIONS "s:n:d:t:mvh"
+
+#define SSD_MAX_KEYS    16
+#define SSD_MAX_CLIENTS 1024
+
+//Blocks one client may add to a round, so a large request cannot hold up the others
+#define SSD_ROUND_BLOCKS 256
+
+//A client is not read from while it has this many requests or bytes queued, so a
+//client that sends faster than it is served blocks in its own writes
+#define SSD_MAX_PENDING 64
+#define SSD_MAX_QUEUED  (8u << 20)
+
+//Bytes read from a client at a time, grown for larger requests
+#define SSD_READ_SIZE (1u << 16)
+
+//A request from receipt to the last byte of its response
+typedef struct ssd_request {
+    uint8_t op;
+    uint8_t key;
+    uint8_t *body; //op, key and payload as received
+    const uint8_t *payload;
+    size_t length; //Bytes in payload
+    container_header header; //Decrypt only
+    size_t blocks; //Blocks to run
+    size_t done; //Blocks run so far
+    uint8_t *response; //Header, status and payload
+    size_t response_len; //Bytes of response built so far
+    size_t sent;
+    bool ready; //Response complete
+    struct ssd_request *next;
+} ssd_request;
+
+typedef struct {
+    int fd;
+    uint8_t *in; //Received bytes not yet parsed into requests
+    size_t in_len;
+    size_t in_cap;
+    ssd_request *head, *tail;
+    size_t pending; //Requests queued
+    size_t queued; //Bytes held by queued requests and their responses
+    size_t taken; //Blocks added to the current round
+    bool eof; //Dropped once every response is sent
+    bool failed; //Dropped right away
+} ssd_client;
+
+//Where a block of a round came from
+typedef struct {
+    ssd_request *request;
+    size_t index;
+} block_origin;
+
+typedef struct {
+    ss_pub_ctx pub[SSD_MAX_KEYS];
+    uint32_t pubs;
+    ss_priv_ctx priv[SSD_MAX_KEYS];
+    uint32_t privs;
+    ss_file_opts opts;
+    work_pool *pool;
+    int listen_fd;
+    ssd_client *clients[SSD_MAX_CLIENTS];
+    size_t client_count;
+    mpz_t *blocks; //Blocks of the current round
+    block_origin *origins;
+    size_t capacity;
+    uint8_t *plain; //Export buffer for decrypted blocks
+    bool verbose;
+} ssd_server;
+
+volatile sig_atomic_t ssd_stop = 0;
+
+//Helper functions not in header file
+int ssd_argparser(int argc, char **argv, const char **socket_path, const char **pbnames,
+    uint32_t *pubs, const char **pvnames, uint32_t *privs, bool *verbose, bool *help,
+    bool *pool_alloc, bool *stats, stats_format *format, ss_file_opts *opts);
+bool load_pub(ss_pub_ctx *ctx, const char *name);
+bool load_priv(ss_priv_ctx *ctx, const char *name);
+int open_socket(const char *path);
+void handle_signal(int signal);
+void serve(ssd_server *server);
+void accept_clients(ssd_server *server);
+bool accepts_input(const ssd_client *client);
+void read_client(ssd_server *server, ssd_client *client);
+void parse_requests(ssd_server *server, ssd_client *client);
+void start_request(ssd_server *server, ssd_client *client, uint8_t *body, size_t size);
+void finish_request(ssd_request *request, ssd_status status);
+void write_client(ssd_client *client);
+void free_request(ssd_request *request);
+void drop_client(ssd_server *server, size_t index);
+bool has_work(const ssd_server *server);
+void run_round(ssd_server *server);
+size_t gather_blocks(ssd_server *server, uint8_t op, uint8_t key);
+void scatter_blocks(ssd_server *server, size_t count, uint8_t op, uint8_t key);
+bool reserve_blocks(ssd_server *server, size_t count);
+void put_be32(uint8_t *buffer, uint32_t value);
+void print_help(void);
+
+/*
+    Main function for execution.
+    Arguments are parsed, the keys are loaded once and requests are served until
+    SIGINT or SIGTERM.
+*/
+int main(int argc, char **argv) {
+    bool help = false;
+    bool verbose = false;
+    bool pool_alloc = false;
+    bool stats = false;
+    stats_format format = STATS_TEXT;
+    const char *socket_path = SSD_DEFAULT_SOCKET;
+    const char *pbnames[SSD_MAX_KEYS];
+    const char *pvnames[SSD_MAX_KEYS];
+    uint32_t pubs = 0;
+    uint32_t privs = 0;
+    ss_file_opts opts = { .threads = 1 };
+
+    int response = ssd_argparser(argc, argv, &socket_path, pbnames, &pubs, pvnames, &privs,
+        &verbose, &help, &pool_alloc, &stats, &format, &opts);
+    if (response != 0) {
+        if (help) {
+            print_help();
+        }
+        return -1;
+    }
+    if (pubs == 0 && privs == 0) {
+        pbnames[pubs++] = "ss.pub";
+        pvnames[privs++] = "ss.priv";
+    }
+
+    if (pool_alloc) {
+        gmpalloc_init(GMPALLOC_POOL); //Before GMP allocates anything
+    }
+    if (stats) {
+        stats_enable();
+    }
+
+    ssd_server *server = (ssd_server *) calloc(1, sizeof(ssd_server));
+    server->opts = opts;
+    server->verbose = verbose;
+    size_t plain_size = 1;
+    bool loaded = true;
+    for (uint32_t i = 0; loaded && i < pubs; i++) {
+        loaded = load_pub(&server->pub[i], pbnames[i]);
+        server->pubs += loaded ? 1 : 0;
+    }
+    for (uint32_t i = 0; loaded && i < privs; i++) {
+        loaded = load_priv(&server->priv[i], pvnames[i]);
+        server->privs += loaded ? 1 : 0;
+        if (loaded) {
+            size_t size = (mpz_sizeinbase(server->priv[i].pq, 2) + 7) / 8;
+            plain_size = size > plain_size ? size : plain_size;
+        }
+    }
+
+    int status = -2;
+    if (loaded) {
+        server->listen_fd = open_socket(socket_path);
+        if (server->listen_fd >= 0) {
+            server->plain = (uint8_t *) malloc(plain_size);
+            server->pool = opts.threads > 1 ? work_pool_create(opts.threads) : NULL;
+            if (verbose) {
+                printf("ssd: serving %u public and %u private keys on %s\n", server->pubs,
+                    server->privs, socket_path);
+                fflush(stdout);
+            }
+            serve(server);
+            close(server->listen_fd);
+            unlink(socket_path);
+            status = 0;
+        }
+    }
+
+    while (server->client_count > 0) {
+        drop_client(server, server->client_count - 1);
+    }
+    for (size_t i = 0; i < server->capacity; i++) {
+        mpz_clear(server->blocks[i]);
+    }
+    free(server->blocks);
+    free(server->origins);
+    free(server->plain);
+    work_pool_delete(&server->pool);
+    for (uint32_t i = 0; i < server->pubs; i++) {
+        ss_pub_ctx_clear(&server->pub[i]);
+    }
+    for (uint32_t i = 0; i < server->privs; i++) {
+        ss_priv_ctx_clear(&server->priv[i]);
+    }
+    free(server);
+
+    if (pool_alloc) {
+        gmpalloc_print_stats(stderr, "ssd");
+    }
+    if (stats) {
+        stats_report(stderr, "ssd", format);
+    }
+    return status;
+}
+
+/*
+    Parses the daemon's arguments. -n and -d may be given up to SSD_MAX_KEYS times each.
+    Returns non-zero if failed.
+*/
+int ssd_argparser(int argc, char **argv, const char **socket_path, const char **pbnames,
+    uint32_t *pubs, const char **pvnames, uint32_t *privs, bool *verbose, bool *help,
+    bool *pool_alloc, bool *stats, stats_format *format, ss_file_opts *opts) {
+    struct option long_options[] = { STATS_LONG_OPTION, { NULL, 0, NULL, 0 } };
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, SSD_OPTIONS, long_options, NULL)) != -1) {
+        switch (opt) {
+        case 's': *socket_path = optarg; break;
+        case 'n':
+            if (*pubs == SSD_MAX_KEYS) {
+                printf("Please enter at most %d public keys\n", SSD_MAX_KEYS);
+                return 1;
+            }
+            pbnames[(*pubs)++] = optarg;
+            break;
+        case 'd':
+            if (*privs == SSD_MAX_KEYS) {
+                printf("Please enter at most %d private keys\n", SSD_MAX_KEYS);
+                return 2;
+            }
+            pvnames[(*privs)++] = optarg;
+            break;
+        case 't':
+            opts->threads = (uint32_t) strtoul(optarg, NULL, 10);
+            if (opts->threads == 0) {
+                printf("Please enter a positive number of threads\n");
+                return 3;
+            }
+            break;
+        case 'm': *pool_alloc = true; break;
+        case 'S':
+            *stats = true;
+            if (!stats_parse_format(optarg, format)) {
+                printf("Please enter text or json for --stats\n");
+                return 4;
+            }
+            break;
+        case 'v': *verbose = true; break;
+        case 'h': *help = true; return 5;
+        default: *help = true; return 6;
+        }
+    }
+    return 0;
+}
+
+/*
+    Loads a text or binary public key into ctx. Prints an error and returns false if failed.
+*/
+bool load_pub(ss_pub_ctx *ctx, const char *name) {
+    FILE *pbfile = NULL;
+    if (!open_file(&pbfile, name, "r")) {
+        return false;
+    }
+    char username[_POSIX_LOGIN_NAME_MAX];
+    memset(username, 0, _POSIX_LOGIN_NAME_MAX); //Clear username buffer
+    bool loaded = true;
+    if (keyfile_detect(pbfile)) {
+        loaded = keyfile_read_pub(pbfile, ctx, username, _POSIX_LOGIN_NAME_MAX);
+        if (!loaded) {
+            printf("%s: Error reading the binary public key.\n", name);
+        }
+    } else {
+        mpz_t n;
+        mpz_init(n);
+        ss_read_pub(n, username, pbfile);
+        ss_pub_ctx_init(ctx, n);
+        mpz_clear(n);
+    }
+    fclose(pbfile);
+    return loaded;
+}
+
+/*
+    Loads a text or binary private key into ctx, with its CRT components if it has them.
+    Prints an error and returns false if failed.
+*/
+bool load_priv(ss_priv_ctx *ctx, const char *name) {
+    FILE *pvfile = NULL;
+    if (!open_file(&pvfile, name, "r")) {
+        return false;
+    }
+    bool loaded = true;
+    if (keyfile_detect(pvfile)) {
+        loaded = keyfile_read_priv(pvfile, ctx);
+        if (!loaded) {
+            printf("%s: Error reading the binary private key.\n", name);
+        }
+    } else {
+        mpz_t d, pq, p, q, dp, dq, qinv;
+        mpz_inits(d, pq, p, q, dp, dq, qinv, NULL);
+        if (ss_read_priv_crt(pq, d, p, q, dp, dq, qinv, pvfile)) {
+            ss_priv_ctx_init_crt(ctx, pq, d, p, q, dp, dq, qinv);
+        } else {
+            ss_priv_ctx_init(ctx, pq, d);
+        }
+        mpz_clears(d, pq, p, q, dp, dq, qinv, NULL);
+    }
+    fclose(pvfile);
+    return loaded;
+}
+
+/*
+    Binds a non-blocking listening socket at path, only accessible to the daemon's user
+    since it hands out the private keys' work. A stale socket left at path is replaced.
+    Returns the socket, -1 with an error printed if failed.
+*/
+int open_socket(const char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("%s: Socket path too long\n", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    struct stat info;
+    if (lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(path);
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(0077);
+    bool bound = fd >= 0 && bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+    umask(mask);
+    if (!bound || listen(fd, SOMAXCONN) != 0 || fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+        printf("%s: %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+
+    struct sigaction action = { .sa_handler = handle_signal }; //No SA_RESTART, poll returns
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    return fd;
+}
+
+void handle_signal(int signal) {
+    (void) signal;
+    ssd_stop = 1;
+    return;
+}
+
+/*
+    Event loop: polls the listening socket and every client, reads and writes whatever
+    is ready, then runs one round over the blocks waiting in all clients' requests.
+    Polling does not wait while there is work left, so requests that arrive during a
+    round join the next one.
+*/
+void serve(ssd_server *server) {
+    struct pollfd *fds = (struct pollfd *) calloc(SSD_MAX_CLIENTS + 1, sizeof(struct pollfd));
+    while (!ssd_stop) {
+        fds[0] = (struct pollfd) { .fd = server->listen_fd,
+            .events = server->client_count < SSD_MAX_CLIENTS ? POLLIN : 0 };
+        for (size_t i = 0; i < server->client_count; i++) {
+            ssd_client *client = server->clients[i];
+            short events = accepts_input(client) ? POLLIN : 0;
+            if (client->head != NULL && client->head->ready) {
+                events |= POLLOUT;
+            }
+            fds[i + 1] = (struct pollfd) { .fd = client->fd, .events = events };
+        }
+
+        size_t polled = server->client_count;
+        if (poll(fds, polled + 1, has_work(server) ? 0 : -1) < 0 && errno != EINTR) {
+            printf("ssd: poll: %s\n", strerror(errno));
+            break;
+        }
+
+        for (size_t i = 0; i < polled; i++) {
+            ssd_client *client = server->clients[i];
+            if (fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                read_client(server, client);
+            }
+            if (fds[i + 1].revents & POLLOUT) {
+                write_client(client);
+            }
+        }
+        for (size_t i = server->client_count; i > 0; i--) {
+            ssd_client *client = server->clients[i - 1];
+            if (client->failed || (client->eof && client->head == NULL)) {
+                drop_client(server, i - 1);
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            accept_clients(server);
+        }
+
+        run_round(server);
+        for (size_t i = 0; i < server->client_count; i++) {
+            write_client(server->clients[i]); //Most responses fit the socket buffer
+        }
+    }
+    free(fds);
+    return;
+}
+
+void accept_clients(ssd_server *server) {
+    while (server->client_count < SSD_MAX_CLIENTS) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            return; //EAGAIN once the backlog is empty
+        }
+        ssd_client *client = (ssd_client *) calloc(1, sizeof(ssd_client));
+        if (client == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) != 0) {
+            free(client);
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        server->clients[server->client_count++] = client;
+    }
+    return;
+}
+
+/*
+    Backpressure: a client is read from only while it has room for more requests.
+*/
+bool accepts_input(const ssd_client *client) {
+    return !client->eof && !client->failed && client->pending < SSD_MAX_PENDING
+           && client->queued < SSD_MAX_QUEUED;
+}
+
+/*
+    Reads what the client sent and turns every complete request into a queued request.
+*/
+void read_client(ssd_server *server, ssd_client *client) {
+    if (!accepts_input(client)) {
+        return;
+    }
+    if (client->in_cap - client->in_len < SSD_READ_SIZE / 2) {
+        size_t grown = client->in_cap < SSD_READ_SIZE ? SSD_READ_SIZE : 2 * client->in_cap;
+        uint8_t *in = (uint8_t *) realloc(client->in, grown);
+        if (in == NULL) {
+            client->failed = true;
+            return;
+        }
+        client->in = in;
+        client->in_cap = grown;
+    }
+    ssize_t got = recv(client->fd, client->in + client->in_len, client->in_cap - client->in_len,
+        MSG_DONTWAIT);
+    if (got == 0) {
+        client->eof = true;
+    } else if (got < 0) {
+        client->failed = errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+    } else {
+        client->in_len += (size_t) got;
+        stats_add(STATS_BYTES_IN, (uint64_t) got);
+        parse_requests(server, client);
+    }
+    return;
+}
+
+/*
+    Splits the complete requests off the front of the client's input. A length out of
+    range fails the client, since nothing after it can be framed.
+*/
+void parse_requests(ssd_server *server, ssd_client *client) {
+    size_t pos = 0;
+    while (client->in_len - pos >= SSD_HEADER_SIZE) {
+        const uint8_t *frame = client->in + pos;
+        uint32_t size = ((uint32_t) frame[0] << 24) | ((uint32_t) frame[1] << 16)
+                        | ((uint32_t) frame[2] << 8) | (uint32_t) frame[3];
+        if (size < SSD_REQUEST_EXTRA || size > SSD_MAX_MESSAGE + SSD_REQUEST_EXTRA) {
+            client->failed = true;
+            return;
+        }
+        if (client->in_len - pos - SSD_HEADER_SIZE < size) {
+            break;
+        }
+        uint8_t *body = (uint8_t *) malloc(size);
+        if (body == NULL) {
+            client->failed = true;
+            return;
+        }
+        memcpy(body, frame + SSD_HEADER_SIZE, size);
+        start_request(server, client, body, size);
+        pos += SSD_HEADER_SIZE + size;
+    }
+    memmove(client->in, client->in + pos, client->in_len - pos);
+    client->in_len -= pos;
+    return;
+}
+
+/*
+    Queues a request and sets up its response. Requests that are invalid or have no
+    blocks are answered right away.
+*/
+void start_request(ssd_server *server, ssd_client *client, uint8_t *body, size_t size) {
+    ssd_request *request = (ssd_request *) calloc(1, sizeof(ssd_request));
+    request->op = body[0];
+    request->key = body[1];
+    request->body = body;
+    request->payload = body + SSD_REQUEST_EXTRA;
+    request->length = size - SSD_REQUEST_EXTRA;
+
+    ssd_status status = SSD_OK;
+    size_t response_size = SSD_HEADER_SIZE + 1;
+    if (request->op == SSD_ENCRYPT) {
+        if (request->key >= server->pubs) {
+            status = SSD_BAD_KEY;
+        } else {
+            ss_pub_ctx *ctx = &server->pub[request->key];
+            request->blocks = (request->length + ctx->k - 2) / (ctx->k - 1);
+            request->header = (container_header) { .version = CONTAINER_VERSION,
+                .width = ctx->width,
+                .blocks = request->blocks };
+            response_size += CONTAINER_HEADER_SIZE + request->blocks * ctx->width;
+        }
+    } else if (request->op == SSD_DECRYPT) {
+        container_header *header = &request->header;
+        size_t used = request->length == 0
+                          ? 0
+                          : container_decode_header(request->payload, request->length, header);
+        if (request->key >= server->privs) {
+            status = SSD_BAD_KEY;
+        } else if (request->length > 0
+                   && (used != CONTAINER_HEADER_SIZE || header->hybrid || header->indexed
+                       || (request->length - used) % header->width != 0
+                       || (header->blocks != CONTAINER_BLOCKS_UNKNOWN
+                           && header->blocks != (request->length - used) / header->width))) {
+            status = SSD_BAD_CONTAINER;
+        } else {
+            request->blocks = request->length == 0 ? 0 : (request->length - used) / header->width;
+            response_size += request->blocks * (server->priv[request->key].k - 1);
+        }
+    } else {
+        status = SSD_BAD_OP;
+    }
+
+    request->response = (uint8_t *) malloc(status == SSD_OK ? response_size : SSD_HEADER_SIZE + 1);
+    request->response_len = SSD_HEADER_SIZE + 1;
+    if (status == SSD_OK && request->op == SSD_ENCRYPT) {
+        request->response_len += container_encode_header(
+            &request->header, request->response + request->response_len);
+    }
+    if (status != SSD_OK || request->blocks == 0) {
+        finish_request(request, status);
+    }
+
+    if (client->tail == NULL) {
+        client->head = request;
+    } else {
+        client->tail->next = request;
+    }
+    client->tail = request;
+    client->pending++;
+    client->queued += size + response_size;
+    return;
+}
+
+/*
+    Fills in the response header. Failed requests answer with the status alone.
+*/
+void finish_request(ssd_request *request, ssd_status status) {
+    if (status != SSD_OK) {
+        request->response_len = SSD_HEADER_SIZE + 1;
+    }
+    put_be32(request->response, (uint32_t) (request->response_len - SSD_HEADER_SIZE));
+    request->response[SSD_HEADER_SIZE] = (uint8_t) status;
+    request->ready = true;
+    return;
+}
+
+/*
+    Sends the finished responses at the front of the client's queue until the socket is full.
+*/
+void write_client(ssd_client *client) {
+    while (!client->failed && client->head != NULL && client->head->ready) {
+        ssd_request *request = client->head;
+        ssize_t sent = send(client->fd, request->response + request->sent,
+            request->response_len - request->sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent < 0) {
+            client->failed = errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR;
+            return;
+        }
+        request->sent += (size_t) sent;
+        stats_add(STATS_BYTES_OUT, (uint64_t) sent);
+        if (request->sent < request->response_len) {
+            return;
+        }
+        client->head = request->next;
+        if (client->head == NULL) {
+            client->tail = NULL;
+        }
+        client->pending--;
+        client->queued = client->pending == 0 ? 0 : client->queued - (request->length
+                                                        + SSD_REQUEST_EXTRA + request->response_len);
+        free_request(request);
+    }
+    return;
+}
+
+void free_request(ssd_request *request) {
+    free(request->body);
+    free(request->response);
+    free(request);
+    return;
+}
+
+/*
+    Closes a client and frees its requests, the last client takes its slot.
+*/
+void drop_client(ssd_server *server, size_t index) {
+    ssd_client *client = server->clients[index];
+    while (client->head != NULL) {
+        ssd_request *next = client->head->next;
+        free_request(client->head);
+        client->head = next;
+    }
+    close(client->fd);
+    free(client->in);
+    free(client);
+    server->clients[index] = server->clients[--server->client_count];
+    return;
+}
+
+bool has_work(const ssd_server *server) {
+    for (size_t i = 0; i < server->client_count; i++) {
+        for (ssd_request *r = server->clients[i]->head; r != NULL; r = r->next) {
+            if (!r->ready) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+    Runs up to SSD_ROUND_BLOCKS blocks of every client, oldest requests first. Blocks of
+    the same op and key are exponentiated together whichever client they came from, so
+    small requests from many clients fill the batch engine's lanes and the workers.
+*/
+void run_round(ssd_server *server) {
+    for (size_t i = 0; i < server->client_count; i++) {
+        server->clients[i]->taken = 0;
+    }
+    for (uint8_t key = 0; key < server->pubs; key++) {
+        size_t count = gather_blocks(server, SSD_ENCRYPT, key);
+        if (count > 0) {
+            uint64_t start = stats_now();
+            ss_encrypt_blocks(server->blocks, count, &server->pub[key], server->pool, &server->opts);
+            stats_add_time(STATS_ARITH_NS, start);
+            scatter_blocks(server, count, SSD_ENCRYPT, key);
+        }
+    }
+    for (uint8_t key = 0; key < server->privs; key++) {
+        size_t count = gather_blocks(server, SSD_DECRYPT, key);
+        if (count > 0) {
+            uint64_t start = stats_now();
+            ss_decrypt_blocks(
+                server->blocks, count, &server->priv[key], server->pool, &server->opts);
+            stats_add_time(STATS_ARITH_NS, start);
+            scatter_blocks(server, count, SSD_DECRYPT, key);
+        }
+    }
+    return;
+}
+
+/*
+    Imports the next blocks of every unfinished request for op and key into the round,
+    within each client's share. Plaintext is prefixed with 0xFF like read_blocks does.
+    Returns the number of blocks gathered.
+*/
+size_t gather_blocks(ssd_server *server, uint8_t op, uint8_t key) {
+    size_t count = 0;
+    for (size_t i = 0; i < server->client_count; i++) {
+        ssd_client *client = server->clients[i];
+        for (ssd_request *r = client->head; r != NULL && client->taken < SSD_ROUND_BLOCKS;
+             r = r->next) {
+            if (r->ready || r->op != op || r->key != key) {
+                continue;
+            }
+            size_t take = r->blocks - r->done;
+            take = take < SSD_ROUND_BLOCKS - client->taken ? take : SSD_ROUND_BLOCKS - client->taken;
+            if (!reserve_blocks(server, count + take)) {
+                return count;
+            }
+            for (size_t b = r->done; b < r->done + take; b++) {
+                if (op == SSD_ENCRYPT) {
+                    size_t k = server->pub[key].k;
+                    size_t pos = b * (k - 1);
+                    size_t len = r->length - pos < k - 1 ? r->length - pos : k - 1;
+                    mpz_import(server->blocks[count], len, 1, sizeof(uint8_t), 1, 0, r->payload + pos);
+                    for (size_t bit = 8 * len; bit < 8 * len + 8; bit++) {
+                        mpz_setbit(server->blocks[count], bit); //Prepend 0xFF byte
+                    }
+                } else {
+                    const uint8_t *block = r->payload + CONTAINER_HEADER_SIZE + b * r->header.width;
+                    container_import_block(server->blocks[count], block, r->header.width);
+                }
+                server->origins[count++] = (block_origin) { .request = r, .index = b };
+            }
+            client->taken += take;
+        }
+    }
+    return count;
+}
+
+/*
+    Writes the round's results into their requests' responses and finishes the requests
+    that are complete. Blocks of a request come back in order, so decrypted plaintext,
+    whose length varies per block, is appended. Decrypted blocks must carry the 0xFF
+    marker and fit k bytes, everything after the marker is data like decrypt writes it.
+*/
+void scatter_blocks(ssd_server *server, size_t count, uint8_t op, uint8_t key) {
+    for (size_t i = 0; i < count; i++) {
+        ssd_request *r = server->origins[i].request;
+        if (r->ready) {
+            continue; //Already failed
+        }
+        if (op == SSD_ENCRYPT) {
+            uint32_t width = server->pub[key].width;
+            container_export_block(server->blocks[i], r->response + r->response_len, width);
+            r->response_len += width;
+        } else {
+            size_t size = 0;
+            mpz_export(server->plain, &size, 1, sizeof(uint8_t), 1, 0, server->blocks[i]);
+            if (size == 0 || size > server->priv[key].k || server->plain[0] != 0xFF) {
+                finish_request(r, SSD_BAD_CIPHERTEXT);
+                continue;
+            }
+            memcpy(r->response + r->response_len, server->plain + 1, size - 1);
+            r->response_len += size - 1;
+        }
+        r->done++;
+        if (r->done == r->blocks) {
+            finish_request(r, SSD_OK);
+        }
+    }
+    stats_add(STATS_BLOCKS, count);
+    return;
+}
+
+/*
+    Grows the round's block array to hold count blocks.
+*/
+bool reserve_blocks(ssd_server *server, size_t count) {
+    if (count <= server->capacity) {
+        return true;
+    }
+    size_t grown = count > 2 * server->capacity ? count : 2 * server->capacity;
+    mpz_t *blocks = (mpz_t *) realloc(server->blocks, grown * sizeof(mpz_t));
+    if (blocks == NULL) {
+        return false;
+    }
+    server->blocks = blocks;
+    block_origin *origins = (block_origin *) realloc(server->origins, grown * sizeof(block_origin));
+    if (origins == NULL) {
+        return false;
+    }
+    server->origins = origins;
+    for (size_t i = server->capacity; i < grown; i++) {
+        mpz_init(server->blocks[i]);
+    }
+    server->capacity = grown;
+    return true;
+}
+
+void put_be32(uint8_t *buffer, uint32_t value) {
+    buffer[0] = (uint8_t) (value >> 24);
+    buffer[1] = (uint8_t) (value >> 16);
+    buffer[2] = (uint8_t) (value >> 8);
+    buffer[3] = (uint8_t) value;
+    return;
+}
+
+/*
+    Help statement
+*/
+void print_help(void) {
+    printf("SYNOPSIS\n"
+           "   Serves SS encryption and decryption requests over a UNIX socket.\n"
+           "   The keys are loaded once, blocks of concurrent requests are\n"
+           "   exponentiated together. See ssd.h for the protocol.\n\n"
+
+           "USAGE\n"
+           "   ./ssd [OPTIONS]\n\n"
+
+           "OPTIONS\n"
+           "   -h              Display program help and usage.\n"
+           "   -v              Display verbose program output.\n"
+           "   -s socket       Socket path (default: ss.sock).\n"
+           "   -n pbfile       Public key file, text or binary, may be repeated. Keys are\n"
+           "                   numbered from 0 in order (default: ss.pub and ss.priv).\n"
+           "   -d pvfile       Private key file, text or binary, may be repeated.\n"
+           "   -t threads      Worker threads for each round of blocks (default: 1).\n"
+           "   -m              Use the pooled GMP allocator and print allocation\n"
+           "                   statistics to stderr on exit.\n"
+           "   --stats[=fmt]   Print operation counters, I/O and arithmetic time and\n"
+           "                   throughput to stderr on exit, fmt is text (default) or json.\n");
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+//
+// Protocol of the ssd daemon, spoken over a UNIX stream socket. A client sends any
+// number of requests and gets one response per request, in the order it sent them.
+// All integers are big-endian.
+//
+// Request:
+//  length:  4 bytes, bytes that follow, at least 2 and at most SSD_MAX_MESSAGE + 2
+//  op:      1 byte, SSD_ENCRYPT or SSD_DECRYPT
+//  key:     1 byte, index of the key in the order the daemon was given them, counted
+//           separately for public (-n) and private (-d) keys
+//  payload: length - 2 bytes
+//
+// Response:
+//  length:  4 bytes, bytes that follow, at least 1
+//  status:  1 byte, an ssd_status
+//  payload: length - 1 bytes, empty unless status is SSD_OK
+//
+// SSD_ENCRYPT takes plaintext and returns it encrypted as a binary container exactly as
+// encrypt writes it (see container.h), SSD_DECRYPT takes a binary container from ssd or
+// encrypt and returns the plaintext. Hex, indexed and hybrid ciphertext is not accepted.
+//
+// A request with a length out of range ends the connection, everything else is answered.
+//
+
+#define SSD_MAX_MESSAGE   (1u << 20)
+#define SSD_HEADER_SIZE   4
+#define SSD_REQUEST_EXTRA 2
+#define SSD_DEFAULT_SOCKET "ss.sock"
+
+typedef enum { SSD_ENCRYPT = 1, SSD_DECRYPT = 2 } ssd_op;
+
+typedef enum {
+    SSD_OK = 0,
+    SSD_BAD_OP, //Unknown op
+    SSD_BAD_KEY, //No key with that index for the op
+    SSD_BAD_CONTAINER, //Decrypt payload is no binary container or not a whole one
+    SSD_BAD_CIPHERTEXT //A block does not decrypt to a framed block, wrong key or modified
+} ssd_status;
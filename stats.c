@@ -0,0 +1,104 @@
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+atomic_bool stats_on = false;
+_Atomic uint64_t stats_counters[STATS_COUNTERS];
+uint64_t stats_start = 0;
+
+//Names in the report, in stats_counter order
+const char *stats_names[STATS_COUNTERS] = {
+    "prime_candidates",
+    "sieve_rejects",
+    "prime_test_rejects",
+    "mr_rounds",
+    "lucas_tests",
+    "modexps",
+    "blocks",
+    "chunks",
+    "bytes_in",
+    "bytes_out",
+    "io_ns",
+    "arith_ns",
+};
+
+//Helper functions not in header file
+uint64_t monotonic_ns(void);
+
+uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+void stats_enable(void) {
+    stats_start = monotonic_ns();
+    atomic_store(&stats_on, true);
+    return;
+}
+
+bool stats_enabled(void) {
+    return atomic_load_explicit(&stats_on, memory_order_relaxed);
+}
+
+void stats_add(stats_counter counter, uint64_t value) {
+    if (stats_enabled()) {
+        atomic_fetch_add_explicit(&stats_counters[counter], value, memory_order_relaxed);
+    }
+    return;
+}
+
+uint64_t stats_now(void) {
+    return stats_enabled() ? monotonic_ns() : 0;
+}
+
+void stats_add_time(stats_counter counter, uint64_t start) {
+    if (stats_enabled()) {
+        stats_add(counter, monotonic_ns() - start);
+    }
+    return;
+}
+
+uint64_t stats_get(stats_counter counter) {
+    return atomic_load_explicit(&stats_counters[counter], memory_order_relaxed);
+}
+
+void stats_report(FILE *out, const char *tool, stats_format format) {
+    double wall = (double) (monotonic_ns() - stats_start) / 1e9;
+    double mb_per_s = wall > 0 ? (double) stats_get(STATS_BYTES_IN) / 1e6 / wall : 0;
+    double blocks_per_s = wall > 0 ? (double) stats_get(STATS_BLOCKS) / wall : 0;
+
+    if (format == STATS_JSON) {
+        fprintf(out, "{ \"tool\": \"%s\", \"wall_s\": %.6f", tool, wall);
+        for (int i = 0; i < STATS_COUNTERS; i++) {
+            fprintf(out, ", \"%s\": %llu", stats_names[i],
+                (unsigned long long) stats_get((stats_counter) i));
+        }
+        fprintf(out, ", \"mb_per_s\": %.4f, \"blocks_per_s\": %.2f }\n", mb_per_s, blocks_per_s);
+        return;
+    }
+
+    fprintf(out, "%s statistics:\n", tool);
+    fprintf(out, "  %-20s %.6f\n", "wall_s", wall);
+    for (int i = 0; i < STATS_COUNTERS; i++) {
+        fprintf(out, "  %-20s %llu\n", stats_names[i],
+            (unsigned long long) stats_get((stats_counter) i));
+    }
+    fprintf(out, "  %-20s %.4f\n", "mb_per_s", mb_per_s);
+    fprintf(out, "  %-20s %.2f\n", "blocks_per_s", blocks_per_s);
+    return;
+}
+
+bool stats_parse_format(const char *arg, stats_format *format) {
+    if (arg == NULL || strcmp(arg, "text") == 0) {
+        *format = STATS_TEXT;
+        return true;
+    }
+    if (strcmp(arg, "json") == 0) {
+        *format = STATS_JSON;
+        return true;
+    }
+    return false;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Process wide counters for --stats. Everything is a no-op until stats_enable, so the
+// library can count unconditionally. Counters are relaxed atomics, hot loops add their
+// totals once per call rather than once per item.
+//
+//  STATS_PRIME_CANDIDATES:   numbers considered as primes by make_prime
+//  STATS_SIEVE_REJECTS:      candidates a small prime divides, never tested
+//  STATS_PRIME_TEST_REJECTS: candidates that failed Miller-Rabin or Baillie-PSW
+//  STATS_MR_ROUNDS:          Miller-Rabin rounds, including BPSW's base 2 round
+//  STATS_LUCAS_TESTS:        strong Lucas tests of BPSW
+//  STATS_MODEXPS:            modular exponentiations, one per lane of a batch
+//  STATS_BLOCKS:             SS blocks encrypted or decrypted
+//  STATS_CHUNKS:             hybrid chunks sealed or opened
+//  STATS_BYTES_IN:           bytes read from the input file
+//  STATS_BYTES_OUT:          bytes written to the output file
+//  STATS_IO_NS:              time spent reading and writing files
+//  STATS_ARITH_NS:           time spent in the arithmetic (and the AEAD) of the tools
+//
+typedef enum {
+    STATS_PRIME_CANDIDATES = 0,
+    STATS_SIEVE_REJECTS,
+    STATS_PRIME_TEST_REJECTS,
+    STATS_MR_ROUNDS,
+    STATS_LUCAS_TESTS,
+    STATS_MODEXPS,
+    STATS_BLOCKS,
+    STATS_CHUNKS,
+    STATS_BYTES_IN,
+    STATS_BYTES_OUT,
+    STATS_IO_NS,
+    STATS_ARITH_NS,
+    STATS_COUNTERS
+} stats_counter;
+
+typedef enum { STATS_TEXT = 0, STATS_JSON } stats_format;
+
+//
+// Starts counting and the wall clock the report measures throughput against.
+//
+void stats_enable(void);
+
+bool stats_enabled(void);
+
+void stats_add(stats_counter counter, uint64_t value);
+
+//
+// Monotonic nanoseconds, 0 while disabled. Pair with stats_add_time.
+//
+uint64_t stats_now(void);
+
+//
+// Adds the nanoseconds since start (from stats_now) to counter.
+//
+void stats_add_time(stats_counter counter, uint64_t start);
+
+uint64_t stats_get(stats_counter counter);
+
+//
+// Writes every counter, the wall time since stats_enable and the throughput over
+// the input bytes and blocks to out, as text or as one JSON object. tool names the
+// program in the report.
+//
+void stats_report(FILE *out, const char *tool, stats_format format);
+
+//
+// Parses the argument of --stats: NULL or "text" for STATS_TEXT, "json" for STATS_JSON.
+// Returns false for anything else.
+//
+bool stats_parse_format(const char *arg, stats_format *format);
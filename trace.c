@@ -0,0 +1,152 @@
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+//Spans a buffer starts with, it doubles when full
+#define TRACE_INITIAL_SPANS 1024
+
+typedef struct {
+    const char *name;
+    const char *arg_name;
+    uint64_t arg;
+    uint64_t start; //Nanoseconds since trace_enable
+    uint64_t duration;
+} trace_event;
+
+//Spans of one thread, linked into the list trace_write walks
+typedef struct trace_buffer {
+    trace_event *events;
+    size_t count;
+    size_t capacity;
+    uint32_t tid;
+    struct trace_buffer *next;
+} trace_buffer;
+
+atomic_bool trace_on = false;
+uint64_t trace_origin = 0;
+
+trace_buffer *trace_buffers = NULL;
+uint32_t trace_threads = 0;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+_Thread_local trace_buffer *local_buffer = NULL;
+
+//Helper functions not in header file
+uint64_t trace_clock(void);
+trace_buffer *get_local_buffer(void);
+
+uint64_t trace_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/*
+    Returns the calling thread's buffer, registering a new one on its first span.
+    NULL if there is no memory for it.
+*/
+trace_buffer *get_local_buffer(void) {
+    if (local_buffer != NULL) {
+        return local_buffer;
+    }
+    trace_buffer *buffer = (trace_buffer *) calloc(1, sizeof(trace_buffer));
+    if (buffer == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&trace_lock);
+    buffer->tid = trace_threads++;
+    buffer->next = trace_buffers;
+    trace_buffers = buffer;
+    pthread_mutex_unlock(&trace_lock);
+    local_buffer = buffer;
+    return buffer;
+}
+
+void trace_enable(void) {
+    trace_origin = trace_clock();
+    atomic_store(&trace_on, true);
+    get_local_buffer(); //Claims thread 0
+    return;
+}
+
+bool trace_enabled(void) {
+    return atomic_load_explicit(&trace_on, memory_order_relaxed);
+}
+
+uint64_t trace_begin(void) {
+    return trace_enabled() ? trace_clock() : 0;
+}
+
+void trace_span(const char *name, uint64_t start, const char *arg_name, uint64_t arg) {
+    if (!trace_enabled()) {
+        return;
+    }
+    uint64_t end = trace_clock();
+    trace_buffer *buffer = get_local_buffer();
+    if (buffer == NULL) {
+        return;
+    }
+    if (buffer->count == buffer->capacity) {
+        size_t capacity = buffer->capacity == 0 ? TRACE_INITIAL_SPANS : 2 * buffer->capacity;
+        trace_event *events
+            = (trace_event *) realloc(buffer->events, capacity * sizeof(trace_event));
+        if (events == NULL) {
+            return; //Drop the span rather than the trace
+        }
+        buffer->events = events;
+        buffer->capacity = capacity;
+    }
+    buffer->events[buffer->count++] = (trace_event) { .name = name,
+        .arg_name = arg_name,
+        .arg = arg,
+        .start = start - trace_origin,
+        .duration = end - start };
+    return;
+}
+
+bool trace_write(FILE *out) {
+    atomic_store(&trace_on, false);
+    long pid = (long) getpid();
+
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    for (trace_buffer *buffer = trace_buffers; buffer != NULL; buffer = buffer->next) {
+        //Timestamps and durations are in microseconds
+        if (buffer->tid == 0) {
+            fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":0,"
+                "\"args\":{\"name\":\"main\"}}", first ? "" : ",\n", pid);
+        } else {
+            fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%u,"
+                "\"args\":{\"name\":\"worker %u\"}}", first ? "" : ",\n", pid, buffer->tid,
+                buffer->tid);
+        }
+        first = false;
+        for (size_t i = 0; i < buffer->count; i++) {
+            trace_event *e = &buffer->events[i];
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%ld,\"tid\":%u,"
+                "\"ts\":%.3f,\"dur\":%.3f", e->name, pid, buffer->tid,
+                (double) e->start / 1e3, (double) e->duration / 1e3);
+            if (e->arg_name != NULL) {
+                fprintf(out, ",\"args\":{\"%s\":%llu}", e->arg_name, (unsigned long long) e->arg);
+            }
+            fputc('}', out);
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    pthread_mutex_lock(&trace_lock);
+    while (trace_buffers != NULL) {
+        trace_buffer *next = trace_buffers->next;
+        free(trace_buffers->events);
+        free(trace_buffers);
+        trace_buffers = next;
+    }
+    trace_threads = 0;
+    pthread_mutex_unlock(&trace_lock);
+    local_buffer = NULL;
+    return fflush(out) == 0 && !ferror(out);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+//
+// Timeline of spans for --trace, written as Chrome trace event JSON (chrome://tracing,
+// ui.perfetto.dev). Like the stats counters everything is a no-op until trace_enable.
+//
+// Every thread records into its own buffer, so recording takes no lock. Threads are
+// numbered in the order they record their first span, the thread that called
+// trace_enable is thread 0 and named "main" in the trace.
+//
+// Spans recorded by the library:
+//  read, import, exponentiate, export, write: stages of an SS block, arg "block"
+//  seal, open:                                 hybrid chunks, arg "chunk"
+//  file:                                       one file of a batch, arg "file"
+//  sieve_interval:                             one sieved interval of a prime search, arg "bits"
+//  is_prime:                                   one primality test of a candidate, arg "bits"
+//  product_tree, remainder_tree:              the two passes of a batch GCD, arg "keys"
+//
+
+//
+// Starts recording, timestamps are relative to this call.
+//
+void trace_enable(void);
+
+bool trace_enabled(void);
+
+//
+// Monotonic nanoseconds at the start of a span, 0 while disabled. Pair with trace_span.
+//
+uint64_t trace_begin(void);
+
+//
+// Records the span from start (from trace_begin) to now on the calling thread.
+//
+// Requires:
+//  name, arg_name: string literals, they are stored as pointers
+//  arg_name: NULL for a span without an argument
+//
+void trace_span(const char *name, uint64_t start, const char *arg_name, uint64_t arg);
+
+//
+// Writes every span recorded so far to out as one JSON object, then frees the buffers
+// and stops recording. No other thread may record while this runs.
+//
+// Returns false if writing failed.
+//
+bool trace_write(FILE *out);